@@ -0,0 +1,379 @@
+//                  _  _
+//  _   _|_ _  _|o_|__|_
+// (_||_||_(_)(_|| |  |
+//
+// automatic differentiation made easier in C++
+// https://github.com/autodiff/autodiff
+//
+// Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+//
+// Copyright © 2018–2024 Allan Leal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// C++ includes
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <type_traits>
+
+// autodiff includes
+#include <autodiff/common/meta.hpp>
+#include <autodiff/common/numbertraits.hpp>
+#include <autodiff/forward/real/real.hpp>
+
+namespace autodiff {
+namespace detail {
+
+/// Return the alignment of a packet of *W* values of type *T*: the largest power of two dividing its size, up to 64 bytes.
+template<typename T, size_t W>
+constexpr size_t PacketAlignment()
+{
+    size_t bytes = sizeof(T) * W;
+    size_t alignment = 1;
+    while(alignment < 64 && bytes % (2 * alignment) == 0)
+        alignment *= 2;
+    return alignment < alignof(T) ? alignof(T) : alignment;
+}
+
+/// A fixed-size packet of *W* numbers of type *T* on which every operation is applied lane-wise.
+/// A `Real<N, Packet<T, W>>` stores each Taylor coefficient of *W* independent Real numbers contiguously,
+/// so every step of the coefficient recurrences in real.hpp becomes a loop over *W* lanes that the compiler vectorizes.
+/// Comparisons mean "in all lanes": `x == y`, `x < y` etc. are true only if they hold in every lane, and `x != y` is
+/// `!(x == y)`, i.e. true if any lane differs. Code that needs a decision per lane builds a mask and uses @ref select,
+/// as the overloads of abs, min, max, sqrt, cbrt and pow for Real<N, Packet<T, W>> at the end of this file do.
+template<typename T, size_t W>
+struct alignas(PacketAlignment<T, W>()) Packet
+{
+    static_assert(std::is_arithmetic_v<T>);
+    static_assert(W > 0);
+
+    /// The value of the number in each lane.
+    std::array<T, W> lanes = {};
+
+    /// Construct a packet with all lanes equal to zero.
+    AUTODIFF_DEVICE_FUNC constexpr Packet()
+    {}
+
+    /// Construct a packet with all lanes equal to the given value.
+    template<typename U, Requires<std::is_arithmetic_v<U>> = true>
+    AUTODIFF_DEVICE_FUNC constexpr Packet(const U& value)
+    {
+        for(size_t k = 0; k < W; ++k) lanes[k] = static_cast<T>(value);
+    }
+
+    /// Construct a packet with given lane values.
+    AUTODIFF_DEVICE_FUNC constexpr Packet(const std::array<T, W>& values)
+    : lanes(values)
+    {}
+
+    AUTODIFF_DEVICE_FUNC constexpr auto operator[](size_t k) -> T& { return lanes[k]; }
+    AUTODIFF_DEVICE_FUNC constexpr auto operator[](size_t k) const -> const T& { return lanes[k]; }
+
+    AUTODIFF_DEVICE_FUNC constexpr auto operator+=(const Packet& y) -> Packet& { for(size_t k = 0; k < W; ++k) lanes[k] += y.lanes[k]; return *this; }
+    AUTODIFF_DEVICE_FUNC constexpr auto operator-=(const Packet& y) -> Packet& { for(size_t k = 0; k < W; ++k) lanes[k] -= y.lanes[k]; return *this; }
+    AUTODIFF_DEVICE_FUNC constexpr auto operator*=(const Packet& y) -> Packet& { for(size_t k = 0; k < W; ++k) lanes[k] *= y.lanes[k]; return *this; }
+    AUTODIFF_DEVICE_FUNC constexpr auto operator/=(const Packet& y) -> Packet& { for(size_t k = 0; k < W; ++k) lanes[k] /= y.lanes[k]; return *this; }
+};
+
+//=====================================================================================================================
+//
+// TYPE TRAITS
+//
+//=====================================================================================================================
+
+template<typename T>
+struct isPacketAux { constexpr static bool value = false; };
+
+template<typename T, size_t W>
+struct isPacketAux<Packet<T, W>> { constexpr static bool value = true; };
+
+template<typename T>
+constexpr bool isPacket = isPacketAux<PlainType<T>>::value;
+
+/// A packet is treated as an arithmetic type so that it can be used as the numeric type *T* of Real<N, T>.
+template<typename T, size_t W>
+struct ArithmeticTraits<Packet<T, W>>
+{
+    static constexpr bool isArithmetic = true;
+};
+
+//=====================================================================================================================
+//
+// ARITHMETIC OPERATORS
+//
+//=====================================================================================================================
+
+template<typename T, size_t W>
+AUTODIFF_DEVICE_FUNC constexpr auto operator+(const Packet<T, W>& x) { return x; }
+
+template<typename T, size_t W>
+AUTODIFF_DEVICE_FUNC constexpr auto operator-(const Packet<T, W>& x)
+{
+    Packet<T, W> res;
+    for(size_t k = 0; k < W; ++k) res[k] = -x[k];
+    return res;
+}
+
+template<typename T, size_t W> AUTODIFF_DEVICE_FUNC constexpr auto operator+(Packet<T, W> x, const Packet<T, W>& y) { return x += y; }
+template<typename T, size_t W> AUTODIFF_DEVICE_FUNC constexpr auto operator-(Packet<T, W> x, const Packet<T, W>& y) { return x -= y; }
+template<typename T, size_t W> AUTODIFF_DEVICE_FUNC constexpr auto operator*(Packet<T, W> x, const Packet<T, W>& y) { return x *= y; }
+template<typename T, size_t W> AUTODIFF_DEVICE_FUNC constexpr auto operator/(Packet<T, W> x, const Packet<T, W>& y) { return x /= y; }
+
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator+(Packet<T, W> x, const U& y) { return x += Packet<T, W>(y); }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator-(Packet<T, W> x, const U& y) { return x -= Packet<T, W>(y); }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator*(Packet<T, W> x, const U& y) { return x *= Packet<T, W>(y); }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator/(Packet<T, W> x, const U& y) { return x /= Packet<T, W>(y); }
+
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator+(const U& x, const Packet<T, W>& y) { return Packet<T, W>(x) += y; }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator-(const U& x, const Packet<T, W>& y) { return Packet<T, W>(x) -= y; }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator*(const U& x, const Packet<T, W>& y) { return Packet<T, W>(x) *= y; }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr auto operator/(const U& x, const Packet<T, W>& y) { return Packet<T, W>(x) /= y; }
+
+//=====================================================================================================================
+//
+// COMPARISON OPERATORS (TRUE IF TRUE IN ALL LANES)
+//
+//=====================================================================================================================
+
+#define AUTODIFF_DEFINE_PACKET_COMPARISON(OP)                                                                     \
+template<typename T, size_t W>                                                                                    \
+AUTODIFF_DEVICE_FUNC constexpr bool operator OP(const Packet<T, W>& x, const Packet<T, W>& y)                     \
+{                                                                                                                 \
+    bool res = true;                                                                                              \
+    for(size_t k = 0; k < W; ++k) res = res && (x[k] OP y[k]);                                                    \
+    return res;                                                                                                   \
+}                                                                                                                 \
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true>                             \
+AUTODIFF_DEVICE_FUNC constexpr bool operator OP(const Packet<T, W>& x, const U& y) { return x OP Packet<T, W>(y); } \
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true>                             \
+AUTODIFF_DEVICE_FUNC constexpr bool operator OP(const U& x, const Packet<T, W>& y) { return Packet<T, W>(x) OP y; }
+
+AUTODIFF_DEFINE_PACKET_COMPARISON(==)
+AUTODIFF_DEFINE_PACKET_COMPARISON(<)
+AUTODIFF_DEFINE_PACKET_COMPARISON(>)
+AUTODIFF_DEFINE_PACKET_COMPARISON(<=)
+AUTODIFF_DEFINE_PACKET_COMPARISON(>=)
+
+#undef AUTODIFF_DEFINE_PACKET_COMPARISON
+
+template<typename T, size_t W> AUTODIFF_DEVICE_FUNC constexpr bool operator!=(const Packet<T, W>& x, const Packet<T, W>& y) { return !(x == y); }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr bool operator!=(const Packet<T, W>& x, const U& y) { return !(x == y); }
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true> AUTODIFF_DEVICE_FUNC constexpr bool operator!=(const U& x, const Packet<T, W>& y) { return !(x == y); }
+
+//=====================================================================================================================
+//
+// MATH FUNCTIONS
+//
+//=====================================================================================================================
+
+#define AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(FUNC)               \
+template<typename T, size_t W>                                    \
+AUTODIFF_DEVICE_FUNC auto FUNC(const Packet<T, W>& x)             \
+{                                                                 \
+    Packet<T, W> res;                                             \
+    for(size_t k = 0; k < W; ++k) res[k] = std::FUNC(x[k]);       \
+    return res;                                                   \
+}
+
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(abs)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(exp)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(log)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(log10)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(sqrt)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(cbrt)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(sin)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(cos)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(tan)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(asin)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(acos)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(atan)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(sinh)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(cosh)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(tanh)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(asinh)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(acosh)
+AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION(atanh)
+
+#undef AUTODIFF_DEFINE_PACKET_UNARY_FUNCTION
+
+#define AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(FUNC)                                                                   \
+template<typename T, size_t W>                                                                                         \
+AUTODIFF_DEVICE_FUNC auto FUNC(const Packet<T, W>& x, const Packet<T, W>& y)                                           \
+{                                                                                                                      \
+    Packet<T, W> res;                                                                                                  \
+    for(size_t k = 0; k < W; ++k) res[k] = std::FUNC(x[k], y[k]);                                                      \
+    return res;                                                                                                        \
+}                                                                                                                      \
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true>                                  \
+AUTODIFF_DEVICE_FUNC auto FUNC(const Packet<T, W>& x, const U& y) { return FUNC(x, Packet<T, W>(y)); }               \
+template<typename T, size_t W, typename U, Requires<std::is_arithmetic_v<U>> = true>                                  \
+AUTODIFF_DEVICE_FUNC auto FUNC(const U& x, const Packet<T, W>& y) { return FUNC(Packet<T, W>(x), y); }
+
+AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(pow)
+AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(atan2)
+AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(min)
+AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(max)
+AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION(copysign)
+
+#undef AUTODIFF_DEFINE_PACKET_BINARY_FUNCTION
+
+/// Return the lane-wise selection `mask[k] ? x[k] : y[k]`.
+template<typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto select(const std::array<bool, W>& mask, const Packet<T, W>& x, const Packet<T, W>& y)
+{
+    Packet<T, W> res;
+    for(size_t k = 0; k < W; ++k) res[k] = mask[k] ? x[k] : y[k];
+    return res;
+}
+
+template<typename T, size_t W>
+std::ostream& operator<<(std::ostream& out, const Packet<T, W>& x)
+{
+    out << "[";
+    for(size_t k = 0; k < W; ++k)
+        out << (k == 0 ? "" : ", ") << x[k];
+    out << "]";
+    return out;
+}
+
+//=====================================================================================================================
+//
+// LANE-WISE OVERLOADS OF THE BRANCHING REAL FUNCTIONS
+//
+//=====================================================================================================================
+
+// The generic abs, min and max of Real<N, T> branch on the value x[0] as a whole,
+// which for a packet would pick the same branch for every lane. These overloads
+// select the coefficients lane by lane instead.
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto abs(const Real<N, Packet<T, W>>& x)
+{
+    Real<N, Packet<T, W>> res;
+    Packet<T, W> s;
+    for(size_t k = 0; k < W; ++k)
+        s[k] = x[0][k] == 0 ? T(0) : std::copysign(T(1), x[0][k]); // zero derivatives where abs is not differentiable
+    res[0] = abs(x[0]);
+    For<1, N + 1>([&](auto i) constexpr { res[i] = s * x[i]; });
+    return res;
+}
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto min(const Real<N, Packet<T, W>>& x, const Real<N, Packet<T, W>>& y)
+{
+    std::array<bool, W> mask;
+    for(size_t k = 0; k < W; ++k) mask[k] = x[0][k] <= y[0][k];
+    Real<N, Packet<T, W>> res;
+    For<0, N + 1>([&](auto i) constexpr { res[i] = select(mask, x[i], y[i]); });
+    return res;
+}
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto max(const Real<N, Packet<T, W>>& x, const Real<N, Packet<T, W>>& y)
+{
+    std::array<bool, W> mask;
+    for(size_t k = 0; k < W; ++k) mask[k] = x[0][k] >= y[0][k];
+    Real<N, Packet<T, W>> res;
+    For<0, N + 1>([&](auto i) constexpr { res[i] = select(mask, x[i], y[i]); });
+    return res;
+}
+
+// The generic sqrt, cbrt and pow of Real<N, T> skip the derivative recurrences when x[0] == 0, which for a packet
+// holds only if every lane is zero, so a single zero lane would divide by zero and give NaN derivatives. These
+// overloads run the recurrences with one in place of the zero lanes and then clear the derivatives of those lanes,
+// which gives every lane the result of the scalar Real.
+
+/// Return *x* with its value replaced by one in the lanes where it is zero, which are flagged in *zero*.
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto nonzero_lanes(const Real<N, Packet<T, W>>& x, std::array<bool, W>& zero)
+{
+    Real<N, Packet<T, W>> res = x;
+    for(size_t k = 0; k < W; ++k) {
+        zero[k] = x[0][k] == 0;
+        res[0][k] = zero[k] ? T(1) : x[0][k];
+    }
+    return res;
+}
+
+/// Set the derivatives of *res* to zero in the lanes flagged in *zero*.
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC void clear_lanes(Real<N, Packet<T, W>>& res, const std::array<bool, W>& zero)
+{
+    For<1, N + 1>([&](auto i) constexpr { res[i] = select(zero, Packet<T, W>(), res[i]); });
+}
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto sqrt(const Real<N, Packet<T, W>>& x)
+{
+    std::array<bool, W> zero;
+    auto res = sqrt<N, Packet<T, W>>(nonzero_lanes(x, zero)); // the generic sqrt
+    res[0] = sqrt(x[0]);
+    clear_lanes(res, zero);
+    return res;
+}
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto cbrt(const Real<N, Packet<T, W>>& x)
+{
+    std::array<bool, W> zero;
+    auto res = cbrt<N, Packet<T, W>>(nonzero_lanes(x, zero)); // the generic cbrt
+    res[0] = cbrt(x[0]);
+    clear_lanes(res, zero);
+    return res;
+}
+
+template<size_t N, typename T, size_t W>
+AUTODIFF_DEVICE_FUNC auto pow(const Real<N, Packet<T, W>>& x, const Real<N, Packet<T, W>>& y)
+{
+    std::array<bool, W> zero;
+    auto res = pow<N, Packet<T, W>>(nonzero_lanes(x, zero), y); // the generic pow
+    res[0] = pow(x[0], y[0]);
+    clear_lanes(res, zero);
+    return res;
+}
+
+template<size_t N, typename T, size_t W, typename U, Requires<isArithmetic<U> && !isPacket<U>> = true>
+AUTODIFF_DEVICE_FUNC auto pow(const Real<N, Packet<T, W>>& x, const U& c)
+{
+    std::array<bool, W> zero;
+    auto res = pow<N, Packet<T, W>, U>(nonzero_lanes(x, zero), c); // the generic pow
+    res[0] = pow(x[0], static_cast<T>(c));
+    clear_lanes(res, zero);
+    return res;
+}
+
+} // namespace detail
+
+//=====================================================================================================================
+//
+// CONVENIENT TYPE ALIASES
+//
+//=====================================================================================================================
+
+using detail::Packet;
+using detail::select;
+
+/// A packet of *W* Real numbers of order *N*, stored coefficient by coefficient (structure of arrays).
+template<size_t N, size_t W, typename T = double>
+using RealPacket = Real<N, Packet<T, W>>;
+
+} // namespace autodiff
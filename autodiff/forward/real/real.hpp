@@ -163,13 +163,18 @@ public:
 
     AUTODIFF_DEVICE_FUNC constexpr auto operator*=(const Real& y)
     {
-        auto& x = *this;
-        ReverseFor<N + 1>([&](auto i) constexpr {
-            x[i] = Sum<0, i + 1>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index, j.index>;
+        // Each coefficient of the product is computed into a separate array
+        // so that the N + 1 convolution sums are independent of each other
+        // (no in-place dependency chain) and can be evaluated in parallel lanes.
+        const auto& x = *this;
+        std::array<T, N + 1> res = {};
+        For<N + 1>([&](auto i) constexpr {
+            res[i] = Sum<0, i + 1>([&](auto j) constexpr {
+                const auto c = static_cast<T>(BinomialCoefficient<i.index, j.index>); // cast so that float/packet recurrences are not promoted to double
                 return c * x[i - j] * y[j];
             });
         });
+        m_data = res;
         return *this;
     }
 
@@ -178,7 +183,7 @@ public:
         auto& x = *this;
         For<N + 1>([&](auto i) constexpr {
             x[i] -= Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index, j.index>);
                 return c * x[j] * y[i - j];
             });
             x[i] /= y[0];
@@ -360,7 +365,7 @@ AUTODIFF_DEVICE_FUNC auto operator/(Real<N, T> x, const U& y)
 template<size_t N, typename T, typename U, Requires<isArithmetic<U>> = true>
 AUTODIFF_DEVICE_FUNC auto operator/(const U& x, Real<N, T> y)
 {
-    Real<N, T> z = x;
+    Real<N, T> z = static_cast<T>(x);
     return z /= y;
 }
 
@@ -377,7 +382,7 @@ AUTODIFF_DEVICE_FUNC constexpr auto exp(const Real<N, T>& x)
     expx[0] = exp(x[0]);
     For<1, N + 1>([&](auto i) constexpr {
         expx[i] = Sum<0, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
             return c * x[i - j] * expx[j];
         });
     });
@@ -392,7 +397,7 @@ AUTODIFF_DEVICE_FUNC constexpr auto log(const Real<N, T>& x)
     logx[0] = log(x[0]);
     For<1, N + 1>([&](auto i) constexpr {
         logx[i] = x[i] - Sum<1, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index - 1>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index - 1>);
             return c * x[i - j] * logx[j];
         });
         logx[i] /= x[0];
@@ -422,13 +427,13 @@ AUTODIFF_DEVICE_FUNC constexpr auto sqrt(const Real<N, T>& x)
         Real<N, T> a;
         For<1, N + 1>([&](auto i) constexpr {
             a[i] = x[i] - Sum<1, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index - 1>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index - 1>);
                 return c * x[i - j] * a[j];
             });
             a[i] /= x[0];
 
-            res[i] = 0.5 * Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            res[i] = static_cast<T>(0.5) * Sum<0, i>([&](auto j) constexpr {
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * a[i - j] * res[j];
             });
         });
@@ -449,13 +454,13 @@ AUTODIFF_DEVICE_FUNC constexpr auto cbrt(const Real<N, T>& x)
         Real<N, T> a;
         For<1, N + 1>([&](auto i) constexpr {
             a[i] = x[i] - Sum<1, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index - 1>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index - 1>);
                 return c * x[i - j] * a[j];
             });
             a[i] /= x[0];
 
-            res[i] = (1.0/3.0) * Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            res[i] = static_cast<T>(1.0/3.0) * Sum<0, i>([&](auto j) constexpr {
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * a[i - j] * res[j];
             });
         });
@@ -476,12 +481,12 @@ AUTODIFF_DEVICE_FUNC constexpr auto pow(const Real<N, T>& x, const Real<N, T>& y
         Real<N, T> a;
         For<1, N + 1>([&](auto i) constexpr {
             a[i] = Sum<0, i + 1>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index, j.index>);
                 return c * y[i - j] * lnx[j];
             });
 
             res[i] = Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * a[i - j] * res[j];
             });
         });
@@ -501,7 +506,7 @@ AUTODIFF_DEVICE_FUNC constexpr auto pow(const Real<N, T>& x, const U& c)
         Real<N, T> a = c * log(x);
         For<1, N + 1>([&](auto i) constexpr {
             res[i] = Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * a[i - j] * res[j];
             });
         });
@@ -521,7 +526,7 @@ AUTODIFF_DEVICE_FUNC constexpr auto pow(const U& c, const Real<N, T>& y)
         Real<N, T> a = y * log(c);
         For<1, N + 1>([&](auto i) constexpr {
             res[i] = Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * a[i - j] * res[j];
             });
         });
@@ -546,12 +551,12 @@ AUTODIFF_DEVICE_FUNC auto sincos(const Real<N, T>& x) -> std::tuple<Real<N, T>,
 
     For<1, N + 1>([&](auto i) constexpr {
         cosx[i] = -Sum<0, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
             return c * x[i - j] * sinx[j];
         });
 
         sinx[i] = Sum<0, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
             return c * x[i - j] * cosx[j];
         });
     });
@@ -584,12 +589,12 @@ AUTODIFF_DEVICE_FUNC auto tan(const Real<N, T>& x)
 
         For<1, N + 1>([&](auto i) constexpr {
             tanx[i] = Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * x[i - j] * aux[j];
             });
 
             aux[i] = 2*Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * tanx[i - j] * tanx[j];
             });
         });
@@ -731,12 +736,12 @@ AUTODIFF_DEVICE_FUNC auto sinhcosh(const Real<N, T>& x) -> std::tuple<Real<N, T>
 
     For<1, N + 1>([&](auto i) constexpr {
         coshx[i] = Sum<0, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
             return c * x[i - j] * sinhx[j];
         });
 
         sinhx[i] = Sum<0, i>([&](auto j) constexpr {
-            constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+            const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
             return c * x[i - j] * coshx[j];
         });
     });
@@ -771,12 +776,12 @@ AUTODIFF_DEVICE_FUNC auto tanh(const Real<N, T>& x)
 
         For<1, N + 1>([&](auto i) constexpr {
             tanhx[i] = Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * x[i - j] * aux[j];
             });
 
             aux[i] = -2*Sum<0, i>([&](auto j) constexpr {
-                constexpr auto c = BinomialCoefficient<i.index - 1, j.index>;
+                const auto c = static_cast<T>(BinomialCoefficient<i.index - 1, j.index>);
                 return c * tanhx[i - j] * tanhx[j];
             });
         });
@@ -29,6 +29,15 @@
 
 #pragma once
 
+// C++ includes
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 // autodiff includes
 #include <autodiff/common/eigen.hpp>
 #include <autodiff/common/meta.hpp>
@@ -218,11 +227,234 @@ auto hessian(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at)
     return hessian(f, wrt, at, u, g);
 }
 
+/// The position of a variable in a `wrt(...)` list within the arguments of an `at(...)` list.
+struct WrtLocation
+{
+    size_t arg = 0;  ///< The index of the argument in the `at(...)` list that contains the variable.
+    size_t item = 0; ///< The index of the variable in that argument if it is a vector (zero otherwise).
+};
+
+/// The type of the autodiff number in an item of a `wrt(...)` list (the item itself or its vector entry type).
+template<typename Item>
+using WrtItemNumberType = PlainType<std::conditional_t<isVector<Item>, VectorValueType<Item>, Item>>;
+
+/// Return a reference to the *j*-th entry of a vector, using either `operator[]` or `operator()`.
+template<typename Vec>
+auto& wrt_vector_entry(Vec& vec, size_t j)
+{
+    if constexpr (detail::has_operator_bracket<Vec&>())
+        return vec[j];
+    else return vec(j);
+}
+
+/// Return the location of every variable in a `wrt(...)` list within the arguments of an `at(...)` list.
+template<typename... Vars, typename... Args>
+auto wrt_locations(const Wrt<Vars...>& wrt, const At<Args...>& at) -> std::vector<WrtLocation>
+{
+    std::vector<WrtLocation> locations(wrt_total_length(wrt));
+
+    ForEachWrtVar(wrt, [&](auto&& i, auto&& xi) constexpr
+    {
+        const void* address = &xi;
+        bool found = false;
+        size_t k = 0; // the index of the current argument in the at list
+        ForEach(at.args, [&](auto& arg) constexpr
+        {
+            if constexpr (isVector<decltype(arg)>) {
+                for(size_t j = 0; !found && j < size_t(arg.size()); ++j)
+                    if(address == &wrt_vector_entry(arg, j)) {
+                        locations[i] = { k, j };
+                        found = true;
+                    }
+            }
+            else if(!found && address == &arg) {
+                locations[i] = { k, 0 };
+                found = true;
+            }
+            ++k;
+        });
+        if(!found)
+            throw std::logic_error("Parallel derivative evaluation requires every variable in the wrt list to be one of the arguments in the at list (or an entry of one of them).");
+    });
+
+    return locations;
+}
+
+/// Return a pointer to the variable at the given location within a (per-thread) copy of the `at(...)` arguments.
+template<typename Var, typename Tuple>
+auto wrt_address(Tuple& args, const WrtLocation& location) -> Var*
+{
+    Var* address = nullptr;
+    size_t k = 0;
+    ForEach(args, [&](auto& arg) constexpr
+    {
+        using Arg = PlainType<decltype(arg)>;
+        if(k++ != location.arg) return;
+        if constexpr (std::is_same_v<WrtItemNumberType<Arg>, Var>) {
+            if constexpr (isVector<Arg>)
+                address = &wrt_vector_entry(arg, location.item);
+            else address = &arg;
+        }
+    });
+    return address;
+}
+
+/// Return the number of threads to use for *tasks* independent evaluations (*nthreads* = 0 means one per hardware thread).
+inline auto parallel_thread_count(size_t nthreads, size_t tasks) -> size_t
+{
+    if(nthreads == 0)
+        nthreads = std::thread::hardware_concurrency();
+    return std::max<size_t>(1, std::min(nthreads, tasks));
+}
+
+/// Call `work(t)` for t = 0, ..., nthreads - 1, each on its own thread (the calling thread runs t = 0), and rethrow the first exception raised.
+template<typename Function>
+void parallel_run(size_t nthreads, const Function& work)
+{
+    std::vector<std::exception_ptr> errors(nthreads);
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads - 1);
+
+    auto guarded = [&](size_t t) {
+        try { work(t); }
+        catch(...) { errors[t] = std::current_exception(); }
+    };
+
+    for(size_t t = 1; t < nthreads; ++t)
+        workers.emplace_back(guarded, t);
+    guarded(0);
+
+    for(auto& worker : workers)
+        worker.join();
+
+    for(auto& error : errors)
+        if(error) std::rethrow_exception(error);
+}
+
+/// Return the Jacobian matrix of a function *f*, evaluating its columns concurrently on *nthreads* threads (0 for one per hardware thread).
+/// Every thread works on its own copy of the `at(...)` arguments, so *f* must be safe to call concurrently.
+/// The variables in the `wrt(...)` list must all have the same autodiff number type and be (entries of) arguments in the `at(...)` list.
+/// The result is identical to that of @ref jacobian, independently of the number of threads.
+template<typename Fun, typename... Vars, typename... Args, typename Y, typename Jac>
+void jacobian_parallel(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, Y& F, Jac& J, size_t nthreads = 0)
+{
+    static_assert(sizeof...(Vars) >= 1);
+    static_assert(sizeof...(Args) >= 1);
+
+    using Var = WrtItemNumberType<std::tuple_element_t<0, std::tuple<Vars...>>>;
+    static_assert((std::is_same_v<WrtItemNumberType<Vars>, Var> && ...), "Expecting a wrt list in which all variables have the same autodiff number type.");
+
+    const size_t n = wrt_total_length(wrt);
+    const auto locations = wrt_locations(wrt, at);
+
+    F = std::apply(f, at.args); // evaluate F without seeding to get its value and number of rows
+    const size_t m = F.size();
+    J.resize(m, n);
+
+    if(n == 0) return;
+
+    std::atomic<size_t> next = 0; // the next column to be evaluated by any thread
+
+    parallel_run(parallel_thread_count(nthreads, n), [&](size_t)
+    {
+        auto args = std::apply([](const auto&... items) { return std::tuple<PlainType<Args>...>(items...); }, at.args); // the arguments of f owned by this thread
+        auto atargs = std::apply([](auto&... items) { return detail::at(items...); }, args);
+
+        for(size_t i = next++; i < n; i = next++) {
+            Var& xi = *wrt_address<Var>(args, locations[i]);
+            auto Fi = eval(f, atargs, detail::wrt(xi)); // evaluate F with xi seeded so that dF/dxi is also computed
+            for(size_t row = 0; row < m; ++row)
+                J(row, i) = derivative<1>(Fi[row]);
+        }
+    });
+}
+
+/// Return the Jacobian matrix of a function *f*, evaluating its columns concurrently on *nthreads* threads (0 for one per hardware thread).
+template<typename Fun, typename... Vars, typename... Args>
+auto jacobian_parallel(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, size_t nthreads = 0)
+{
+    using Y = ReturnType<Fun, Args...>;
+    using U = VectorValueType<Y>;
+    using T = NumericType<U>;
+    using Mat = MatrixX<T>;
+
+    Y F;
+    Mat J;
+    jacobian_parallel(f, wrt, at, F, J, nthreads);
+    return J;
+}
+
+/// Return the hessian matrix of scalar function *f*, evaluating its upper triangular entries concurrently on *nthreads* threads (0 for one per hardware thread).
+/// Every thread works on its own copy of the `at(...)` arguments, so *f* must be safe to call concurrently.
+/// The variables in the `wrt(...)` list must all have the same autodiff number type and be (entries of) arguments in the `at(...)` list.
+/// The result is identical to that of @ref hessian, independently of the number of threads.
+template<typename Fun, typename... Vars, typename... Args, typename U, typename G, typename H>
+void hessian_parallel(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, U& u, G& g, H& h, size_t nthreads = 0)
+{
+    static_assert(sizeof...(Vars) >= 1);
+    static_assert(sizeof...(Args) >= 1);
+
+    using Var = WrtItemNumberType<std::tuple_element_t<0, std::tuple<Vars...>>>;
+    static_assert((std::is_same_v<WrtItemNumberType<Vars>, Var> && ...), "Expecting a wrt list in which all variables have the same autodiff number type.");
+
+    const size_t n = wrt_total_length(wrt);
+    const auto locations = wrt_locations(wrt, at);
+
+    g.resize(n);
+    h.resize(n, n);
+
+    u = std::apply(f, at.args); // evaluate u without seeding to get its value
+
+    std::vector<std::pair<size_t, size_t>> entries; // the (i, j) entries with j >= i, since the Hessian matrix is symmetric
+    entries.reserve(n * (n + 1) / 2);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i; j < n; ++j)
+            entries.emplace_back(i, j);
+
+    if(entries.empty()) return;
+
+    std::atomic<size_t> next = 0; // the next entry to be evaluated by any thread
+
+    parallel_run(parallel_thread_count(nthreads, entries.size()), [&](size_t)
+    {
+        auto args = std::apply([](const auto&... items) { return std::tuple<PlainType<Args>...>(items...); }, at.args); // the arguments of f owned by this thread
+        auto atargs = std::apply([](auto&... items) { return detail::at(items...); }, args);
+
+        for(size_t k = next++; k < entries.size(); k = next++) {
+            const auto [i, j] = entries[k];
+            Var& xi = *wrt_address<Var>(args, locations[i]);
+            Var& xj = *wrt_address<Var>(args, locations[j]);
+            auto uij = eval(f, atargs, detail::wrt(xi, xj)); // evaluate u with xi and xj seeded to produce u0, du/dxi, d2u/dxidxj
+            if(i == j)
+                g[i] = derivative<1>(uij); // get du/dxi from u (each g[i] is written by exactly one entry)
+            h(i, j) = h(j, i) = derivative<2>(uij); // get d2u/dxidxj from u
+        }
+    });
+}
+
+/// Return the hessian matrix of scalar function *f*, evaluating its upper triangular entries concurrently on *nthreads* threads (0 for one per hardware thread).
+template<typename Fun, typename... Vars, typename... Args>
+auto hessian_parallel(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, size_t nthreads = 0)
+{
+    using U = ReturnType<Fun, Args...>;
+    using T = NumericType<U>;
+    using Vec = VectorX<T>;
+    using Mat = MatrixX<T>;
+
+    U u;
+    Vec g;
+    Mat H;
+    hessian_parallel(f, wrt, at, u, g, H, nthreads);
+    return H;
+}
+
 } // namespace detail
 
 using detail::gradient;
 using detail::jacobian;
 using detail::hessian;
+using detail::jacobian_parallel;
+using detail::hessian_parallel;
 
 } // namespace autodiff
 
@@ -0,0 +1,254 @@
+//                  _  _
+//  _   _|_ _  _|o_|__|_
+// (_||_||_(_)(_|| |  |
+//
+// automatic differentiation made easier in C++
+// https://github.com/autodiff/autodiff
+//
+// Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+//
+// Copyright © 2018–2024 Allan Leal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// C++ includes
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Eigen includes
+#include <Eigen/SparseCore>
+
+// autodiff includes
+#include <autodiff/forward/utils/gradient.hpp>
+
+namespace autodiff {
+namespace detail {
+
+/// The sparsity pattern of a matrix, given by the column indices of the structurally nonzero entries in each row.
+struct SparsityPattern
+{
+    size_t rows = 0; ///< The number of rows of the matrix.
+    size_t cols = 0; ///< The number of columns of the matrix.
+    std::vector<std::vector<size_t>> nonzeros; ///< The sorted column indices of the nonzero entries in each row.
+};
+
+/// Return pointers to the variables in a `wrt(...)` list, which must all have the same autodiff number type.
+template<typename... Vars>
+auto wrt_pointers(const Wrt<Vars...>& wrt)
+{
+    using Var = WrtItemNumberType<std::tuple_element_t<0, std::tuple<Vars...>>>;
+    static_assert((std::is_same_v<WrtItemNumberType<Vars>, Var> && ...), "Expecting a wrt list in which all variables have the same autodiff number type.");
+
+    std::vector<Var*> x(wrt_total_length(wrt));
+    ForEachWrtVar(wrt, [&](auto&& i, auto&& xi) constexpr {
+        static_assert(!isConst<decltype(xi)>, "Expecting non-const autodiff numbers in wrt list because these need to be seeded, and thus altered!");
+        x[i] = &xi;
+    });
+    return x;
+}
+
+/// Return the sparsity pattern of the Jacobian matrix of a function *f* at the given point.
+/// Each variable is seeded with a NaN derivative in turn, which contaminates every output that structurally depends on it,
+/// even where the partial derivative happens to be zero at this point. Outputs that depend on a variable only through
+/// comparisons or branches (e.g. `min`, `max`, `abs`, `if`) are detected only for the branch taken at this point.
+template<typename Fun, typename... Vars, typename... Args>
+auto jacobian_sparsity(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at) -> SparsityPattern
+{
+    static_assert(sizeof...(Vars) >= 1);
+    static_assert(sizeof...(Args) >= 1);
+
+    const auto x = wrt_pointers(wrt);
+    const auto nan = std::numeric_limits<double>::quiet_NaN();
+
+    SparsityPattern pattern;
+    pattern.cols = x.size();
+
+    for(size_t i = 0; i < x.size(); ++i) {
+        seed<1>(*x[i], nan);
+        auto F = std::apply(f, at.args);
+        seed<1>(*x[i], 0.0);
+        if(i == 0) {
+            pattern.rows = F.size();
+            pattern.nonzeros.resize(pattern.rows);
+        }
+        for(size_t row = 0; row < pattern.rows; ++row)
+            if(std::isnan(static_cast<double>(derivative<1>(F[row]))))
+                pattern.nonzeros[row].push_back(i); // i is increasing, so column indices stay sorted
+    }
+
+    return pattern;
+}
+
+/// Return a coloring of the columns of a sparsity pattern in which no two columns with a nonzero in the same row share a color.
+/// Columns are colored greedily in decreasing order of their number of nonzeros (largest-first), using the smallest available color.
+/// Colors are numbered 0, 1, ..., so the number of colors is one plus the largest entry.
+inline auto color_columns(const SparsityPattern& pattern) -> std::vector<size_t>
+{
+    const size_t n = pattern.cols;
+
+    std::vector<std::vector<size_t>> rowsof(n); // the rows of the nonzero entries in each column
+    for(size_t row = 0; row < pattern.rows; ++row)
+        for(auto col : pattern.nonzeros[row])
+            rowsof[col].push_back(row);
+
+    std::vector<size_t> order(n);
+    for(size_t j = 0; j < n; ++j)
+        order[j] = j;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return rowsof[a].size() > rowsof[b].size(); });
+
+    const auto uncolored = std::numeric_limits<size_t>::max();
+    std::vector<size_t> colors(n, uncolored);
+    std::vector<size_t> forbidden; // forbidden[c] == j means color c is taken by a column sharing a row with column j
+
+    for(auto j : order) {
+        for(auto row : rowsof[j])
+            for(auto col : pattern.nonzeros[row])
+                if(colors[col] != uncolored)
+                    forbidden[colors[col]] = j;
+        size_t c = 0;
+        while(c < forbidden.size() && forbidden[c] == j)
+            ++c;
+        if(c == forbidden.size())
+            forbidden.push_back(uncolored);
+        colors[j] = c;
+    }
+
+    return colors;
+}
+
+/// Return the sparse Jacobian matrix of a function *f* with a known sparsity pattern, using one evaluation per column color.
+/// All columns of the same color (see @ref color_columns) are seeded together, and since no two of them have a nonzero
+/// in the same row, each derivative of the compressed evaluation is the entry of exactly one column.
+template<typename Fun, typename... Vars, typename... Args, typename Y, typename T>
+void jacobian_sparse(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, const SparsityPattern& pattern, Y& F, Eigen::SparseMatrix<T>& J)
+{
+    static_assert(sizeof...(Vars) >= 1);
+    static_assert(sizeof...(Args) >= 1);
+
+    const auto x = wrt_pointers(wrt);
+    assert(x.size() == pattern.cols);
+
+    const auto colors = color_columns(pattern);
+    const size_t ncolors = colors.empty() ? 0 : *std::max_element(colors.begin(), colors.end()) + 1;
+
+    std::vector<Eigen::Triplet<T>> triplets;
+
+    F = std::apply(f, at.args); // evaluate F without seeding in case there are no columns at all
+
+    for(size_t c = 0; c < ncolors; ++c) {
+        for(size_t i = 0; i < x.size(); ++i)
+            if(colors[i] == c) seed<1>(*x[i], 1.0);
+        F = std::apply(f, at.args); // evaluate F with all columns of color c seeded
+        for(size_t i = 0; i < x.size(); ++i)
+            if(colors[i] == c) seed<1>(*x[i], 0.0);
+        for(size_t row = 0; row < pattern.rows; ++row)
+            for(auto col : pattern.nonzeros[row])
+                if(colors[col] == c)
+                    triplets.emplace_back(row, col, derivative<1>(F[row]));
+    }
+
+    J.resize(pattern.rows, pattern.cols);
+    J.setFromTriplets(triplets.begin(), triplets.end());
+}
+
+/// Return the sparse Jacobian matrix of a function *f* with a known sparsity pattern, using one evaluation per column color.
+template<typename Fun, typename... Vars, typename... Args>
+auto jacobian_sparse(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, const SparsityPattern& pattern)
+{
+    using Y = ReturnType<Fun, Args...>;
+    using U = VectorValueType<Y>;
+    using T = NumericType<U>;
+
+    Y F;
+    Eigen::SparseMatrix<T> J;
+    jacobian_sparse(f, wrt, at, pattern, F, J);
+    return J;
+}
+
+/// Return the sparse Jacobian matrix of a function *f*, detecting its sparsity pattern first with @ref jacobian_sparsity.
+/// When the Jacobian is needed at many points with the same pattern, detect it once and pass it instead.
+template<typename Fun, typename... Vars, typename... Args>
+auto jacobian_sparse(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at)
+{
+    return jacobian_sparse(f, wrt, at, jacobian_sparsity(f, wrt, at));
+}
+
+/// Return the sparse hessian matrix of scalar function *f* with a known (symmetric) sparsity pattern.
+/// Each evaluation of a second-order dual number yields a single second derivative, so instead of coloring, only the
+/// structurally nonzero entries of the upper triangle are evaluated (an entry given in either triangle of the pattern
+/// is evaluated once and mirrored).
+template<typename Fun, typename... Vars, typename... Args, typename U, typename T>
+void hessian_sparse(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, const SparsityPattern& pattern, U& u, Eigen::SparseMatrix<T>& H)
+{
+    static_assert(sizeof...(Vars) >= 1);
+    static_assert(sizeof...(Args) >= 1);
+
+    const auto x = wrt_pointers(wrt);
+    assert(x.size() == pattern.rows && x.size() == pattern.cols);
+
+    std::vector<std::pair<size_t, size_t>> entries; // the (i, j) entries with j >= i
+    for(size_t row = 0; row < pattern.rows; ++row)
+        for(auto col : pattern.nonzeros[row])
+            entries.emplace_back(std::min(row, col), std::max(row, col));
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+    std::vector<Eigen::Triplet<T>> triplets;
+    triplets.reserve(2 * entries.size());
+
+    u = std::apply(f, at.args); // evaluate u without seeding to get its value
+
+    for(auto [i, j] : entries) {
+        auto uij = eval(f, at, detail::wrt(*x[i], *x[j])); // evaluate u with xi and xj seeded to produce u0, du/dxi, d2u/dxidxj
+        const T hij = derivative<2>(uij);
+        triplets.emplace_back(i, j, hij);
+        if(i != j)
+            triplets.emplace_back(j, i, hij);
+    }
+
+    H.resize(pattern.rows, pattern.cols);
+    H.setFromTriplets(triplets.begin(), triplets.end());
+}
+
+/// Return the sparse hessian matrix of scalar function *f* with a known (symmetric) sparsity pattern.
+template<typename Fun, typename... Vars, typename... Args>
+auto hessian_sparse(const Fun& f, const Wrt<Vars...>& wrt, const At<Args...>& at, const SparsityPattern& pattern)
+{
+    using U = ReturnType<Fun, Args...>;
+    using T = NumericType<U>;
+
+    U u;
+    Eigen::SparseMatrix<T> H;
+    hessian_sparse(f, wrt, at, pattern, u, H);
+    return H;
+}
+
+} // namespace detail
+
+using detail::SparsityPattern;
+using detail::jacobian_sparsity;
+using detail::color_columns;
+using detail::jacobian_sparse;
+using detail::hessian_sparse;
+
+} // namespace autodiff
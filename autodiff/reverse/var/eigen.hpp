@@ -214,6 +214,74 @@ auto hessian(const Variable<T>& y, Eigen::DenseBase<X>& x)
     return hessian(y, x, g);
 }
 
+/// Return the Jacobian matrix of variables y with respect to variables x.
+/// All rows are computed together in a single sweep over the common expression tree of y.
+template<typename Y, typename X>
+auto jacobian(const Eigen::DenseBase<Y>& y, Eigen::DenseBase<X>& x)
+{
+    using ScalarX = typename X::Scalar;
+    static_assert(isVariable<ScalarX>, "Argument x is not a vector with Variable<T> (aka var) objects.");
+    static_assert(isVariable<typename Y::Scalar>, "Argument y is not a vector with Variable<T> (aka var) objects.");
+
+    using T = std::decay_t<decltype(std::declval<ScalarX>().expr->val)>;
+
+    constexpr auto Rows = Y::RowsAtCompileTime;
+    constexpr auto Cols = X::RowsAtCompileTime;
+    constexpr auto MaxRows = Y::MaxRowsAtCompileTime;
+    constexpr auto MaxCols = X::MaxRowsAtCompileTime;
+
+    const size_t m = y.size();
+    const size_t n = x.size();
+
+    std::vector<Expr<T>*> yexprs(m), xexprs(n);
+    for(size_t k = 0; k < m; ++k) yexprs[k] = y[k].expr.get();
+    for(size_t i = 0; i < n; ++i) xexprs[i] = x[i].expr.get();
+
+    std::vector<T> seeds(m * m, T(0.0)); // the identity matrix, so that row k of the Jacobian is carried in lane k
+    for(size_t k = 0; k < m; ++k)
+        seeds[k * m + k] = T(1.0);
+
+    const auto adjoints = propagate_adjoints(yexprs, seeds, m, xexprs);
+
+    using Jacobian = Mat<T, Rows, Cols, MaxRows, MaxCols>;
+    Jacobian J(m, n);
+    for(size_t k = 0; k < m; ++k)
+        for(size_t i = 0; i < n; ++i)
+            J(k, i) = adjoints[i * m + k];
+    return J;
+}
+
+/// Return the vector-Jacobian product of variables y with cotangent vector v with respect to variables x.
+template<typename Y, typename V, typename X>
+auto vjp(const Eigen::DenseBase<Y>& y, const Eigen::DenseBase<V>& v, Eigen::DenseBase<X>& x)
+{
+    using ScalarX = typename X::Scalar;
+    static_assert(isVariable<ScalarX>, "Argument x is not a vector with Variable<T> (aka var) objects.");
+    static_assert(isVariable<typename Y::Scalar>, "Argument y is not a vector with Variable<T> (aka var) objects.");
+
+    using T = std::decay_t<decltype(std::declval<ScalarX>().expr->val)>;
+
+    constexpr auto Rows = X::RowsAtCompileTime;
+    constexpr auto MaxRows = X::MaxRowsAtCompileTime;
+
+    const size_t m = y.size();
+    const size_t n = x.size();
+    assert(size_t(v.size()) == m);
+
+    std::vector<Expr<T>*> yexprs(m), xexprs(n);
+    std::vector<T> seeds(m);
+    for(size_t k = 0; k < m; ++k) { yexprs[k] = y[k].expr.get(); seeds[k] = v[k]; }
+    for(size_t i = 0; i < n; ++i) xexprs[i] = x[i].expr.get();
+
+    const auto adjoints = propagate_adjoints(yexprs, seeds, 1, xexprs);
+
+    using Gradient = Vec<T, Rows, MaxRows>;
+    Gradient g(n);
+    for(size_t i = 0; i < n; ++i)
+        g[i] = adjoints[i];
+    return g;
+}
+
 } // namespace detail
   //
 } // namespace reverse
@@ -222,5 +290,7 @@ AUTODIFF_DEFINE_EIGEN_TYPEDEFS_ALL_SIZES(autodiff::var, var)
 
 using reverse::detail::gradient;
 using reverse::detail::hessian;
+using reverse::detail::jacobian;
+using reverse::detail::vjp;
 
 } // namespace autodiff
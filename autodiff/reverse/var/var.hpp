@@ -30,13 +30,18 @@
 #pragma once
 
 // C++ includes
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <functional>
 #include <memory>
 #include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 // autodiff includes
 #include <autodiff/common/meta.hpp>
@@ -109,6 +114,30 @@ template<typename T> struct Variable;
 
 template<typename T> using ExprPtr = std::shared_ptr<Expr<T>>;
 
+/// Return a new stamp from a global counter used to order update passes and changes of value in expression trees.
+inline auto nextUpdateStamp() -> size_t
+{
+    static std::atomic<size_t> counter = 0;
+    return ++counter;
+}
+
+/// The operands of an expression node, each with its share of a propagated derivative (see Expr::capture).
+template<typename T>
+using PropagationRecords = std::vector<std::pair<Expr<T>*, T>>;
+
+/// The update pass in progress on the current thread and the nesting depth of update calls within it.
+struct UpdatePass
+{
+    static auto id() -> size_t& { thread_local size_t value = 0; return value; }
+    static auto depth() -> size_t& { thread_local size_t value = 0; return value; }
+
+    /// Enter a nested update call, starting a new pass if this is the outermost one.
+    UpdatePass() { if(depth()++ == 0) id() = nextUpdateStamp(); }
+
+    /// Leave a nested update call.
+    ~UpdatePass() { --depth(); }
+};
+
 namespace traits {
 
 template<typename T>
@@ -172,14 +201,54 @@ struct Expr
     /// @param wprime The derivative of the root expression node w.r.t. the child expression of this expression node.
     virtual void propagate(const T& wprime) = 0;
 
+    /// Record the operands of this expression with their share of @p wprime, instead of propagating it to them.
+    /// With @p wprime = 1 the records are the partial derivatives of this expression w.r.t. its operands.
+    virtual void capture(const T& wprime, PropagationRecords<T>& records) = 0;
+
     /// Update the contribution of this expression in the derivative of the root node of the expression tree.
     /// @param wprime The derivative of the root expression node w.r.t. the child expression of this expression node (as an expression).
     virtual void propagatex(const ExprPtr<T>& wprime) = 0;
 
-    /// Update the value of this expression
-    virtual void update() = 0;
+    /// The update pass in which this expression was last visited.
+    size_t updatePass = 0;
+
+    /// The stamp of the last change in the value of this expression (zero if unchanged since construction).
+    size_t version = 0;
+
+    /// Update the value of this expression after changes in the independent variables of its expression tree.
+    /// Only expressions with an operand changed since their last evaluation are re-evaluated, and every node
+    /// is visited at most once per outermost update call, so shared subexpressions are not traversed again.
+    void update()
+    {
+        UpdatePass pass;
+        if(updatePass == pass.id()) return;
+        updatePass = pass.id();
+        if(updateOperands() > version) {
+            evaluate();
+            version = nextUpdateStamp();
+        }
+    }
+
+    /// Update the operands of this expression and return the latest version among them.
+    virtual auto updateOperands() -> size_t { return 0; }
+
+    /// Recompute the value of this expression from the current values of its operands.
+    virtual void evaluate() {}
 };
 
+/// Define Expr::propagate and Expr::capture of an expression node from its member template propagateTo(wprime, to),
+/// in which to(operand, w) hands the share w of wprime to an operand. propagate recurses into the operands as usual,
+/// while capture only records them, so the default propagation path carries no check for capture.
+#define AUTODIFF_DEFINE_EXPR_PROPAGATE                                                                                          \
+    void propagate(const T& wprime) override                                                                                    \
+    {                                                                                                                           \
+        propagateTo(wprime, [](const ExprPtr<T>& e, const T& w) { e->propagate(w); });                                          \
+    }                                                                                                                           \
+    void capture(const T& wprime, PropagationRecords<T>& records) override                                                     \
+    {                                                                                                                           \
+        propagateTo(wprime, [&](const ExprPtr<T>& e, const T& w) { records.emplace_back(e.get(), w); });                       \
+    }
+
 /// The node in the expression tree representing either an independent or dependent variable.
 template<typename T>
 struct VariableExpr : Expr<T>
@@ -207,16 +276,18 @@ struct IndependentVariableExpr : VariableExpr<T>
     /// Construct an IndependentVariableExpr object with given value.
     IndependentVariableExpr(const T& v) : VariableExpr<T>(v) {}
 
-    void propagate(const T& wprime) override {
+    void propagate(const T& wprime) override
+    {
         if(gradPtr) { *gradPtr += wprime; }
     }
 
+    /// A leaf has no operands to record, and the bound gradient is only written by propagate.
+    void capture(const T&, PropagationRecords<T>&) override {}
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         if(gradxPtr) { *gradxPtr = *gradxPtr + wprime; }
     }
-
-    void update() override {}
 };
 
 /// The node in the expression tree representing a dependent variable.
@@ -238,15 +309,26 @@ struct DependentVariableExpr : VariableExpr<T>
         expr->propagate(wprime);
     }
 
+    /// Records the defining expression only; the bound gradient is only written by propagate.
+    void capture(const T& wprime, PropagationRecords<T>& records) override
+    {
+        records.emplace_back(expr.get(), wprime);
+    }
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         if(gradxPtr) { *gradxPtr = *gradxPtr + wprime; }
         expr->propagatex(wprime);
     }
 
-    void update() override
+    auto updateOperands() -> size_t override
     {
         expr->update();
+        return expr->version;
+    }
+
+    void evaluate() override
+    {
         this->val = expr->val;
     }
 };
@@ -256,13 +338,14 @@ struct ConstantExpr : Expr<T>
 {
     using Expr<T>::Expr;
 
-    void propagate([[maybe_unused]] const T& wprime) override
+    template<typename To>
+    void propagateTo([[maybe_unused]] const T& wprime, To&&)
     {}
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex([[maybe_unused]] const ExprPtr<T>& wprime) override
     {}
-
-    void update() override {}
 };
 
 template<typename T> ExprPtr<T> constant(const T& val) { return std::make_shared<ConstantExpr<T>>(val); }
@@ -273,6 +356,12 @@ struct UnaryExpr : Expr<T>
     ExprPtr<T> x;
 
     UnaryExpr(const T& v, const ExprPtr<T>& e) : Expr<T>(v), x(e) {}
+
+    auto updateOperands() -> size_t override
+    {
+        x->update();
+        return x->version;
+    }
 };
 
 template<typename T>
@@ -283,19 +372,21 @@ struct NegativeExpr : UnaryExpr<T>
 
     using UnaryExpr<T>::UnaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(-wprime);
+        to(x, -wprime);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(-wprime);
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = -x->val;
     }
 };
@@ -306,6 +397,13 @@ struct BinaryExpr : Expr<T>
     ExprPtr<T> l, r;
 
     BinaryExpr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : Expr<T>(v), l(ll), r(rr) {}
+
+    auto updateOperands() -> size_t override
+    {
+        l->update();
+        r->update();
+        return std::max(l->version, r->version);
+    }
 };
 
 template<typename T>
@@ -314,6 +412,14 @@ struct TernaryExpr : Expr<T>
     ExprPtr<T> l, c, r;
 
     TernaryExpr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& cc, const ExprPtr<T>& rr) : Expr<T>(v), l(ll), c(cc), r(rr) {}
+
+    auto updateOperands() -> size_t override
+    {
+        l->update();
+        c->update();
+        r->update();
+        return std::max({ l->version, c->version, r->version });
+    }
 };
 
 template<typename T>
@@ -325,22 +431,23 @@ struct AddExpr : BinaryExpr<T>
 
     using BinaryExpr<T>::BinaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime);
-        r->propagate(wprime);
+        to(l, wprime);
+        to(r, wprime);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime);
         r->propagatex(wprime);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = l->val + r->val;
     }
 };
@@ -353,22 +460,23 @@ struct SubExpr : BinaryExpr<T>
     using BinaryExpr<T>::r;
     using BinaryExpr<T>::BinaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime);
-        r->propagate(-wprime);
+        to(l, wprime);
+        to(r, -wprime);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime);  // (l - r)'l =  l'
         r->propagatex(-wprime); // (l - r)'r = -r'
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = l->val - r->val;
     }
 };
@@ -381,22 +489,23 @@ struct MulExpr : BinaryExpr<T>
     using BinaryExpr<T>::r;
     using BinaryExpr<T>::BinaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime * r->val); // (l * r)'l = w' * r
-        r->propagate(wprime * l->val); // (l * r)'r = l * w'
+        to(l, wprime * r->val); // (l * r)'l = w' * r
+        to(r, wprime * l->val); // (l * r)'r = l * w'
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime * r);
         r->propagatex(wprime * l);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = l->val * r->val;
     }
 };
@@ -409,14 +518,17 @@ struct DivExpr : BinaryExpr<T>
     using BinaryExpr<T>::r;
     using BinaryExpr<T>::BinaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto aux1 = 1.0 / r->val;
         const auto aux2 = -l->val * aux1 * aux1;
-        l->propagate(wprime * aux1);
-        r->propagate(wprime * aux2);
+        to(l, wprime * aux1);
+        to(r, wprime * aux2);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux1 = 1.0 / r;
@@ -425,10 +537,8 @@ struct DivExpr : BinaryExpr<T>
         r->propagatex(wprime * aux2);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = l->val / r->val;
     }
 };
@@ -441,19 +551,21 @@ struct SinExpr : UnaryExpr<T>
 
     SinExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime * cos(x->val));
+        to(x, wprime * cos(x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime * cos(x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = sin(x->val);
     }
 };
@@ -466,19 +578,21 @@ struct CosExpr : UnaryExpr<T>
 
     CosExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(-wprime * sin(x->val));
+        to(x, -wprime * sin(x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(-wprime * sin(x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = cos(x->val);
     }
 };
@@ -491,21 +605,23 @@ struct TanExpr : UnaryExpr<T>
 
     TanExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto aux = 1.0 / cos(x->val);
-        x->propagate(wprime * aux * aux);
+        to(x, wprime * aux * aux);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux = 1.0 / cos(x);
         x->propagatex(wprime * aux * aux);
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = tan(x->val);
     }
 };
@@ -518,19 +634,21 @@ struct SinhExpr : UnaryExpr<T>
 
     SinhExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime * cosh(x->val));
+        to(x, wprime * cosh(x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime * cosh(x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = sinh(x->val);
     }
 };
@@ -543,19 +661,21 @@ struct CoshExpr : UnaryExpr<T>
 
     CoshExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime * sinh(x->val));
+        to(x, wprime * sinh(x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime * sinh(x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = cosh(x->val);
     }
 };
@@ -568,21 +688,23 @@ struct TanhExpr : UnaryExpr<T>
 
     TanhExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto aux = 1.0 / cosh(x->val);
-        x->propagate(wprime * aux * aux);
+        to(x, wprime * aux * aux);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux = 1.0 / cosh(x);
         x->propagatex(wprime * aux * aux);
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = tanh(x->val);
     }
 };
@@ -595,19 +717,21 @@ struct ArcSinExpr : UnaryExpr<T>
 
     ArcSinExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime / sqrt(1.0 - x->val * x->val));
+        to(x, wprime / sqrt(1.0 - x->val * x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime / sqrt(1.0 - x * x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = asin(x->val);
     }
 };
@@ -620,19 +744,21 @@ struct ArcCosExpr : UnaryExpr<T>
 
     ArcCosExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(-wprime / sqrt(1.0 - x->val * x->val));
+        to(x, -wprime / sqrt(1.0 - x->val * x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(-wprime / sqrt(1.0 - x * x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = acos(x->val);
     }
 };
@@ -645,19 +771,21 @@ struct ArcTanExpr : UnaryExpr<T>
 
     ArcTanExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime / (1.0 + x->val * x->val));
+        to(x, wprime / (1.0 + x->val * x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime / (1.0 + x * x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = atan(x->val);
     }
 };
@@ -671,13 +799,16 @@ struct ArcTan2Expr : BinaryExpr<T>
 
     ArcTan2Expr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : BinaryExpr<T>(v, ll, rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto aux = wprime / (l->val * l->val + r->val * r->val);
-        l->propagate(r->val * aux);
-        r->propagate(-l->val * aux);
+        to(l, r->val * aux);
+        to(r, -l->val * aux);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux = wprime / (l * l + r * r);
@@ -685,10 +816,8 @@ struct ArcTan2Expr : BinaryExpr<T>
         r->propagatex(-l * aux);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = atan2(l->val, r->val);
     }
 };
@@ -701,19 +830,21 @@ struct ExpExpr : UnaryExpr<T>
     using UnaryExpr<T>::val;
     using UnaryExpr<T>::x;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime * val); // exp(x)' = exp(x) * x'
+        to(x, wprime * val); // exp(x)' = exp(x) * x'
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime * exp(x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = exp(x->val);
     }
 };
@@ -725,19 +856,21 @@ struct LogExpr : UnaryExpr<T>
     using UnaryExpr<T>::x;
     using UnaryExpr<T>::UnaryExpr;
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime / x->val); // log(x)' = x'/x
+        to(x, wprime / x->val); // log(x)' = x'/x
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime / x);
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = log(x->val);
     }
 };
@@ -752,19 +885,21 @@ struct Log10Expr : UnaryExpr<T>
 
     Log10Expr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime / (ln10 * x->val));
+        to(x, wprime / (ln10 * x->val));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime / (ln10 * x));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = log10(x->val);
     }
 };
@@ -781,18 +916,21 @@ struct PowExpr : BinaryExpr<T>
 
     PowExpr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : BinaryExpr<T>(v, ll, rr), log_l(log(ll->val)) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         using U = VariableValueType<T>;
         constexpr auto zero = U(0.0);
         const auto lval = l->val;
         const auto rval = r->val;
         const auto aux = wprime * pow(lval, rval - 1);
-        l->propagate(aux * rval);
+        to(l, aux * rval);
         const auto auxr = lval == zero ? 0.0 : lval * log(lval); // since x*log(x) -> 0 as x -> 0
-        r->propagate(aux * auxr);
+        to(r, aux * auxr);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         using U = VariableValueType<T>;
@@ -803,10 +941,8 @@ struct PowExpr : BinaryExpr<T>
         r->propagatex(aux * auxr);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = pow(l->val, r->val);
     }
 };
@@ -821,15 +957,18 @@ struct PowConstantLeftExpr : BinaryExpr<T>
 
     PowConstantLeftExpr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : BinaryExpr<T>(v, ll, rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto lval = l->val;
         const auto rval = r->val;
         const auto aux = wprime * pow(lval, rval - 1);
         const auto auxr = lval == 0.0 ? 0.0 : lval * log(lval); // since x*log(x) -> 0 as x -> 0
-        r->propagate(aux * auxr);
+        to(r, aux * auxr);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux = wprime * pow(l, r - 1);
@@ -837,9 +976,8 @@ struct PowConstantLeftExpr : BinaryExpr<T>
         r->propagatex(aux * auxr);
     }
 
-    void update() override
+    void evaluate() override
     {
-        r->update();
         this->val = pow(l->val, r->val);
     }
 };
@@ -854,19 +992,21 @@ struct PowConstantRightExpr : BinaryExpr<T>
 
     PowConstantRightExpr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : BinaryExpr<T>(v, ll, rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime * pow(l->val, r->val - 1) * r->val); // pow(l, r)'l = r * pow(l, r - 1) * l'
+        to(l, wprime * pow(l->val, r->val - 1) * r->val); // pow(l, r)'l = r * pow(l, r - 1) * l'
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime * pow(l, r - 1) * r);
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
         this->val = pow(l->val, r->val);
     }
 };
@@ -879,19 +1019,21 @@ struct SqrtExpr : UnaryExpr<T>
 
     SqrtExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        x->propagate(wprime / (2.0 * sqrt(x->val))); // sqrt(x)' = 1/2 * 1/sqrt(x) * x'
+        to(x, wprime / (2.0 * sqrt(x->val))); // sqrt(x)' = 1/2 * 1/sqrt(x) * x'
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         x->propagatex(wprime / (2.0 * sqrt(x)));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = sqrt(x->val);
     }
 };
@@ -905,13 +1047,16 @@ struct AbsExpr : UnaryExpr<T>
 
     AbsExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        if(x->val < 0.0) x->propagate(-wprime);
-        else if(x->val > 0.0) x->propagate(wprime);
-        else x->propagate(T(0));
+        if(x->val < 0.0) to(x, -wprime);
+        else if(x->val > 0.0) to(x, wprime);
+        else to(x, T(0));
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         if(x->val < 0.0) x->propagatex(-wprime);
@@ -919,9 +1064,8 @@ struct AbsExpr : UnaryExpr<T>
         else x->propagate(T(0));
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = abs(x->val);
     }
 };
@@ -936,21 +1080,23 @@ struct ErfExpr : UnaryExpr<T>
 
     ErfExpr(const T& v, const ExprPtr<T>& e) : UnaryExpr<T>(v, e) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
         const auto aux = 2.0 / sqrt_pi * exp(-(x->val) * (x->val)); // erf(x)' = 2/sqrt(pi) * exp(-x * x) * x'
-        x->propagate(wprime * aux);
+        to(x, wprime * aux);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         const auto aux = 2.0 / sqrt_pi * exp(-x * x);
         x->propagatex(wprime * aux);
     }
 
-    void update() override
+    void evaluate() override
     {
-        x->update();
         this->val = erf(x->val);
     }
 };
@@ -965,22 +1111,23 @@ struct Hypot2Expr : BinaryExpr<T>
 
     Hypot2Expr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : BinaryExpr<T>(v, ll, rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime * l->val / val); // sqrt(l*l + r*r)'l = 1/2 * 1/sqrt(l*l + r*r) * (2*l*l') = (l*l')/sqrt(l*l + r*r)
-        r->propagate(wprime * r->val / val); // sqrt(l*l + r*r)'r = 1/2 * 1/sqrt(l*l + r*r) * (2*r*r') = (r*r')/sqrt(l*l + r*r)
+        to(l, wprime * l->val / val); // sqrt(l*l + r*r)'l = 1/2 * 1/sqrt(l*l + r*r) * (2*l*l') = (l*l')/sqrt(l*l + r*r)
+        to(r, wprime * r->val / val); // sqrt(l*l + r*r)'r = 1/2 * 1/sqrt(l*l + r*r) * (2*r*r') = (r*r')/sqrt(l*l + r*r)
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime * l / hypot(l, r));
         r->propagatex(wprime * r / hypot(l, r));
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        r->update();
         this->val = hypot(l->val, r->val);
     }
 };
@@ -996,13 +1143,16 @@ struct Hypot3Expr : TernaryExpr<T>
 
     Hypot3Expr(const T& v, const ExprPtr<T>& ll, const ExprPtr<T>& cc, const ExprPtr<T>& rr) : TernaryExpr<T>(v, ll, cc, rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        l->propagate(wprime * l->val / val);
-        c->propagate(wprime * c->val / val);
-        r->propagate(wprime * r->val / val);
+        to(l, wprime * l->val / val);
+        to(c, wprime * c->val / val);
+        to(r, wprime * r->val / val);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(wprime * l / hypot(l, c, r));
@@ -1010,11 +1160,8 @@ struct Hypot3Expr : TernaryExpr<T>
         r->propagatex(wprime * r / hypot(l, c, r));
     }
 
-    void update() override
+    void evaluate() override
     {
-        l->update();
-        c->update();
-        r->update();
         this->val = hypot(l->val, c->val, r->val);
     }
 };
@@ -1065,28 +1212,35 @@ struct ConditionalExpr : Expr<T>
 
     ConditionalExpr(const BooleanExpr& wrappedPred, const ExprPtr<T>& ll, const ExprPtr<T>& rr) : Expr<T>(wrappedPred ? ll->val : rr->val), predicate(wrappedPred), l(ll), r(rr) {}
 
-    void propagate(const T& wprime) override
+    template<typename To>
+    void propagateTo(const T& wprime, To&& to)
     {
-        if(predicate.val) l->propagate(wprime);
-        else r->propagate(wprime);
+        if(predicate.val) to(l, wprime);
+        else to(r, wprime);
     }
 
+    AUTODIFF_DEFINE_EXPR_PROPAGATE
+
     void propagatex(const ExprPtr<T>& wprime) override
     {
         l->propagatex(derive(wprime, constant<T>(0.0)));
         r->propagatex(derive(constant<T>(0.0), wprime));
     }
 
-    void update() override
+    auto updateOperands() -> size_t override
     {
+        // The predicate may depend on expressions other than l and r, so it is
+        // always re-evaluated, and a change of branch counts as a change of value.
+        const bool previous = predicate.val;
         predicate.update();
-        if(predicate.val) {
-            l->update();
-            this->val = l->val;
-        } else {
-            r->update();
-            this->val = r->val;
-        }
+        const auto& selected = predicate.val ? l : r;
+        selected->update();
+        return predicate.val != previous ? nextUpdateStamp() : selected->version;
+    }
+
+    void evaluate() override
+    {
+        this->val = predicate.val ? l->val : r->val;
     }
 
     ExprPtr<T> derive(const ExprPtr<T>& left, const ExprPtr<T>& right) const {
@@ -1094,6 +1248,8 @@ struct ConditionalExpr : Expr<T>
     }
 };
 
+#undef AUTODIFF_DEFINE_EXPR_PROPAGATE
+
 //------------------------------------------------------------------------------
 // CONVENIENT FUNCTIONS
 //------------------------------------------------------------------------------
@@ -1209,10 +1365,11 @@ struct Variable
     /// Update the value of this variable with changes in its expression tree
     void update() { expr->update(); }
 
+    /// Change the value of this independent variable, so that the next update of dependent variables re-evaluates its downstream expressions
     void update(T value) {
       if(auto independentExpr = std::dynamic_pointer_cast<IndependentVariableExpr<T>>(expr)) {
         independentExpr->val = value;
-        independentExpr->update();
+        independentExpr->version = nextUpdateStamp();
       } else {
         throw std::logic_error("Cannot update the value of a dependent expression stored in a variable");
       }
@@ -1484,6 +1641,129 @@ auto derivativesx(const Variable<T>& y, const Wrt<Vars...>& wrt)
     return values;
 }
 
+/// Propagate the adjoints of several dependent expressions down their common expression tree in a single topological sweep.
+/// Expression ys[k] is seeded with row k of the ys.size() x width matrix @p seeds (row-major), so that every node carries
+/// @p width adjoints at once and is visited exactly once, after all expressions using it. Return the xs.size() x width
+/// matrix (row-major) with the resulting adjoints of expressions @p xs (zero for those not in the tree).
+template<typename T>
+auto propagate_adjoints(const std::vector<Expr<T>*>& ys, const std::vector<T>& seeds, size_t width, const std::vector<Expr<T>*>& xs) -> std::vector<T>
+{
+    assert(seeds.size() == ys.size() * width);
+
+    // Discover the nodes of the tree together with the partial derivatives of each node w.r.t. its operands
+    std::vector<Expr<T>*> nodes;
+    std::unordered_map<Expr<T>*, size_t> index;
+    std::vector<std::pair<size_t, T>> operands; // the (operand node, partial derivative) pairs of all nodes
+    std::vector<size_t> offsets = { 0 };        // the operands of node i are in [offsets[i], offsets[i + 1])
+
+    auto discover = [&](Expr<T>* e) {
+        auto [it, inserted] = index.emplace(e, nodes.size());
+        if(inserted) nodes.push_back(e);
+        return it->second;
+    };
+
+    for(auto* y : ys)
+        discover(y);
+
+    PropagationRecords<T> captured;
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        captured.clear();
+        nodes[i]->capture(T(1.0), captured);
+        for(auto& [e, partial] : captured)
+            operands.emplace_back(discover(e), partial);
+        offsets.push_back(operands.size());
+    }
+
+    // Count the expressions using each node, so that a node is processed only after all of them
+    std::vector<size_t> users(nodes.size(), 0);
+    for(const auto& operand : operands)
+        ++users[operand.first];
+
+    std::vector<T> adjoints(nodes.size() * width, T(0.0));
+    for(size_t k = 0; k < ys.size(); ++k)
+        for(size_t j = 0; j < width; ++j)
+            adjoints[index[ys[k]] * width + j] += seeds[k * width + j];
+
+    std::vector<size_t> ready;
+    for(size_t i = 0; i < nodes.size(); ++i)
+        if(users[i] == 0) ready.push_back(i);
+
+    while(!ready.empty()) {
+        const size_t i = ready.back();
+        ready.pop_back();
+        const T* wi = &adjoints[i * width];
+        for(size_t e = offsets[i]; e < offsets[i + 1]; ++e) {
+            const auto& [k, partial] = operands[e];
+            T* wk = &adjoints[k * width];
+            for(size_t j = 0; j < width; ++j)
+                wk[j] += partial * wi[j];
+            if(--users[k] == 0) ready.push_back(k);
+        }
+    }
+
+    std::vector<T> result(xs.size() * width, T(0.0));
+    for(size_t i = 0; i < xs.size(); ++i) {
+        const auto it = index.find(xs[i]);
+        if(it != index.end())
+            std::copy_n(&adjoints[it->second * width], width, &result[i * width]);
+    }
+    return result;
+}
+
+/// Return the expression nodes of the variables in a wrt list.
+template<typename... Vars>
+auto wrt_exprs(const Wrt<Vars...>& wrt)
+{
+    using T = std::decay_t<decltype(std::get<0>(wrt.args).expr->val)>;
+    std::vector<Expr<T>*> xs;
+    For<sizeof...(Vars)>([&](auto i) constexpr {
+        xs.push_back(std::get<i>(wrt.args).expr.get());
+    });
+    return xs;
+}
+
+/// Return the Jacobian matrix of dependent variables ys with respect to given independent variables.
+/// All rows are computed together in a single sweep over the common expression tree of ys.
+template<typename T, size_t M, typename... Vars>
+auto jacobian(const std::array<Variable<T>, M>& ys, const Wrt<Vars...>& wrt)
+{
+    constexpr auto N = sizeof...(Vars);
+
+    std::vector<Expr<T>*> yexprs;
+    for(const auto& y : ys)
+        yexprs.push_back(y.expr.get());
+
+    std::vector<T> seeds(M * M, T(0.0)); // the identity matrix, so that row k of the Jacobian is carried in lane k
+    for(size_t k = 0; k < M; ++k)
+        seeds[k * M + k] = T(1.0);
+
+    const auto adjoints = propagate_adjoints(yexprs, seeds, M, wrt_exprs(wrt));
+
+    std::array<std::array<T, N>, M> J;
+    for(size_t k = 0; k < M; ++k)
+        for(size_t i = 0; i < N; ++i)
+            J[k][i] = adjoints[i * M + k];
+    return J;
+}
+
+/// Return the vector-Jacobian product of dependent variables ys with cotangent vector v, i.e. the derivatives of
+/// v[0]*ys[0] + ... + v[M-1]*ys[M-1] with respect to given independent variables, in a single sweep.
+template<typename T, size_t M, typename... Vars>
+auto vjp(const std::array<Variable<T>, M>& ys, const std::array<T, M>& v, const Wrt<Vars...>& wrt)
+{
+    constexpr auto N = sizeof...(Vars);
+
+    std::vector<Expr<T>*> yexprs;
+    for(const auto& y : ys)
+        yexprs.push_back(y.expr.get());
+
+    const auto adjoints = propagate_adjoints(yexprs, std::vector<T>(v.begin(), v.end()), 1, wrt_exprs(wrt));
+
+    std::array<T, N> values;
+    std::copy_n(adjoints.begin(), N, values.begin());
+    return values;
+}
+
 /// Output a Variable object to the output stream.
 template<typename T>
 std::ostream& operator<<(std::ostream& out, const Variable<T>& x)
@@ -1530,6 +1810,8 @@ using HigherOrderVariable = typename AuxHigherOrderVariable<N, T>::type;
 
 using reverse::detail::wrt;
 using reverse::detail::derivatives;
+using reverse::detail::jacobian;
+using reverse::detail::vjp;
 using reverse::detail::Variable;
 using reverse::detail::val;
 
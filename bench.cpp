@@ -0,0 +1,889 @@
+#include "catch_amalgamated.hpp"
+#include <autodiff/forward/dual.hpp>
+#include <autodiff/forward/real.hpp>
+#include <autodiff/reverse/var.hpp>
+#include "saka.h"
+#include "saka_backward.h"
+#include "saka_grad_buffer.h"
+#include "saka_bsdf.h"
+#include "saka_texture.h"
+#include "saka_wavefront.h"
+#include "saka_sort.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Cross-engine microbenchmarks.
+// Every kernel is evaluated on each AD engine together with the derivative of its output w.r.t. its first input.
+// Catch2 reports ns/eval, and the allocation counters below report allocations per eval and peak heap bytes per eval.
+// See the regression namespace at the bottom for the baseline comparison mode.
+
+// Allocation tracking
+namespace bench
+{
+    std::atomic<size_t> g_allocations = 0;
+    std::atomic<size_t> g_liveBytes = 0;
+    std::atomic<size_t> g_peakBytes = 0;
+
+    // Every block carries its size in front of it so that delete can account for it.
+    constexpr size_t kHeader = alignof(std::max_align_t);
+
+    inline void* allocate(size_t size)
+    {
+        char* p = (char*)std::malloc(size + kHeader);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        *(size_t*)p = size;
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        size_t live = g_liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = g_peakBytes.load(std::memory_order_relaxed);
+        while (peak < live && !g_peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            ;
+        return p + kHeader;
+    }
+    inline void deallocate(void* ptr)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+        char* p = (char*)ptr - kHeader;
+        g_liveBytes.fetch_sub(*(size_t*)p, std::memory_order_relaxed);
+        std::free(p);
+    }
+}
+
+void* operator new(size_t size) { return bench::allocate(size); }
+void* operator new[](size_t size) { return bench::allocate(size); }
+void operator delete(void* p) noexcept { bench::deallocate(p); }
+void operator delete[](void* p) noexcept { bench::deallocate(p); }
+void operator delete(void* p, size_t) noexcept { bench::deallocate(p); }
+void operator delete[](void* p, size_t) noexcept { bench::deallocate(p); }
+
+namespace bench
+{
+    struct Inputs
+    {
+        float v[6];
+    };
+
+    // Random inputs in [lo, hi), rotated through by the benchmarks so that nothing is constant folded.
+    inline std::vector<Inputs> makeInputs(float lo, float hi)
+    {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> u(lo, hi);
+        std::vector<Inputs> inputs(1024);
+        for (Inputs& in : inputs)
+        {
+            for (float& v : in.v)
+            {
+                v = u(rng);
+            }
+        }
+        return inputs;
+    }
+
+    // Evaluate f once per input and print allocations per eval and the peak heap growth during a single eval.
+    template <class F>
+    void reportMemory(const char* name, const std::vector<Inputs>& inputs, F f)
+    {
+        size_t allocations = 0;
+        size_t peak = 0;
+        for (const Inputs& in : inputs)
+        {
+            size_t live = g_liveBytes.load();
+            g_peakBytes.store(live);
+            size_t a = g_allocations.load();
+            volatile float r = f(in);
+            (void)r;
+            allocations += g_allocations.load() - a;
+            peak = std::max(peak, g_peakBytes.load() - live);
+        }
+        printf("    %-24s %8.2f allocs/eval %8zu peak bytes/eval\n", name, (double)allocations / inputs.size(), peak);
+    }
+}
+
+// Generic kernels for the engines without their own vector type, mirroring saka.h.
+namespace kernels
+{
+    template <class S>
+    S simple_0(S x)
+    {
+        return x * x;
+    }
+    template <class S>
+    S simple_1(S x)
+    {
+        return exp(x * x);
+    }
+    template <class S>
+    S complex_0(S x, S y, S z)
+    {
+        return 1.0f + x + y + z + x * y + y * z + x * z + x * y * z + exp(x / y + y / z);
+    }
+    template <class S>
+    S complex_1(S x, S y, S z)
+    {
+        return (x + y + z) * exp(x * y * z);
+    }
+
+    template <class S>
+    struct vec3
+    {
+        S x, y, z;
+    };
+    template <class S>
+    S dot(const vec3<S>& a, const vec3<S>& b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+    template <class S>
+    vec3<S> reflection(const vec3<S>& wi, const vec3<S>& n)
+    {
+        S s = dot(wi, n) * 2.0f / dot(n, n);
+        return { n.x * s - wi.x, n.y * s - wi.y, n.z * s - wi.z };
+    }
+
+    inline float primal(float x) { return x; }
+    inline float primal(const saka::ValRef& x) { return x.m_impl->value; }
+    inline float primal(const autodiff::dual& x) { return (float)x.val; }
+    inline float primal(const autodiff::real& x) { return (float)x[0]; }
+    inline float primal(const autodiff::var& x) { return (float)autodiff::val(x); }
+
+    template <class S>
+    vec3<S> refraction_norm_free(const vec3<S>& wi, const vec3<S>& n, float eta)
+    {
+        S NoN = dot(n, n);
+        S WIoN = dot(wi, n);
+        S WoW = dot(wi, wi);
+        S k = NoN * WoW * (eta * eta - 1.0f) + WIoN * WIoN;
+        if (primal(k) < 0.0f)
+        {
+            return { S(0.0f), S(0.0f), S(0.0f) };
+        }
+        S a = WIoN - sqrt(k);
+        return { n.x * a - wi.x * NoN, n.y * a - wi.y * NoN, n.z * a - wi.z * NoN };
+    }
+
+    template <class S>
+    S optics(const vec3<S>& wi, const vec3<S>& n)
+    {
+        vec3<S> r = reflection(wi, n);
+        vec3<S> t = refraction_norm_free(wi, n, 1.5f);
+        return r.x + r.y + r.z + t.x + t.y + t.z;
+    }
+}
+
+// The dval3 version of kernels::optics, on the saka.h primitives themselves.
+inline saka::dval optics_dval3(saka::dval3 wi, saka::dval3 n)
+{
+    using namespace saka;
+    dval3 r = reflection(wi, n);
+    dval3 t = refraction_norm_free(wi, n, 1.5f);
+    return r.x + r.y + r.z + t.x + t.y + t.z;
+}
+
+// Call visit(engineName, eval) for every engine, where eval(inputs) evaluates the kernel of `Arity` scalar inputs
+// and returns d(output)/d(first input).
+template <int Arity, class SakaF, class GenericF, class Visitor>
+void forEachEngine(SakaF sakaKernel, GenericF genericKernel, Visitor visit)
+{
+    using namespace bench;
+
+    visit("saka::dval", [=](const Inputs& in) {
+        saka::dval xs[6];
+        for (int i = 0; i < Arity; i++)
+        {
+            xs[i] = saka::dval(in.v[i]);
+        }
+        xs[0].requires_grad();
+        return sakaKernel(xs).g;
+    });
+    visit("saka::ValRef", [=](const Inputs& in) {
+        saka::ValRef xs[6];
+        for (int i = 0; i < Arity; i++)
+        {
+            xs[i] = saka::ValRef(in.v[i]);
+        }
+        saka::ValRef y = genericKernel(xs);
+        y.backward();
+        return xs[0].derivative();
+    });
+    visit("autodiff::dual", [=](const Inputs& in) {
+        autodiff::dual xs[6];
+        for (int i = 0; i < Arity; i++)
+        {
+            xs[i] = in.v[i];
+        }
+        autodiff::detail::seed<1>(xs[0], 1.0);
+        return (float)autodiff::derivative<1>(genericKernel(xs));
+    });
+    visit("autodiff::real", [=](const Inputs& in) {
+        autodiff::real xs[6];
+        for (int i = 0; i < Arity; i++)
+        {
+            xs[i] = in.v[i];
+        }
+        xs[0][1] = 1.0;
+        return (float)genericKernel(xs)[1];
+    });
+    visit("autodiff::var", [=](const Inputs& in) {
+        autodiff::var xs[6];
+        for (int i = 0; i < Arity; i++)
+        {
+            xs[i] = in.v[i];
+        }
+        autodiff::var y = genericKernel(xs);
+        auto [dydx] = autodiff::derivatives(y, autodiff::reverse::detail::wrt(xs[0]));
+        return (float)dydx;
+    });
+}
+
+// Call visit(kernelName, engineName, inputs, eval) for every kernel on every engine.
+template <class Visitor>
+void forEachCase(Visitor visit)
+{
+    std::vector<bench::Inputs> inputs;
+
+    inputs = bench::makeInputs(0.0f, 1.0f);
+    forEachEngine<1>(
+        [](const saka::dval* x) { return kernels::simple_0(x[0]); },
+        [](const auto* x) { return kernels::simple_0(x[0]); },
+        [&](const char* engine, auto eval) { visit("simple_0", engine, inputs, eval); });
+    forEachEngine<1>(
+        [](const saka::dval* x) { return kernels::simple_1(x[0]); },
+        [](const auto* x) { return kernels::simple_1(x[0]); },
+        [&](const char* engine, auto eval) { visit("simple_1", engine, inputs, eval); });
+
+    inputs = bench::makeInputs(1.0f, 2.0f);
+    forEachEngine<3>(
+        [](const saka::dval* x) { return kernels::complex_0(x[0], x[1], x[2]); },
+        [](const auto* x) { return kernels::complex_0(x[0], x[1], x[2]); },
+        [&](const char* engine, auto eval) { visit("complex_0", engine, inputs, eval); });
+
+    inputs = bench::makeInputs(-1.0f, 1.0f);
+    forEachEngine<3>(
+        [](const saka::dval* x) { return kernels::complex_1(x[0], x[1], x[2]); },
+        [](const auto* x) { return kernels::complex_1(x[0], x[1], x[2]); },
+        [&](const char* engine, auto eval) { visit("complex_1", engine, inputs, eval); });
+    forEachEngine<6>(
+        [](const saka::dval* x) { return optics_dval3({ x[0], x[1], x[2] }, { x[3], x[4], x[5] }); },
+        [](const auto* x) {
+            using S = std::remove_const_t<std::remove_pointer_t<decltype(x)>>;
+            return kernels::optics<S>({ x[0], x[1], x[2] }, { x[3], x[4], x[5] });
+        },
+        [&](const char* engine, auto eval) { visit("optics", engine, inputs, eval); });
+}
+
+TEST_CASE("engines agree", "[bench]") {
+    // All engines have to agree before their timings are worth comparing. autodiff::dual is the reference.
+    std::map<std::string, std::vector<float>> reference;
+    forEachCase([&](const char* kernel, const char* engine, const std::vector<bench::Inputs>& inputs, auto eval) {
+        if (std::string(engine) != "autodiff::dual")
+        {
+            return;
+        }
+        for (const bench::Inputs& in : inputs)
+        {
+            reference[kernel].push_back(eval(in));
+        }
+    });
+    forEachCase([&](const char* kernel, const char* engine, const std::vector<bench::Inputs>& inputs, auto eval) {
+        INFO(kernel << " / " << engine);
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            REQUIRE(eval(inputs[i]) == Catch::Approx(reference[kernel][i]).epsilon(1.0e-3));
+        }
+    });
+}
+
+TEST_CASE("engines", "[bench]") {
+    forEachCase([](const char* kernel, const char* engine, const std::vector<bench::Inputs>& inputs, auto eval) {
+        std::string name = std::string(kernel) + " / " + engine;
+        size_t i = 0;
+        BENCHMARK(name.c_str()) { return eval(inputs[i++ % inputs.size()]); };
+        bench::reportMemory(name.c_str(), inputs, eval);
+    });
+}
+
+// every worker of the pool splats 64k tangents into 4096 parameters
+TEST_CASE("scatter", "[bench]") {
+    saka::WorkStealingPool pool;
+    const int size = 4096;
+    const int tasks = 64;
+    const int addsPerTask = 1024;
+    auto target = [](int task, int i) { return (task * 7919 + i * 104729) % size; };
+
+    std::vector<std::atomic<float>> atomics(size);
+    BENCHMARK("atomic<float> compare exchange") {
+        pool.run(tasks, [&](int task, int) {
+            for (int i = 0; i < addsPerTask; i++)
+            {
+                std::atomic<float>& a = atomics[target(task, i)];
+                float expected = a.load(std::memory_order_relaxed);
+                while (!a.compare_exchange_weak(expected, expected + 1.0f, std::memory_order_relaxed))
+                {
+                }
+            }
+        });
+        return atomics[0].load();
+    };
+
+    saka::grad_buffer buffer(size, pool.threadCount());
+    std::vector<float> reduced(size);
+    BENCHMARK("grad_buffer add + reduce") {
+        pool.run(tasks, [&](int task, int worker) {
+            for (int i = 0; i < addsPerTask; i++)
+            {
+                buffer.add(worker, target(task, i), 1.0f);
+            }
+        });
+        buffer.reduce(reduced.data(), &pool);
+        return reduced[0];
+    };
+}
+
+// The fused BSDF terms against the same GGX conductor BRDF composed of dval operations
+namespace composed
+{
+    using namespace saka;
+    dval lambda_r(dval a, dval c)
+    {
+        return sqrt(a * a + (1.0f - a * a) * c * c);
+    }
+    dval ggx_conductor_brdf(dval3 wi, dval3 wo, dval alpha, dval eta, dval k)
+    {
+        dval3 h = normalize(wi + wo);
+        dval d = h.z * h.z * (alpha * alpha - 1.0f) + 1.0f;
+        dval D = alpha * alpha / (3.14159265f * d * d);
+        dval G = 2.0f * wi.z * wo.z / (wo.z * lambda_r(alpha, wi.z) + wi.z * lambda_r(alpha, wo.z));
+        dval c = dot(h, wi);
+        dval s2 = 1.0f - c * c;
+        dval A = eta * eta - k * k - s2;
+        dval t = sqrt(A * A + 4.0f * eta * eta * k * k);
+        dval a = sqrt(0.5f * (t + A));
+        dval rs = (t - 2.0f * a * c + c * c) / (t + 2.0f * a * c + c * c);
+        dval rp = rs * (c * c * t - 2.0f * a * c * s2 + s2 * s2) / (c * c * t + 2.0f * a * c * s2 + s2 * s2);
+        dval F = 0.5f * (rs + rp);
+        return D * G * F / (wi.z * wo.z * 4.0f);
+    }
+}
+
+TEST_CASE("bsdf", "[bench]") {
+    const int count = 1024;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::vector<float> w[6];
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            float z = 0.05f + 0.95f * u(rng);
+            float phi = 6.2831853f * u(rng);
+            float r = std::sqrt(1.0f - z * z);
+            w[j * 3 + 0].push_back(r * std::cos(phi));
+            w[j * 3 + 1].push_back(r * std::sin(phi));
+            w[j * 3 + 2].push_back(z);
+        }
+    }
+    saka::BsdfSamples samples = { w[0].data(), w[1].data(), w[2].data(), w[3].data(), w[4].data(), w[5].data(), count };
+    saka::dval alpha = 0.3f;
+    alpha.requires_grad();
+    std::vector<float> value(count), tangent(count);
+
+    BENCHMARK("ggx conductor / composed dval") {
+        for (int i = 0; i < count; i++)
+        {
+            saka::dval f = composed::ggx_conductor_brdf({ w[0][i], w[1][i], w[2][i] }, { w[3][i], w[4][i], w[5][i] }, alpha, 0.2f, 3.0f);
+            value[i] = f.v;
+            tangent[i] = f.g;
+        }
+        return tangent[0];
+    };
+    BENCHMARK("ggx conductor / fused") {
+        saka::ggx_conductor_brdf(samples, alpha, 0.2f, 3.0f, value.data(), tangent.data());
+        return tangent[0];
+    };
+}
+
+// incoherent lookups into a 1024^2 texture, forward and with the texel gradients scattered on the pool
+TEST_CASE("texture", "[bench]") {
+    saka::WorkStealingPool pool;
+    saka::Texture tex(1024, 1024);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    for (int i = 0; i < tex.size(); i++)
+    {
+        tex.data()[i] = u01(rng);
+    }
+    const int count = 1 << 16;
+    std::vector<float> u(count), v(count), adjoints(count * 3, 1.0f);
+    for (int i = 0; i < count; i++)
+    {
+        u[i] = u01(rng);
+        v[i] = u01(rng);
+    }
+
+    BENCHMARK("sample") {
+        float sum = 0.0f;
+        for (int i = 0; i < count; i++)
+        {
+            saka::dval du = u[i];
+            du.requires_grad();
+            sum += saka::sample(tex, du, v[i]).x.g;
+        }
+        return sum;
+    };
+
+    saka::grad_buffer shards(tex.size(), pool.threadCount());
+    std::vector<float> gradient(tex.size());
+    BENCHMARK("sample_backward + reduce") {
+        saka::sample_backward(tex, u.data(), v.data(), adjoints.data(), count, &shards, gradient.data(), nullptr, nullptr, &pool);
+        return gradient[0];
+    };
+}
+
+// one 128x128 pass of the glass box scene, a path per pixel sample against the staged wavefront
+TEST_CASE("tracer pass", "[bench]") {
+    saka::WorkStealingPool pool;
+    saka::TracerScene scene(saka::TracerParameter::BoxOffset, 0.0f, true);
+    saka::TracerCamera camera;
+    const int w = 128, h = 128, maxDepth = 4;
+    std::vector<float> primal(w * h * 3), tangent(w * h * 3);
+
+    BENCHMARK("megakernel") {
+        pool.run(h, [&](int y, int) {
+            for (int x = 0; x < w; x++)
+            {
+                saka::dval3 ro, rd;
+                uint64_t seed = saka::pixel_sample(camera, w, h, x, y, 0, &ro, &rd);
+                saka::dval3 L = saka::trace_path(scene, ro, rd, seed, maxDepth);
+                primal[(y * w + x) * 3] += L.x.v;
+                tangent[(y * w + x) * 3] += L.x.g;
+            }
+        });
+        return primal[0];
+    };
+
+    saka::WavefrontTracer wavefront(&pool);
+    BENCHMARK("wavefront") {
+        wavefront.render(scene, camera, w, h, 0, maxDepth, primal.data(), tangent.data());
+        return primal[0];
+    };
+    for (int i = 0; i < saka::WavefrontStats::STAGE_COUNT; i++)
+    {
+        printf("  %-10s %8.3f ms %9lld rays\n", saka::WavefrontStats::name(i), wavefront.stats().seconds[i] * 1000.0, (long long)wavefront.stats().rays[i]);
+    }
+
+    // secondary rays sorted, with the cost and the gain of every bounce against the unsorted pass
+    saka::WavefrontTracer sorted(&pool);
+    sorted.setSortBounces(0xFFFFFFFEu);
+    BENCHMARK("wavefront, bounces 1+ sorted") {
+        sorted.render(scene, camera, w, h, 0, maxDepth, primal.data(), tangent.data());
+        return primal[0];
+    };
+    printf("\n%s", sorted.stats().sortReport(wavefront.stats()).c_str());
+}
+
+// Regression mode
+// Bench --regression <baseline.json> [--update] [--tolerance 0.05] [--repeats 15]
+// Measures every kernel on every engine on a pinned thread and compares the median ns/eval with the baseline file.
+// Only --update writes the file. Returns 1 when any case is slower than baseline * (1 + tolerance) by more than three times
+// the combined median absolute deviations or has no baseline entry, 2 on usage errors and on a missing or unparseable baseline.
+namespace regression
+{
+    struct Measurement
+    {
+        double median = 0.0; // ns/eval
+        double mad = 0.0;    // median absolute deviation of the repeats
+    };
+
+    inline void pinCurrentThread()
+    {
+#if defined(_WIN32)
+        SetThreadAffinityMask(GetCurrentThread(), 1);
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    inline double median(std::vector<double> xs)
+    {
+        std::sort(xs.begin(), xs.end());
+        size_t n = xs.size();
+        return n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) * 0.5;
+    }
+
+    // Each repeat runs over the inputs as many times as it takes to fill ~10ms.
+    template <class F>
+    Measurement measure(const std::vector<bench::Inputs>& inputs, F eval, int repeats)
+    {
+        using Clock = std::chrono::steady_clock;
+        volatile float sink = 0.0f;
+
+        int passes = 1;
+        for (;;)
+        {
+            auto beg = Clock::now();
+            for (int p = 0; p < passes; p++)
+            {
+                for (const bench::Inputs& in : inputs)
+                {
+                    sink = eval(in);
+                }
+            }
+            if (std::chrono::duration<double>(Clock::now() - beg).count() > 0.01)
+            {
+                break;
+            }
+            passes *= 2;
+        }
+
+        std::vector<double> samples;
+        for (int r = 0; r < repeats; r++)
+        {
+            auto beg = Clock::now();
+            for (int p = 0; p < passes; p++)
+            {
+                for (const bench::Inputs& in : inputs)
+                {
+                    sink = eval(in);
+                }
+            }
+            double ns = std::chrono::duration<double, std::nano>(Clock::now() - beg).count();
+            samples.push_back(ns / ((double)passes * inputs.size()));
+        }
+        (void)sink;
+
+        Measurement m;
+        m.median = median(samples);
+        for (double& s : samples)
+        {
+            s = std::fabs(s - m.median);
+        }
+        m.mad = median(samples);
+        return m;
+    }
+
+    inline bool save(const char* path, const std::map<std::string, Measurement>& measurements)
+    {
+        FILE* fp = fopen(path, "w");
+        if (!fp)
+        {
+            return false;
+        }
+        fprintf(fp, "{\n");
+        size_t i = 0;
+        for (const auto& [name, m] : measurements)
+        {
+            fprintf(fp, "    \"%s\": { \"ns_per_eval\": %.6g, \"mad\": %.6g }%s\n", name.c_str(), m.median, m.mad, ++i < measurements.size() ? "," : "");
+        }
+        fprintf(fp, "}\n");
+        fclose(fp);
+        return true;
+    }
+
+    // Parses the files written by save(): a flat object of "name": { "ns_per_eval": x, "mad": y } entries.
+    // Anything else, including a truncated file, is rejected, so a broken baseline is never taken for an empty one.
+    inline bool parse(const std::string& json, std::map<std::string, Measurement>* measurements)
+    {
+        size_t i = 0;
+        auto skipSpace = [&]() {
+            while (i < json.size() && isspace((unsigned char)json[i]))
+            {
+                i++;
+            }
+        };
+        auto expect = [&](char c) {
+            skipSpace();
+            if (i < json.size() && json[i] == c)
+            {
+                i++;
+                return true;
+            }
+            return false;
+        };
+        auto readString = [&](std::string* s) {
+            if (!expect('"'))
+            {
+                return false;
+            }
+            size_t end = json.find('"', i);
+            if (end == std::string::npos)
+            {
+                return false;
+            }
+            *s = json.substr(i, end - i);
+            i = end + 1;
+            return true;
+        };
+        auto readNumber = [&](double* x) {
+            skipSpace();
+            const char* beg = json.c_str() + i;
+            char* end;
+            *x = strtod(beg, &end);
+            i += end - beg;
+            return end != beg;
+        };
+
+        std::map<std::string, Measurement> entries;
+        if (!expect('{'))
+        {
+            return false;
+        }
+        if (!expect('}'))
+        {
+            do
+            {
+                std::string name;
+                if (!readString(&name) || !expect(':') || !expect('{'))
+                {
+                    return false;
+                }
+                Measurement m;
+                bool hasMedian = false;
+                do
+                {
+                    std::string key;
+                    double x;
+                    if (!readString(&key) || !expect(':') || !readNumber(&x))
+                    {
+                        return false;
+                    }
+                    if (key == "ns_per_eval")
+                    {
+                        m.median = x;
+                        hasMedian = true;
+                    }
+                    else if (key == "mad")
+                    {
+                        m.mad = x;
+                    }
+                } while (expect(','));
+                if (!expect('}') || !hasMedian)
+                {
+                    return false;
+                }
+                entries[name] = m;
+            } while (expect(','));
+            if (!expect('}'))
+            {
+                return false;
+            }
+        }
+        skipSpace();
+        if (i != json.size())
+        {
+            return false;
+        }
+        *measurements = std::move(entries);
+        return true;
+    }
+
+    inline bool load(const char* path, std::map<std::string, Measurement>* measurements)
+    {
+        std::ifstream ifs(path);
+        if (!ifs)
+        {
+            return false;
+        }
+        std::string json((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        return parse(json, measurements);
+    }
+
+    struct Summary
+    {
+        int regressions = 0;
+        int missing = 0; // cases without a baseline entry
+    };
+
+    // Compares one case with its baseline entry, prints its line and counts it in the summary.
+    inline void compare(const std::string& name, const Measurement& m, const std::map<std::string, Measurement>& baseline, double tolerance, Summary* summary)
+    {
+        auto it = baseline.find(name);
+        if (it == baseline.end())
+        {
+            summary->missing++;
+            printf("%-36s %12s %12.2f  MISSING\n", name.c_str(), "-", m.median);
+            return;
+        }
+        // A regression has to exceed both the tolerance and the spread of the two measurements.
+        double change = m.median / it->second.median - 1.0;
+        double noise = 3.0 * (m.mad + it->second.mad);
+        bool regressed = tolerance < change && noise < m.median - it->second.median;
+        summary->regressions += regressed ? 1 : 0;
+        printf("%-36s %12.2f %12.2f %+9.1f%%%s%s\n", name.c_str(), it->second.median, m.median, change * 100.0,
+            regressed ? "  REGRESSION" : "",
+            tolerance < m.mad / m.median ? "  (noisy)" : "");
+    }
+
+    // Exit codes: 0 when every case is within the tolerance of its baseline (or the baseline was written with --update),
+    // 1 on regressions or cases missing from the baseline, 2 on usage errors and on a missing or unreadable baseline.
+    inline int run(int argc, char* argv[])
+    {
+        const char* path = nullptr;
+        bool update = false;
+        double tolerance = 0.05;
+        int repeats = 15;
+        for (int i = 2; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--update")
+            {
+                update = true;
+            }
+            else if (arg == "--tolerance" && i + 1 < argc)
+            {
+                tolerance = atof(argv[++i]);
+            }
+            else if (arg == "--repeats" && i + 1 < argc)
+            {
+                repeats = std::max(atoi(argv[++i]), 1);
+            }
+            else if (!path)
+            {
+                path = argv[i];
+            }
+            else
+            {
+                printf("unknown argument: %s\n", argv[i]);
+                return 2;
+            }
+        }
+        if (!path)
+        {
+            printf("usage: %s --regression <baseline.json> [--update] [--tolerance 0.05] [--repeats 15]\n", argv[0]);
+            return 2;
+        }
+
+        std::map<std::string, Measurement> baseline;
+        if (!update)
+        {
+            if (!std::ifstream(path))
+            {
+                printf("no baseline at %s, record one with --update\n", path);
+                return 2;
+            }
+            if (!load(path, &baseline))
+            {
+                printf("failed to parse the baseline %s\n", path);
+                return 2;
+            }
+        }
+
+        pinCurrentThread();
+
+        std::map<std::string, Measurement> measurements;
+        Summary summary;
+        printf("%-36s %12s %12s %10s\n", "case", "baseline ns", "ns/eval", "change");
+        forEachCase([&](const char* kernel, const char* engine, const std::vector<bench::Inputs>& inputs, auto eval) {
+            std::string name = std::string(kernel) + " / " + engine;
+            Measurement m = measure(inputs, eval, repeats);
+            measurements[name] = m;
+            if (update)
+            {
+                printf("%-36s %12s %12.2f\n", name.c_str(), "-", m.median);
+                return;
+            }
+            compare(name, m, baseline, tolerance, &summary);
+        });
+
+        if (update)
+        {
+            if (!save(path, measurements))
+            {
+                printf("failed to write %s\n", path);
+                return 2;
+            }
+            printf("baseline written to %s\n", path);
+            return 0;
+        }
+        printf("%d regression(s) beyond %.1f%%, %d case(s) missing from the baseline\n", summary.regressions, tolerance * 100.0, summary.missing);
+        return summary.regressions || summary.missing ? 1 : 0;
+    }
+}
+
+TEST_CASE("regression baseline", "[bench][regression]") {
+    using namespace regression;
+
+    std::map<std::string, Measurement> baseline;
+    baseline["a / dval"] = { 10.0, 0.1 };
+    baseline["b / dval"] = { 20.0, 0.2 };
+    const char* path = "regression_test_baseline.json";
+    REQUIRE(save(path, baseline));
+
+    // save and load round trip
+    std::map<std::string, Measurement> loaded;
+    REQUIRE(load(path, &loaded));
+    REQUIRE(loaded.size() == 2);
+    REQUIRE(loaded["b / dval"].median == 20.0);
+    REQUIRE(loaded["a / dval"].mad == 0.1);
+
+    // malformed or truncated files are rejected instead of loading as an empty baseline
+    std::map<std::string, Measurement> rejected;
+    REQUIRE(!parse("{ garbage", &rejected));
+    REQUIRE(!parse("", &rejected));
+    REQUIRE(!parse("{ \"a\": { \"ns_per_eval\": 1.0 }", &rejected));
+    REQUIRE(!parse("{ \"a\": { \"mad\": 1.0 } }", &rejected));
+    REQUIRE(!parse("{ \"a\": { \"ns_per_eval\": x } }", &rejected));
+    REQUIRE(!parse("{ \"a\": { \"ns_per_eval\": 1.0 } } trailing", &rejected));
+    REQUIRE(rejected.empty());
+    REQUIRE(parse(" { } ", &rejected));
+
+    // a case missing from the baseline is counted, a regression only beyond the tolerance and the noise
+    Summary summary;
+    compare("a / dval", { 10.2, 0.1 }, baseline, 0.05, &summary);
+    compare("b / dval", { 30.0, 0.1 }, baseline, 0.05, &summary);
+    compare("c / dval", { 5.0, 0.1 }, baseline, 0.05, &summary);
+    REQUIRE(summary.regressions == 1);
+    REQUIRE(summary.missing == 1);
+
+    // run() fails on a file that does not parse, and without --update neither measures nor writes a missing baseline
+    {
+        std::ofstream ofs(path);
+        ofs << "{ garbage";
+    }
+    char program[] = "bench";
+    char mode[] = "--regression";
+    char* argv[] = { program, mode, (char*)path };
+    REQUIRE(run(3, argv) == 2);
+    REQUIRE(remove(path) == 0);
+    REQUIRE(run(3, argv) == 2);
+    REQUIRE(!std::ifstream(path));
+}
+
+int main(int argc, char* argv[])
+{
+    if (1 < argc && std::string(argv[1]) == "--regression")
+    {
+        return regression::run(argc, argv);
+    }
+    return Catch::Session().run(argc, argv);
+}
@@ -1,7 +1,10 @@
 ﻿#include "pr.hpp"
 #include <iostream>
+#include <memory>
 
 #include "saka.h"
+#include "saka_backward.h"
+#include "saka_tracer.h"
 #include "autodiff/reverse/var.hpp"
 
 using namespace autodiff;
@@ -133,12 +136,37 @@ int main() {
     Initialize(config);
 
     Camera3D camera;
-    camera.origin = { 4, 4, 4 };
-    camera.lookat = { 0, 0, 0 };
+    camera.origin = { 0, -4, 1 };
+    camera.lookat = { 0, 0, 1 };
     camera.zUp = true;
 
     double e = GetElapsedTime();
 
+    // ValRef::backward() statistics of a sample graph, rebuilt every frame
+    int statsDepth = 16;
+    saka::BackwardStats backwardStats;
+
+    // differentiable path tracing of the viewport camera, off the UI thread. One core is left to the UI thread.
+    saka::Tracer tracer(std::max((int)std::thread::hardware_concurrency() - 1, 1));
+    saka::Tracer::Settings tracerSettings;
+    int tracerParameter = 0;
+    float tracerValues[2] = { 0.0f, 1.8f };
+    float tangentScale = 1.0f;
+    std::vector<float> tracerPrimal;
+    std::vector<float> tracerTangent;
+    int tracerWidth = 0;
+    int tracerHeight = 0;
+    int tracerSamples = 0;
+    // the scene drawn as a wireframe, rebuilt only when what it depends on changes
+    std::unique_ptr<saka::TracerScene> wireScene;
+    int wireParameter = -1;
+    float wireValue = 0.0f;
+    bool wireGlassBox = false;
+    Image2DRGBA8 primalImage;
+    Image2DRGBA8 tangentImage;
+    std::unique_ptr<ITexture> primalTexture(CreateTexture());
+    std::unique_ptr<ITexture> tangentTexture(CreateTexture());
+
     while (pr::NextFrame() == false) {
         if (IsImGuiUsingMouse() == false) {
             UpdateCameraBlenderLike(&camera);
@@ -153,15 +181,124 @@ int main() {
         //DrawGrid(GridAxis::XY, 1.0f, 10, { 128, 128, 128 });
         //DrawXYZAxis(1.0f);
 
+        {
+            if (!wireScene || wireParameter != tracerParameter || wireValue != tracerValues[tracerParameter] || wireGlassBox != tracerSettings.glassBox)
+            {
+                wireParameter = tracerParameter;
+                wireValue = tracerValues[tracerParameter];
+                wireGlassBox = tracerSettings.glassBox;
+                wireScene.reset(new saka::TracerScene((saka::TracerParameter)wireParameter, wireValue, wireGlassBox));
+            }
+            const saka::TracerScene& scene = *wireScene;
+            saka::dtriangles tris = scene.triangles();
+            for (int i = 0; i < tris.count; i++)
+            {
+                glm::vec3 v0 = { tris.x0[i].v, tris.y0[i].v, tris.z0[i].v };
+                glm::vec3 v1 = { tris.x1[i].v, tris.y1[i].v, tris.z1[i].v };
+                glm::vec3 v2 = { tris.x2[i].v, tris.y2[i].v, tris.z2[i].v };
+                DrawLine(v0, v1, { 128, 128, 128 });
+                DrawLine(v1, v2, { 128, 128, 128 });
+                DrawLine(v2, v0, { 128, 128, 128 });
+            }
+            DrawPoint({ scene.light.x.v, scene.light.y.v, scene.light.z.v }, { 255, 255, 0 }, 6);
+        }
+
         PopGraphicState();
         EndCamera();
 
+        for (int i = 0; i < 3; i++)
+        {
+            tracerSettings.camera.origin[i] = camera.origin[i];
+            tracerSettings.camera.lookat[i] = camera.lookat[i];
+        }
+        tracerSettings.parameter = (saka::TracerParameter)tracerParameter;
+        tracerSettings.value = tracerValues[tracerParameter];
+        tracer.setup(tracerSettings);
+
+        // the images only change once per finished pass, so the upload stays off most frames
+        if (tracer.fetch(&tracerPrimal, &tracerTangent, &tracerWidth, &tracerHeight, &tracerSamples))
+        {
+            primalImage.allocate(tracerWidth, tracerHeight);
+            tangentImage.allocate(tracerWidth, tracerHeight);
+            auto toByte = [](float x) {
+                return (uint8_t)glm::clamp(std::pow(std::max(x, 0.0f), 1.0f / 2.2f) * 255.0f + 0.5f, 0.0f, 255.0f);
+            };
+            for (int y = 0; y < tracerHeight; y++)
+            for (int x = 0; x < tracerWidth; x++)
+            {
+                const float* L = &tracerPrimal[(y * tracerWidth + x) * 3];
+                primalImage(x, y) = { toByte(L[0]), toByte(L[1]), toByte(L[2]), 255 };
+
+                // luminance tangent, red for positive and blue for negative
+                const float* dL = &tracerTangent[(y * tracerWidth + x) * 3];
+                float d = (0.2126f * dL[0] + 0.7152f * dL[1] + 0.0722f * dL[2]) * tangentScale;
+                tangentImage(x, y) = { toByte(d), 0, toByte(-d), 255 };
+            }
+            primalTexture->upload(primalImage);
+            tangentTexture->upload(tangentImage);
+        }
+
         BeginImGui();
 
         ImGui::SetNextWindowSize({ 500, 800 }, ImGuiCond_Once);
         ImGui::Begin("Panel");
         ImGui::Text("fps = %f", GetFrameRate());
 
+        {
+            backwardStats.beginForward();
+            saka::ValRef x(1.4f);
+            saka::ValRef y = x;
+            for (int i = 0; i < statsDepth; i++)
+            {
+                saka::ValRef a = saka::square(y);
+                y = saka::exp(a) / (a * a) + y;
+            }
+            y.backward(&backwardStats);
+        }
+        if (ImGui::CollapsingHeader("ValRef::backward()", ImGuiTreeNodeFlags_DefaultOpen))
+        {
+            ImGui::SliderInt("graph depth", &statsDepth, 1, 256);
+            for (auto kv : backwardStats.nodeCounts)
+            {
+                ImGui::Text("%s = %d", kv.first.c_str(), kv.second);
+            }
+            ImGui::Text("max generation = %d", backwardStats.maxGeneration);
+            ImGui::Text("pushes = %d, duplicate pops = %d", backwardStats.pushes, backwardStats.duplicatePops);
+            ImGui::Text("graph = %.1f kB", backwardStats.graphBytes / 1024.0);
+            ImGui::Text("forward = %.3f ms, backward = %.3f ms", backwardStats.forwardSeconds * 1000.0, backwardStats.backwardSeconds * 1000.0);
+            if (ImGui::Button("export json"))
+            {
+                FILE* fp = fopen("backward_stats.json", "w");
+                if (fp)
+                {
+                    fprintf(fp, "%s", backwardStats.json().c_str());
+                    fclose(fp);
+                }
+            }
+        }
+        if (ImGui::CollapsingHeader("path tracer", ImGuiTreeNodeFlags_DefaultOpen))
+        {
+            const char* parameters[] = { "box offset", "light height" };
+            ImGui::Combo("parameter", &tracerParameter, parameters, 2);
+            if (tracerParameter == 0)
+            {
+                ImGui::SliderFloat("box offset", &tracerValues[0], -0.5f, 0.5f);
+            }
+            else
+            {
+                ImGui::SliderFloat("light height", &tracerValues[1], 1.0f, 1.95f);
+            }
+            ImGui::SliderInt("max depth", &tracerSettings.maxDepth, 1, 8);
+            ImGui::Checkbox("glass box", &tracerSettings.glassBox);
+            ImGui::SliderFloat("tangent scale", &tangentScale, 0.1f, 10.0f);
+            ImGui::Text("%d threads, %d spp, %.1f ms / pass", tracer.threadCount(), tracerSamples, tracer.passSeconds() * 1000.0);
+            if (tracerSamples)
+            {
+                ImGui::Image(primalTexture.get(), ImVec2((float)tracerWidth, (float)tracerHeight));
+                ImGui::Image(tangentTexture.get(), ImVec2((float)tracerWidth, (float)tracerHeight));
+            }
+        }
+
         ImGui::End();
 
         EndImGui();
@@ -65,9 +65,14 @@ project "unittest"
     cppdialect "C++17"
 
     -- Src
-    files { "unittest.cpp", "catch_amalgamated.cpp", "catch_amalgamated.hpp" }
+    files { "unittest.cpp", "unittest_autodiff.cpp", "unittest_op_counts.cpp", "catch_amalgamated.cpp", "catch_amalgamated.hpp" }
     includedirs { "." }
 
+    -- eigen, for the autodiff matrix utilities in unittest_autodiff.cpp
+    -- setup command
+    -- git submodule add https://gitlab.com/libeigen/eigen libs/eigen
+    includedirs { "libs/eigen" }
+
     -- UTF8
     postbuildcommands { 
         "mt.exe -manifest ../utf8.manifest -outputresource:\"$(TargetDir)$(TargetName).exe\" -nologo"
@@ -96,4 +101,34 @@ project "unittest"
         runtime "Release"
         targetname ("Unittest")
         optimize "Full"
-    filter{}
\ No newline at end of file
+    filter{}
+project "bench"
+    kind "ConsoleApp"
+    language "C++"
+    targetdir "bin/"
+    systemversion "latest"
+    flags { "MultiProcessorCompile", "NoPCH" }
+
+    cppdialect "C++17"
+
+    -- Src
+    files { "bench.cpp", "catch_amalgamated.cpp", "catch_amalgamated.hpp" }
+    includedirs { "." }
+    defines { "CATCH_AMALGAMATED_CUSTOM_MAIN" } -- bench.cpp has its own main for the regression mode
+
+    -- UTF8
+    postbuildcommands { 
+        "mt.exe -manifest ../utf8.manifest -outputresource:\"$(TargetDir)$(TargetName).exe\" -nologo"
+    }
+
+    symbols "On"
+
+    filter {"Debug"}
+        runtime "Debug"
+        targetname ("Bench_Debug")
+        optimize "Off"
+    filter {"Release"}
+        runtime "Release"
+        targetname ("Bench")
+        optimize "Full"
+    filter{}
@@ -6,8 +6,25 @@
 #define SAKA_DEVICE
 #endif
 
+#include <string.h>
+
+// Define SAKA_COUNT_OPS to count the float operations executed by dval arithmetic, split into the primal and the tangent.
+// The counters are thread local and host only. Without SAKA_COUNT_OPS the counting compiles away entirely.
+// The counting build lives in the inline namespace saka::op_counting, so a translation unit defining SAKA_COUNT_OPS
+// links with uncounted ones without either picking up the other's inline functions.
+#if defined( SAKA_COUNT_OPS ) && !defined( __CUDA_ARCH__ ) && !defined( __HIP_DEVICE_COMPILE__ )
+#include <cstdio>
+#define SAKA_COUNT( pass, op, n ) ( ::saka::details::op_counts().pass.op += ( n ) )
+#else
+#define SAKA_COUNT( pass, op, n )
+#endif
+
 namespace saka
 {
+#if defined( SAKA_COUNT_OPS )
+inline namespace op_counting
+{
+#endif
     class dval
     {
     public:
@@ -24,11 +41,46 @@ namespace saka
         float g;
     };
 
+#if defined( SAKA_COUNT_OPS )
+    struct OpCount
+    {
+        long long add = 0; // add, sub and negate
+        long long mul = 0;
+        long long div = 0;
+        long long transcendental = 0; // exp, sqrt, log, sin, cos, tanh, pow, atan2
+
+        long long total() const { return add + mul + div + transcendental; }
+    };
+    struct OpCounts
+    {
+        OpCount primal;  // computing v
+        OpCount tangent; // computing g, including the local derivatives and the chain rule
+
+        OpCounts operator-(const OpCounts& rhs) const
+        {
+            OpCounts r;
+            r.primal = { primal.add - rhs.primal.add, primal.mul - rhs.primal.mul, primal.div - rhs.primal.div, primal.transcendental - rhs.primal.transcendental };
+            r.tangent = { tangent.add - rhs.tangent.add, tangent.mul - rhs.tangent.mul, tangent.div - rhs.tangent.div, tangent.transcendental - rhs.tangent.transcendental };
+            return r;
+        }
+    };
+#endif
+
     namespace details
     {
+#if defined( SAKA_COUNT_OPS )
+        inline OpCounts& op_counts()
+        {
+            thread_local OpCounts counts;
+            return counts;
+        }
+#endif
+
         template <class F, class dFdx>
         SAKA_DEVICE inline dval unary(dval x, F f, dFdx dfdx)
         {
+            SAKA_COUNT(tangent, mul, 1);
+
             dval u;
             u.v = f(x.v);
             u.g = x.g * dfdx(x.v);
@@ -38,14 +90,181 @@ namespace saka
         template <class F, class dFdx, class dFdy>
         SAKA_DEVICE inline dval binary(dval x, dval y, F f, dFdx dfdx, dFdy dfdy)
         {
+            SAKA_COUNT(tangent, mul, 2);
+            SAKA_COUNT(tangent, add, 1);
+
             dval u;
             u.v = f(x.v, y.v);
             u.g = x.g * dfdx(x.v, y.v) + y.g * dfdy(x.v, y.v);
             return u;
         }
+
+        // For functions that compute their local derivatives together with the value, sharing the work.
+        SAKA_DEVICE inline dval chain(dval x, float v, float dvdx)
+        {
+            SAKA_COUNT(tangent, mul, 1);
+
+            dval u;
+            u.v = v;
+            u.g = x.g * dvdx;
+            return u;
+        }
+        SAKA_DEVICE inline dval chain(dval x, dval y, float v, float dvdx, float dvdy)
+        {
+            SAKA_COUNT(tangent, mul, 2);
+            SAKA_COUNT(tangent, add, 1);
+
+            dval u;
+            u.v = v;
+            u.g = x.g * dvdx + y.g * dvdy;
+            return u;
+        }
+        SAKA_DEVICE inline dval chain(dval x, dval y, dval z, float v, float dvdx, float dvdy, float dvdz)
+        {
+            SAKA_COUNT(tangent, mul, 3);
+            SAKA_COUNT(tangent, add, 2);
+
+            dval u;
+            u.v = v;
+            u.g = x.g * dvdx + y.g * dvdy + z.g * dvdz;
+            return u;
+        }
+
+
+        SAKA_DEVICE inline int as_int(float x)
+        {
+#if ( defined( __CUDACC__ ) || defined( __HIPCC__ ) )
+            return __float_as_int(x);
+#else
+            int i;
+            memcpy(&i, &x, sizeof(float));
+            return i;
+#endif
+        }
+        SAKA_DEVICE inline float as_float(int i)
+        {
+#if ( defined( __CUDACC__ ) || defined( __HIPCC__ ) )
+            return __int_as_float(i);
+#else
+            float x;
+            memcpy(&x, &i, sizeof(float));
+            return x;
+#endif
+        }
     }
+
+    // Math policies for the transcendentals of dval. The tangents are always computed from the same policy as the values.
+    // Define SAKA_FAST_MATH to make fast_math the default, or pick one per call, e.g. exp<fast_math>(x).
+    struct precise_math
+    {
+        SAKA_DEVICE static float exp(float x) { return expf(x); }
+        SAKA_DEVICE static float log(float x) { return logf(x); }
+        SAKA_DEVICE static float sqrt(float x) { return sqrtf(x); }
+        SAKA_DEVICE static float rsqrt(float x) { return 1.0f / sqrtf(x); }
+        SAKA_DEVICE static float tanh(float x) { return tanhf(x); }
+        SAKA_DEVICE static float pow(float x, float p) { return powf(x, p); }
+        SAKA_DEVICE static void sincos(float x, float* s, float* c)
+        {
+#if ( defined( __CUDACC__ ) || defined( __HIPCC__ ) ) || ( defined( __GLIBC__ ) && defined( _GNU_SOURCE ) )
+            sincosf(x, s, c);
+#else
+            *s = sinf(x);
+            *c = cosf(x);
+#endif
+        }
+    };
+
+    // Polynomial and bit-trick approximations for finite, normal inputs. Measured max errors:
+    //   exp    relative 2.4e-7 for x in [-87, 88], x is clamped to that range
+    //   log    1.1e-7 absolute for |log(x)| < 1, relative above, for x in [1e-30, 1e30]
+    //   rsqrt  relative 4.8e-6, sqrt is x * rsqrt(x) with the same relative error
+    //   sincos absolute 4.3e-7 for |x| < 1e4
+    //   tanh   absolute 1.3e-7
+    //   pow    relative 2e-7 (1 + |p log(x)|) for x in [1e-3, 1e3], |p| <= 4, as exp(p log(x)); powf for x <= 0
+    struct fast_math
+    {
+        SAKA_DEVICE static float exp(float x)
+        {
+            // exp(x) = 2^n exp(r), |r| <= ln(2) / 2
+            x = fminf(fmaxf(x, -87.0f), 88.0f);
+            float n = floorf(x * 1.44269504f + 0.5f);
+            float r = x - n * 0.693145752f - n * 1.42860677e-6f;
+            float p = 1.0f / 720.0f;
+            p = p * r + 1.0f / 120.0f;
+            p = p * r + 1.0f / 24.0f;
+            p = p * r + 1.0f / 6.0f;
+            p = p * r + 0.5f;
+            p = p * r + 1.0f;
+            p = p * r + 1.0f;
+            return p * details::as_float(((int)n + 127) << 23);
+        }
+        SAKA_DEVICE static float log(float x)
+        {
+            // x = m 2^e, m in [sqrt(1/2), sqrt(2)), log(m) = 2 atanh((m - 1) / (m + 1))
+            int bits = details::as_int(x);
+            int e = ((bits >> 23) & 0xFF) - 127;
+            float m = details::as_float((bits & 0x007FFFFF) | 0x3F800000);
+            if (1.41421356f <= m)
+            {
+                m *= 0.5f;
+                e++;
+            }
+            float s = (m - 1.0f) / (m + 1.0f);
+            float s2 = s * s;
+            float p = 2.0f / 9.0f;
+            p = p * s2 + 2.0f / 7.0f;
+            p = p * s2 + 2.0f / 5.0f;
+            p = p * s2 + 2.0f / 3.0f;
+            p = p * s2 + 2.0f;
+            return p * s + (float)e * 0.693145752f + (float)e * 1.42860677e-6f;
+        }
+        SAKA_DEVICE static float rsqrt(float x)
+        {
+            float y = details::as_float(0x5F3759DF - (details::as_int(x) >> 1));
+            y = y * (1.5f - 0.5f * x * y * y);
+            y = y * (1.5f - 0.5f * x * y * y);
+            return y;
+        }
+        SAKA_DEVICE static float sqrt(float x)
+        {
+            return x * rsqrt(x);
+        }
+        SAKA_DEVICE static void sincos(float x, float* s, float* c)
+        {
+            // x = j pi / 2 + r, |r| <= pi / 4
+            float j = floorf(x * 0.636619772f + 0.5f);
+            float r = x - j * 1.5703125f - j * 4.83826794e-4f;
+            float r2 = r * r;
+            float sr = ((-1.0f / 5040.0f * r2 + 1.0f / 120.0f) * r2 - 1.0f / 6.0f) * r2 * r + r;
+            float cr = (((1.0f / 40320.0f * r2 - 1.0f / 720.0f) * r2 + 1.0f / 24.0f) * r2 - 0.5f) * r2 + 1.0f;
+            int q = (int)j & 3;
+            float sq = (q & 1) ? cr : sr;
+            float cq = (q & 1) ? sr : cr;
+            *s = (q & 2) ? -sq : sq;
+            *c = ((q + 1) & 2) ? -cq : cq;
+        }
+        SAKA_DEVICE static float tanh(float x)
+        {
+            // tanh(|x|) = (1 - e) / (1 + e), e = exp(-2 |x|) <= 1
+            float e = exp(-2.0f * fabsf(x));
+            return copysignf((1.0f - e) / (1.0f + e), x);
+        }
+        SAKA_DEVICE static float pow(float x, float p)
+        {
+            return 0.0f < x ? exp(p * log(x)) : powf(x, p);
+        }
+    };
+
+#if defined( SAKA_FAST_MATH )
+    using default_math = fast_math;
+#else
+    using default_math = precise_math;
+#endif
+
     SAKA_DEVICE inline dval operator+(dval x, dval y)
     {
+        SAKA_COUNT(primal, add, 1);
+
         return details::binary(x, y,
             [](float x, float y) { return x + y; },
             [](float x, float y) { return 1.0f; }, // df/dx
@@ -54,6 +273,8 @@ namespace saka
     }
     SAKA_DEVICE inline dval operator-(dval x)
     {
+        SAKA_COUNT(primal, add, 1);
+
         return details::unary(x,
             [](float x) { return -x; },
             [](float x) { return -1.0f; });
@@ -61,6 +282,8 @@ namespace saka
 
     SAKA_DEVICE inline dval operator-(dval x, dval y)
     {
+        SAKA_COUNT(primal, add, 1);
+
         return details::binary(x, y,
             [](float x, float y) { return x - y; },
             [](float x, float y) { return +1.0f; },
@@ -68,6 +291,8 @@ namespace saka
     }
     SAKA_DEVICE inline dval operator*(dval x, dval y)
     {
+        SAKA_COUNT(primal, mul, 1);
+
         return details::binary(x, y,
             [](float x, float y) { return x * y; },
             [](float x, float y) { return y; }, // df/dx
@@ -76,26 +301,194 @@ namespace saka
     }
     SAKA_DEVICE inline dval operator/(dval x, dval y)
     {
+        SAKA_COUNT(primal, div, 1);
+        SAKA_COUNT(tangent, div, 2);
+        SAKA_COUNT(tangent, mul, 1);
+        SAKA_COUNT(tangent, add, 1);
+
         return details::binary(x, y,
             [](float x, float y) { return x / y; },
             [](float x, float y) { return 1.0f / y; },
             [](float x, float y) { return -x / (y * y); });
     }
+    template <class Math = default_math>
     SAKA_DEVICE inline dval exp(dval x)
     {
-        return details::unary(x, 
-            [](float x) { return expf(x); }, 
-            [](float x) { return expf(x); } // df/dx
-        );
+        SAKA_COUNT(primal, transcendental, 1);
+
+        float v = Math::exp(x.v);
+        return details::chain(x, v, v /* df/dx */);
     }
+    template <class Math = default_math>
     SAKA_DEVICE inline dval sqrt(dval x)
     {
-        return details::unary(x, 
-            [](float x) { return sqrtf(x); }, 
-            [](float x) { return 0.5f / sqrtf(x); } // df/dx
-        );
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, div, 1);
+
+        float v = Math::sqrt(x.v);
+        return details::chain(x, v, 0.5f / v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval rsqrt(dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, mul, 3);
+
+        float v = Math::rsqrt(x.v);
+        return details::chain(x, v, -0.5f * v * v * v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval log(dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, div, 1);
+
+        return details::chain(x, Math::log(x.v), 1.0f / x.v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval sin(dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, s, c);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval cos(dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, add, 1);
+
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, c, -s);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval tanh(dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, mul, 1);
+        SAKA_COUNT(tangent, add, 1);
+
+        float t = Math::tanh(x.v);
+        return details::chain(x, t, 1.0f - t * t);
+    }
+
+    // x > 0. The value is exp(y log(x)) so that log(x) is shared with df/dy.
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval pow(dval x, dval y)
+    {
+        SAKA_COUNT(primal, transcendental, 2);
+        SAKA_COUNT(primal, mul, 1);
+        SAKA_COUNT(tangent, mul, 2);
+        SAKA_COUNT(tangent, div, 1);
+
+        float l = Math::log(x.v);
+        float v = Math::exp(y.v * l);
+        return details::chain(x, y, v, y.v * v / x.v, v * l);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval pow(dval x, float p)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, mul, 1);
+        SAKA_COUNT(tangent, div, 1);
+
+        float v = Math::pow(x.v, p);
+        float dvdx = x.v != 0.0f ? p * v / x.v : p * Math::pow(x.v, p - 1.0f);
+        return details::chain(x, v, dvdx);
+    }
+    SAKA_DEVICE inline dval atan2(dval y, dval x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, mul, 4);
+        SAKA_COUNT(tangent, add, 2);
+        SAKA_COUNT(tangent, div, 1);
+
+        float r = 1.0f / (x.v * x.v + y.v * y.v);
+        return details::chain(y, x, atan2f(y.v, x.v), x.v * r, -y.v * r);
+    }
+
+    // Lane-wise a or b without a branch. Both sides are always evaluated by the caller, so data-dependent paths
+    // such as clamping or total internal reflection run the same instructions for every element of a batch.
+    SAKA_DEVICE inline float select(bool mask, float a, float b)
+    {
+        return mask ? a : b;
+    }
+    SAKA_DEVICE inline dval select(bool mask, dval a, dval b)
+    {
+        dval u;
+        u.v = select(mask, a.v, b.v);
+        u.g = select(mask, a.g, b.g);
+        return u;
+    }
+
+    SAKA_DEVICE inline dval abs(dval x)
+    {
+        return select(x.v < 0.0f, -x, x);
+    }
+    SAKA_DEVICE inline dval min(dval x, dval y)
+    {
+        return select(x.v <= y.v, x, y);
+    }
+    SAKA_DEVICE inline dval max(dval x, dval y)
+    {
+        return select(x.v >= y.v, x, y);
+    }
+    SAKA_DEVICE inline dval clamp(dval x, dval lower, dval upper)
+    {
+        return min(max(x, lower), upper);
+    }
+
+    // a * b + c, both the value and the tangent with a single rounding each
+    SAKA_DEVICE inline dval fma(dval a, dval b, dval c)
+    {
+        SAKA_COUNT(primal, mul, 1);
+        SAKA_COUNT(primal, add, 1);
+        SAKA_COUNT(tangent, mul, 2);
+        SAKA_COUNT(tangent, add, 2);
+
+        dval u;
+        u.v = fmaf(a.v, b.v, c.v);
+        u.g = fmaf(a.g, b.v, fmaf(a.v, b.g, c.g));
+        return u;
     }
 
+#if defined( SAKA_COUNT_OPS )
+    // Counts the dval operations executed on this thread during its lifetime.
+    // With a label, the counts are printed when the scope ends.
+    class OpCountScope
+    {
+    public:
+        OpCountScope(const char* label = nullptr) : m_label(label), m_begin(details::op_counts()) {}
+        ~OpCountScope()
+        {
+            if (m_label)
+            {
+                print(m_label);
+            }
+        }
+        OpCountScope(const OpCountScope&) = delete;
+        OpCountScope& operator=(const OpCountScope&) = delete;
+
+        OpCounts counts() const
+        {
+            return details::op_counts() - m_begin;
+        }
+        void print(const char* label) const
+        {
+            OpCounts c = counts();
+            printf("%s\n", label);
+            printf("  primal : add %lld, mul %lld, div %lld, transcendental %lld\n", c.primal.add, c.primal.mul, c.primal.div, c.primal.transcendental);
+            printf("  tangent: add %lld, mul %lld, div %lld, transcendental %lld\n", c.tangent.add, c.tangent.mul, c.tangent.div, c.tangent.transcendental);
+        }
+    private:
+        const char* m_label;
+        OpCounts m_begin;
+    };
+#endif
+
     struct dval3
     {
         dval x;
@@ -103,6 +496,15 @@ namespace saka
         dval z;
     };
 
+    SAKA_DEVICE inline dval3 select(bool mask, dval3 a, dval3 b)
+    {
+        return {
+            select(mask, a.x, b.x),
+            select(mask, a.y, b.y),
+            select(mask, a.z, b.z)
+        };
+    }
+
     SAKA_DEVICE inline dval3 make_dval3(dval x, dval y, dval z)
     {
         return { x, y, z };
@@ -188,16 +590,1266 @@ namespace saka
         return n * dot(wi, n) * 2.0f / dot(n, n) - wi;
     }
 
+    namespace details
+    {
+        // refraction_norm_free() of the vector type V3 with scalar S (dval3 and dval, dval2_3 and dval2, dvaln3 and dvaln),
+        // eta is a float or an S
+        template <class S, class V3, class Eta>
+        SAKA_DEVICE inline V3 refraction_norm_free(V3 wi, V3 n, Eta eta, bool* tir)
+        {
+            S NoN = dot(n, n);
+            S WIoN = dot(wi, n);
+            S WoW = dot(wi, wi);
+            S k = NoN * WoW * (eta * eta - 1.0f) + WIoN * WIoN;
+            *tir = k.v < 0.0f;
+            V3 t = -wi * NoN + n * (WIoN - sqrt(max(k, 0.0f)));
+            return select(*tir, V3{ 0.0f, 0.0f, 0.0f }, t);
+        }
+    }
+
+    // Zero on total internal reflection, which is also reported through tir.
+    // Branchless: the refracted direction is computed from max(k, 0) for every input and the zero is selected afterwards.
+    SAKA_DEVICE inline dval3 refraction_norm_free(dval3 wi, dval3 n, float eta /* = eta_t / eta_i */, bool* tir)
+    {
+        return details::refraction_norm_free<dval>(wi, n, eta, tir);
+    }
     SAKA_DEVICE inline dval3 refraction_norm_free(dval3 wi, dval3 n, float eta /* = eta_t / eta_i */)
     {
-        dval NoN = dot(n, n);
-        dval WIoN = dot(wi, n);
-        dval WoW = dot(wi, wi);
-        dval k = NoN * WoW * (eta * eta - 1.0f) + WIoN * WIoN;
-        if (k.v < 0.0f) // adhoc..
+        bool tir;
+        return refraction_norm_free(wi, n, eta, &tir);
+    }
+    // with the tangent of eta, e.g. for gradients with respect to an ior
+    SAKA_DEVICE inline dval3 refraction_norm_free(dval3 wi, dval3 n, dval eta /* = eta_t / eta_i */, bool* tir)
+    {
+        return details::refraction_norm_free<dval>(wi, n, eta, tir);
+    }
+
+    namespace details
+    {
+        // a0 b0 + a1 b1 + a2 b2 with the tangent summed directly instead of through each product and sum
+        SAKA_DEVICE inline dval dot3(dval a0, dval b0, dval a1, dval b1, dval a2, dval b2)
+        {
+            SAKA_COUNT(primal, mul, 3);
+            SAKA_COUNT(primal, add, 2);
+            SAKA_COUNT(tangent, mul, 6);
+            SAKA_COUNT(tangent, add, 5);
+
+            dval u;
+            u.v = a0.v * b0.v + a1.v * b1.v + a2.v * b2.v;
+            u.g = a0.g * b0.v + a0.v * b0.g + a1.g * b1.v + a1.v * b1.g + a2.g * b2.v + a2.v * b2.g;
+            return u;
+        }
+        SAKA_DEVICE inline dval dot4(dval a0, dval b0, dval a1, dval b1, dval a2, dval b2, dval a3, dval b3)
+        {
+            SAKA_COUNT(primal, mul, 4);
+            SAKA_COUNT(primal, add, 3);
+            SAKA_COUNT(tangent, mul, 8);
+            SAKA_COUNT(tangent, add, 7);
+
+            dval u;
+            u.v = a0.v * b0.v + a1.v * b1.v + a2.v * b2.v + a3.v * b3.v;
+            u.g = a0.g * b0.v + a0.v * b0.g + a1.g * b1.v + a1.v * b1.g + a2.g * b2.v + a2.v * b2.g + a3.g * b3.v + a3.v * b3.g;
+            return u;
+        }
+
+        // out = -x a x, the tangent of the inverse x = a^-1 of a matrix with tangent a, column-major
+        template <int N>
+        SAKA_DEVICE inline void inverse_tangent(const float x[N][N], const float a[N][N], float out[N][N])
+        {
+            SAKA_COUNT(tangent, mul, 2 * N * N * N);
+            SAKA_COUNT(tangent, add, 2 * N * N * (N - 1) + N * N);
+
+            float xa[N][N];
+            for (int c = 0; c < N; c++)
+            {
+                for (int r = 0; r < N; r++)
+                {
+                    float s = 0.0f;
+                    for (int k = 0; k < N; k++)
+                    {
+                        s += x[k][r] * a[c][k];
+                    }
+                    xa[c][r] = s;
+                }
+            }
+            for (int c = 0; c < N; c++)
+            {
+                for (int r = 0; r < N; r++)
+                {
+                    float s = 0.0f;
+                    for (int k = 0; k < N; k++)
+                    {
+                        s += xa[k][r] * x[c][k];
+                    }
+                    out[c][r] = -s;
+                }
+            }
+        }
+    }
+
+    struct dval4
+    {
+        dval x;
+        dval y;
+        dval z;
+        dval w;
+    };
+
+    SAKA_DEVICE inline dval4 make_dval4(dval x, dval y, dval z, dval w)
+    {
+        return { x, y, z, w };
+    }
+    SAKA_DEVICE inline dval4 make_dval4(dval3 v, dval w)
+    {
+        return { v.x, v.y, v.z, w };
+    }
+
+    template <class T>
+    SAKA_DEVICE inline dval4 make_dval4(T v)
+    {
+        return { v.x, v.y, v.z, v.w };
+    }
+
+    SAKA_DEVICE inline dval4 select(bool mask, dval4 a, dval4 b)
+    {
+        return {
+            select(mask, a.x, b.x),
+            select(mask, a.y, b.y),
+            select(mask, a.z, b.z),
+            select(mask, a.w, b.w)
+        };
+    }
+
+    SAKA_DEVICE inline dval4 operator+(dval4 a, dval4 b)
+    {
+        return {
+            a.x + b.x,
+            a.y + b.y,
+            a.z + b.z,
+            a.w + b.w
+        };
+    }
+    SAKA_DEVICE inline dval4 operator-(dval4 a)
+    {
+        return {
+            -a.x,
+            -a.y,
+            -a.z,
+            -a.w
+        };
+    }
+    SAKA_DEVICE inline dval4 operator-(dval4 a, dval4 b)
+    {
+        return {
+            a.x - b.x,
+            a.y - b.y,
+            a.z - b.z,
+            a.w - b.w
+        };
+    }
+    SAKA_DEVICE inline dval4 operator*(dval4 a, dval s)
+    {
+        return {
+            a.x * s,
+            a.y * s,
+            a.z * s,
+            a.w * s
+        };
+    }
+    SAKA_DEVICE inline dval4 operator*(dval4 a, dval4 b)
+    {
+        return {
+            a.x * b.x,
+            a.y * b.y,
+            a.z * b.z,
+            a.w * b.w
+        };
+    }
+    SAKA_DEVICE inline dval4 operator/(dval4 a, dval s)
+    {
+        return {
+            a.x / s,
+            a.y / s,
+            a.z / s,
+            a.w / s
+        };
+    }
+    SAKA_DEVICE inline dval dot(dval4 a, dval4 b)
+    {
+        return details::dot4(a.x, b.x, a.y, b.y, a.z, b.z, a.w, b.w);
+    }
+
+    // 3x3 matrix, column-major with m[column][row] as glm
+    struct dmat3
+    {
+        dval m[3][3];
+    };
+
+    SAKA_DEVICE inline dmat3 dmat3_identity()
+    {
+        dmat3 r;
+        for (int c = 0; c < 3; c++)
         {
-            return { 0.0f, 0.0f, 0.0f };
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j] = c == j ? 1.0f : 0.0f;
+            }
         }
-        return -wi * NoN + n * (WIoN - sqrt(k));
+        return r;
     }
+
+    // from any type indexed as m[column][row], e.g. glm::mat3
+    template <class T>
+    SAKA_DEVICE inline dmat3 make_dmat3(const T& m)
+    {
+        dmat3 r;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j] = m[c][j];
+            }
+        }
+        return r;
+    }
+
+    SAKA_DEVICE inline dmat3 transpose(const dmat3& a)
+    {
+        dmat3 r;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j] = a.m[j][c];
+            }
+        }
+        return r;
+    }
+    SAKA_DEVICE inline dval3 operator*(const dmat3& a, dval3 v)
+    {
+        return {
+            details::dot3(a.m[0][0], v.x, a.m[1][0], v.y, a.m[2][0], v.z),
+            details::dot3(a.m[0][1], v.x, a.m[1][1], v.y, a.m[2][1], v.z),
+            details::dot3(a.m[0][2], v.x, a.m[1][2], v.y, a.m[2][2], v.z)
+        };
+    }
+    SAKA_DEVICE inline dmat3 operator*(const dmat3& a, const dmat3& b)
+    {
+        dmat3 r;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j] = details::dot3(a.m[0][j], b.m[c][0], a.m[1][j], b.m[c][1], a.m[2][j], b.m[c][2]);
+            }
+        }
+        return r;
+    }
+    SAKA_DEVICE inline dval determinant(const dmat3& a)
+    {
+        return details::dot3(
+            a.m[0][0], a.m[1][1] * a.m[2][2] - a.m[2][1] * a.m[1][2],
+            a.m[1][0], a.m[2][1] * a.m[0][2] - a.m[0][1] * a.m[2][2],
+            a.m[2][0], a.m[0][1] * a.m[1][2] - a.m[1][1] * a.m[0][2]);
+    }
+
+    // The value is inverted in float and the tangent is -A^-1 dA A^-1, rather than differentiating the cofactors.
+    SAKA_DEVICE inline dmat3 inverse(const dmat3& a)
+    {
+        SAKA_COUNT(primal, mul, 30);
+        SAKA_COUNT(primal, add, 11);
+        SAKA_COUNT(primal, div, 1);
+
+        float x[3][3];
+        float da[3][3];
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                x[c][j] = a.m[c][j].v;
+                da[c][j] = a.m[c][j].g;
+            }
+        }
+
+        float adj[3][3];
+        for (int c = 0; c < 3; c++)
+        {
+            int c1 = (c + 1) % 3;
+            int c2 = (c + 2) % 3;
+            for (int j = 0; j < 3; j++)
+            {
+                int j1 = (j + 1) % 3;
+                int j2 = (j + 2) % 3;
+                adj[j][c] = x[c1][j1] * x[c2][j2] - x[c2][j1] * x[c1][j2];
+            }
+        }
+        float invDet = 1.0f / (x[0][0] * adj[0][0] + x[1][0] * adj[0][1] + x[2][0] * adj[0][2]);
+
+        float inv[3][3];
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                inv[c][j] = adj[c][j] * invDet;
+            }
+        }
+        float dinv[3][3];
+        details::inverse_tangent<3>(inv, da, dinv);
+
+        dmat3 r;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j].v = inv[c][j];
+                r.m[c][j].g = dinv[c][j];
+            }
+        }
+        return r;
+    }
+
+    // 4x4 matrix, column-major with m[column][row] as glm
+    struct dmat4
+    {
+        dval m[4][4];
+    };
+
+    SAKA_DEVICE inline dmat4 dmat4_identity()
+    {
+        dmat4 r;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[c][j] = c == j ? 1.0f : 0.0f;
+            }
+        }
+        return r;
+    }
+
+    // from any type indexed as m[column][row], e.g. glm::mat4
+    template <class T>
+    SAKA_DEVICE inline dmat4 make_dmat4(const T& m)
+    {
+        dmat4 r;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[c][j] = m[c][j];
+            }
+        }
+        return r;
+    }
+
+    // rotation and translation
+    SAKA_DEVICE inline dmat4 make_dmat4(const dmat3& rotation, dval3 translation)
+    {
+        dmat4 r = dmat4_identity();
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                r.m[c][j] = rotation.m[c][j];
+            }
+        }
+        r.m[3][0] = translation.x;
+        r.m[3][1] = translation.y;
+        r.m[3][2] = translation.z;
+        return r;
+    }
+
+    SAKA_DEVICE inline dmat4 transpose(const dmat4& a)
+    {
+        dmat4 r;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[c][j] = a.m[j][c];
+            }
+        }
+        return r;
+    }
+    SAKA_DEVICE inline dval4 operator*(const dmat4& a, dval4 v)
+    {
+        return {
+            details::dot4(a.m[0][0], v.x, a.m[1][0], v.y, a.m[2][0], v.z, a.m[3][0], v.w),
+            details::dot4(a.m[0][1], v.x, a.m[1][1], v.y, a.m[2][1], v.z, a.m[3][1], v.w),
+            details::dot4(a.m[0][2], v.x, a.m[1][2], v.y, a.m[2][2], v.z, a.m[3][2], v.w),
+            details::dot4(a.m[0][3], v.x, a.m[1][3], v.y, a.m[2][3], v.z, a.m[3][3], v.w)
+        };
+    }
+    SAKA_DEVICE inline dmat4 operator*(const dmat4& a, const dmat4& b)
+    {
+        dmat4 r;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[c][j] = details::dot4(a.m[0][j], b.m[c][0], a.m[1][j], b.m[c][1], a.m[2][j], b.m[c][2], a.m[3][j], b.m[c][3]);
+            }
+        }
+        return r;
+    }
+
+    // Affine transforms, the bottom row is assumed to be (0, 0, 0, 1)
+    SAKA_DEVICE inline dval3 transform_point(const dmat4& a, dval3 p)
+    {
+        return {
+            details::dot3(a.m[0][0], p.x, a.m[1][0], p.y, a.m[2][0], p.z) + a.m[3][0],
+            details::dot3(a.m[0][1], p.x, a.m[1][1], p.y, a.m[2][1], p.z) + a.m[3][1],
+            details::dot3(a.m[0][2], p.x, a.m[1][2], p.y, a.m[2][2], p.z) + a.m[3][2]
+        };
+    }
+    SAKA_DEVICE inline dval3 transform_direction(const dmat4& a, dval3 d)
+    {
+        return {
+            details::dot3(a.m[0][0], d.x, a.m[1][0], d.y, a.m[2][0], d.z),
+            details::dot3(a.m[0][1], d.x, a.m[1][1], d.y, a.m[2][1], d.z),
+            details::dot3(a.m[0][2], d.x, a.m[1][2], d.y, a.m[2][2], d.z)
+        };
+    }
+
+    // General inverse. As for dmat3, the value is inverted in float and the tangent is -A^-1 dA A^-1.
+    SAKA_DEVICE inline dmat4 inverse(const dmat4& a)
+    {
+        SAKA_COUNT(primal, mul, 94);
+        SAKA_COUNT(primal, add, 49);
+        SAKA_COUNT(primal, div, 1);
+
+        float x[4][4];
+        float da[4][4];
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                x[c][j] = a.m[c][j].v;
+                da[c][j] = a.m[c][j].g;
+            }
+        }
+
+        // 2x2 minors of the upper and lower halves (Laplace expansion)
+        float s0 = x[0][0] * x[1][1] - x[1][0] * x[0][1];
+        float s1 = x[0][0] * x[1][2] - x[1][0] * x[0][2];
+        float s2 = x[0][0] * x[1][3] - x[1][0] * x[0][3];
+        float s3 = x[0][1] * x[1][2] - x[1][1] * x[0][2];
+        float s4 = x[0][1] * x[1][3] - x[1][1] * x[0][3];
+        float s5 = x[0][2] * x[1][3] - x[1][2] * x[0][3];
+        float c5 = x[2][2] * x[3][3] - x[3][2] * x[2][3];
+        float c4 = x[2][1] * x[3][3] - x[3][1] * x[2][3];
+        float c3 = x[2][1] * x[3][2] - x[3][1] * x[2][2];
+        float c2 = x[2][0] * x[3][3] - x[3][0] * x[2][3];
+        float c1 = x[2][0] * x[3][2] - x[3][0] * x[2][2];
+        float c0 = x[2][0] * x[3][1] - x[3][0] * x[2][1];
+
+        float invDet = 1.0f / (s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0);
+
+        // inv[column][row], the transposed cofactors
+        float inv[4][4];
+        inv[0][0] = ( x[1][1] * c5 - x[1][2] * c4 + x[1][3] * c3) * invDet;
+        inv[1][0] = (-x[1][0] * c5 + x[1][2] * c2 - x[1][3] * c1) * invDet;
+        inv[2][0] = ( x[1][0] * c4 - x[1][1] * c2 + x[1][3] * c0) * invDet;
+        inv[3][0] = (-x[1][0] * c3 + x[1][1] * c1 - x[1][2] * c0) * invDet;
+        inv[0][1] = (-x[0][1] * c5 + x[0][2] * c4 - x[0][3] * c3) * invDet;
+        inv[1][1] = ( x[0][0] * c5 - x[0][2] * c2 + x[0][3] * c1) * invDet;
+        inv[2][1] = (-x[0][0] * c4 + x[0][1] * c2 - x[0][3] * c0) * invDet;
+        inv[3][1] = ( x[0][0] * c3 - x[0][1] * c1 + x[0][2] * c0) * invDet;
+        inv[0][2] = ( x[3][1] * s5 - x[3][2] * s4 + x[3][3] * s3) * invDet;
+        inv[1][2] = (-x[3][0] * s5 + x[3][2] * s2 - x[3][3] * s1) * invDet;
+        inv[2][2] = ( x[3][0] * s4 - x[3][1] * s2 + x[3][3] * s0) * invDet;
+        inv[3][2] = (-x[3][0] * s3 + x[3][1] * s1 - x[3][2] * s0) * invDet;
+        inv[0][3] = (-x[2][1] * s5 + x[2][2] * s4 - x[2][3] * s3) * invDet;
+        inv[1][3] = ( x[2][0] * s5 - x[2][2] * s2 + x[2][3] * s1) * invDet;
+        inv[2][3] = (-x[2][0] * s4 + x[2][1] * s2 - x[2][3] * s0) * invDet;
+        inv[3][3] = ( x[2][0] * s3 - x[2][1] * s1 + x[2][2] * s0) * invDet;
+
+        float dinv[4][4];
+        details::inverse_tangent<4>(inv, da, dinv);
+
+        dmat4 r;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[c][j].v = inv[c][j];
+                r.m[c][j].g = dinv[c][j];
+            }
+        }
+        return r;
+    }
+
+    // Quaternion w + xi + yj + zk
+    struct dquat
+    {
+        dval w;
+        dval x;
+        dval y;
+        dval z;
+    };
+
+    SAKA_DEVICE inline dquat make_dquat(dval w, dval x, dval y, dval z)
+    {
+        return { w, x, y, z };
+    }
+
+    // from any type with w, x, y, z members, e.g. glm::quat
+    template <class T>
+    SAKA_DEVICE inline dquat make_dquat(T q)
+    {
+        return { q.w, q.x, q.y, q.z };
+    }
+
+    // rotation by angle around the unit axis
+    SAKA_DEVICE inline dquat dquat_angle_axis(dval angle, dval3 axis)
+    {
+        dval s = sin(angle * 0.5f);
+        return { cos(angle * 0.5f), axis.x * s, axis.y * s, axis.z * s };
+    }
+
+    SAKA_DEVICE inline dquat operator*(dquat a, dquat b)
+    {
+        return {
+            details::dot4(a.w, b.w, -a.x, b.x, -a.y, b.y, -a.z, b.z),
+            details::dot4(a.w, b.x, a.x, b.w, a.y, b.z, -a.z, b.y),
+            details::dot4(a.w, b.y, -a.x, b.z, a.y, b.w, a.z, b.x),
+            details::dot4(a.w, b.z, a.x, b.y, -a.y, b.x, a.z, b.w)
+        };
+    }
+    SAKA_DEVICE inline dquat conjugate(dquat q)
+    {
+        return { q.w, -q.x, -q.y, -q.z };
+    }
+    SAKA_DEVICE inline dquat normalize(dquat q)
+    {
+        dval s = rsqrt(details::dot4(q.w, q.w, q.x, q.x, q.y, q.y, q.z, q.z));
+        return { q.w * s, q.x * s, q.y * s, q.z * s };
+    }
+
+    // rotation of v by the unit quaternion q: v + 2w (q x v) + 2 q x (q x v)
+    SAKA_DEVICE inline dval3 rotate(dquat q, dval3 v)
+    {
+        dval3 u = { q.x, q.y, q.z };
+        dval3 t = cross(u, v) * 2.0f;
+        return v + t * q.w + cross(u, t);
+    }
+
+    SAKA_DEVICE inline dmat3 to_dmat3(dquat q)
+    {
+        dval xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        dval xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        dval wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+        dmat3 r;
+        r.m[0][0] = 1.0f - 2.0f * (yy + zz);
+        r.m[0][1] = 2.0f * (xy + wz);
+        r.m[0][2] = 2.0f * (xz - wy);
+        r.m[1][0] = 2.0f * (xy - wz);
+        r.m[1][1] = 1.0f - 2.0f * (xx + zz);
+        r.m[1][2] = 2.0f * (yz + wx);
+        r.m[2][0] = 2.0f * (xz + wy);
+        r.m[2][1] = 2.0f * (yz - wx);
+        r.m[2][2] = 1.0f - 2.0f * (xx + yy);
+        return r;
+    }
+
+    // Ray-triangle intersection (Moller-Trumbore)
+    // The hit test runs on the float values only. The tangents of t, u and v are computed once, for the hit that is kept,
+    // so misses never pay for derivatives. u and v are the barycentrics of v1 and v2.
+    struct dhit
+    {
+        dval t;
+        dval u;
+        dval v;
+    };
+
+    namespace details
+    {
+        SAKA_DEVICE inline bool intersect_triangle_primal(
+            float ox, float oy, float oz, float dx, float dy, float dz,
+            float v0x, float v0y, float v0z, float v1x, float v1y, float v1z, float v2x, float v2y, float v2z,
+            float tmax, float* t)
+        {
+            float e1x = v1x - v0x, e1y = v1y - v0y, e1z = v1z - v0z;
+            float e2x = v2x - v0x, e2y = v2y - v0y, e2z = v2z - v0z;
+            float px = dy * e2z - dz * e2y;
+            float py = dz * e2x - dx * e2z;
+            float pz = dx * e2y - dy * e2x;
+            float det = e1x * px + e1y * py + e1z * pz;
+            float invDet = 1.0f / det;
+            float sx = ox - v0x, sy = oy - v0y, sz = oz - v0z;
+            float u = (sx * px + sy * py + sz * pz) * invDet;
+            float qx = sy * e1z - sz * e1y;
+            float qy = sz * e1x - sx * e1z;
+            float qz = sx * e1y - sy * e1x;
+            float v = (dx * qx + dy * qy + dz * qz) * invDet;
+            *t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+            // a parallel ray gives an infinite or nan t and fails here
+            return 0.0f <= u && 0.0f <= v && u + v <= 1.0f && 0.0f < *t && *t < tmax;
+        }
+
+        // the same formulas on dval, for the tangents of an accepted hit
+        SAKA_DEVICE inline dhit intersect_triangle_tangent(dval3 ro, dval3 rd, dval3 v0, dval3 v1, dval3 v2)
+        {
+            dval3 e1 = v1 - v0;
+            dval3 e2 = v2 - v0;
+            dval3 p = cross(rd, e2);
+            dval invDet = 1.0f / dot(e1, p);
+            dval3 s = ro - v0;
+            dval3 q = cross(s, e1);
+            return { dot(e2, q) * invDet, dot(s, p) * invDet, dot(rd, q) * invDet };
+        }
+    }
+
+    SAKA_DEVICE inline bool intersect_triangle(dval3 ro, dval3 rd, dval3 v0, dval3 v1, dval3 v2, dhit* hit, float tmax = 3.402823466e+38f)
+    {
+        float t;
+        if (!details::intersect_triangle_primal(
+            ro.x.v, ro.y.v, ro.z.v, rd.x.v, rd.y.v, rd.z.v,
+            v0.x.v, v0.y.v, v0.z.v, v1.x.v, v1.y.v, v1.z.v, v2.x.v, v2.y.v, v2.z.v, tmax, &t))
+        {
+            return false;
+        }
+        *hit = details::intersect_triangle_tangent(ro, rd, v0, v1, v2);
+        return true;
+    }
+
+    // Triangles in structure-of-arrays layout, one array per vertex coordinate, e.g. x0[i] is v0.x of triangle i
+    struct dtriangles
+    {
+        const dval* x0; const dval* y0; const dval* z0;
+        const dval* x1; const dval* y1; const dval* z1;
+        const dval* x2; const dval* y2; const dval* z2;
+        int count;
+    };
+
+    // The closest of the triangles hit by one ray. Returns its index, or -1 on a miss.
+    SAKA_DEVICE inline int intersect_triangles(dval3 ro, dval3 rd, const dtriangles& tris, dhit* hit, float tmax = 3.402823466e+38f)
+    {
+        int closest = -1;
+        for (int i = 0; i < tris.count; i++)
+        {
+            float t;
+            if (details::intersect_triangle_primal(
+                ro.x.v, ro.y.v, ro.z.v, rd.x.v, rd.y.v, rd.z.v,
+                tris.x0[i].v, tris.y0[i].v, tris.z0[i].v,
+                tris.x1[i].v, tris.y1[i].v, tris.z1[i].v,
+                tris.x2[i].v, tris.y2[i].v, tris.z2[i].v, tmax, &t))
+            {
+                tmax = t;
+                closest = i;
+            }
+        }
+        if (closest != -1)
+        {
+            int i = closest;
+            *hit = details::intersect_triangle_tangent(ro, rd,
+                { tris.x0[i], tris.y0[i], tris.z0[i] },
+                { tris.x1[i], tris.y1[i], tris.z1[i] },
+                { tris.x2[i], tris.y2[i], tris.z2[i] });
+        }
+        return closest;
+    }
+
+    // Second-order forward mode, a hyper-dual number v + g1 e1 + g2 e2 + g12 e1 e2 with e1^2 = e2^2 = 0.
+    // Seeding g1 with a direction u and g2 with a direction w gives the first derivatives along u and w,
+    // and u^T H w in g12, in a single pass.
+    class dval2
+    {
+    public:
+        SAKA_DEVICE dval2() : v(0.0f), g1(0.0f), g2(0.0f), g12(0.0f) {}
+        SAKA_DEVICE dval2(float x) : v(x), g1(0.0f), g2(0.0f), g12(0.0f) {}
+        SAKA_DEVICE dval2(float x, float g1, float g2) : v(x), g1(g1), g2(g2), g12(0.0f) {}
+
+        // both tangents along this variable, so g12 becomes the second derivative
+        SAKA_DEVICE void requires_grad()
+        {
+            g1 = 1.0f;
+            g2 = 1.0f;
+        }
+
+        float v;
+        float g1;
+        float g2;
+        float g12;
+    };
+
+    namespace details
+    {
+        // f(x) from its value and first and second derivatives at x.v
+        SAKA_DEVICE inline dval2 chain(dval2 x, float v, float d, float dd)
+        {
+            dval2 u;
+            u.v = v;
+            u.g1 = d * x.g1;
+            u.g2 = d * x.g2;
+            u.g12 = d * x.g12 + dd * x.g1 * x.g2;
+            return u;
+        }
+        // f(x, y) from its value, gradient and Hessian at (x.v, y.v)
+        SAKA_DEVICE inline dval2 chain(dval2 x, dval2 y, float v, float dx, float dy, float dxx, float dxy, float dyy)
+        {
+            dval2 u;
+            u.v = v;
+            u.g1 = dx * x.g1 + dy * y.g1;
+            u.g2 = dx * x.g2 + dy * y.g2;
+            u.g12 = dx * x.g12 + dy * y.g12 + dxx * x.g1 * x.g2 + dxy * (x.g1 * y.g2 + y.g1 * x.g2) + dyy * y.g1 * y.g2;
+            return u;
+        }
+    }
+
+    SAKA_DEVICE inline dval2 operator+(dval2 x, dval2 y)
+    {
+        dval2 u;
+        u.v = x.v + y.v;
+        u.g1 = x.g1 + y.g1;
+        u.g2 = x.g2 + y.g2;
+        u.g12 = x.g12 + y.g12;
+        return u;
+    }
+    SAKA_DEVICE inline dval2 operator-(dval2 x)
+    {
+        dval2 u;
+        u.v = -x.v;
+        u.g1 = -x.g1;
+        u.g2 = -x.g2;
+        u.g12 = -x.g12;
+        return u;
+    }
+    SAKA_DEVICE inline dval2 operator-(dval2 x, dval2 y)
+    {
+        dval2 u;
+        u.v = x.v - y.v;
+        u.g1 = x.g1 - y.g1;
+        u.g2 = x.g2 - y.g2;
+        u.g12 = x.g12 - y.g12;
+        return u;
+    }
+    SAKA_DEVICE inline dval2 operator*(dval2 x, dval2 y)
+    {
+        return details::chain(x, y, x.v * y.v, y.v, x.v, 0.0f, 1.0f, 0.0f);
+    }
+    SAKA_DEVICE inline dval2 operator/(dval2 x, dval2 y)
+    {
+        float r = 1.0f / y.v;
+        float v = x.v * r;
+        return details::chain(x, y, v, r, -v * r, 0.0f, -r * r, 2.0f * v * r * r);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 exp(dval2 x)
+    {
+        float v = Math::exp(x.v);
+        return details::chain(x, v, v, v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 sqrt(dval2 x)
+    {
+        float v = Math::sqrt(x.v);
+        float d = 0.5f / v;
+        return details::chain(x, v, d, -d * d / v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 rsqrt(dval2 x)
+    {
+        float v = Math::rsqrt(x.v);
+        float v3 = v * v * v;
+        return details::chain(x, v, -0.5f * v3, 0.75f * v3 * v * v);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 log(dval2 x)
+    {
+        float r = 1.0f / x.v;
+        return details::chain(x, Math::log(x.v), r, -r * r);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 sin(dval2 x)
+    {
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, s, c, -s);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 cos(dval2 x)
+    {
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, c, -s, -c);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 tanh(dval2 x)
+    {
+        float t = Math::tanh(x.v);
+        float d = 1.0f - t * t;
+        return details::chain(x, t, d, -2.0f * t * d);
+    }
+
+    // x > 0. The value is exp(y log(x)) so that log(x) is shared with the y derivatives.
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 pow(dval2 x, dval2 y)
+    {
+        float l = Math::log(x.v);
+        float v = Math::exp(y.v * l);
+        float r = 1.0f / x.v;
+        float dx = y.v * v * r;
+        return details::chain(x, y, v, dx, v * l, (y.v - 1.0f) * dx * r, v * r * (1.0f + y.v * l), v * l * l);
+    }
+    template <class Math = default_math>
+    SAKA_DEVICE inline dval2 pow(dval2 x, float p)
+    {
+        float v = Math::pow(x.v, p);
+        float d = x.v != 0.0f ? p * v / x.v : p * Math::pow(x.v, p - 1.0f);
+        float dd = x.v != 0.0f ? (p - 1.0f) * d / x.v : p * (p - 1.0f) * Math::pow(x.v, p - 2.0f);
+        return details::chain(x, v, d, dd);
+    }
+    SAKA_DEVICE inline dval2 atan2(dval2 y, dval2 x)
+    {
+        float r = 1.0f / (x.v * x.v + y.v * y.v);
+        float r2 = r * r;
+        float xy2 = 2.0f * x.v * y.v * r2;
+        return details::chain(y, x, atan2f(y.v, x.v), x.v * r, -y.v * r, -xy2, (y.v * y.v - x.v * x.v) * r2, xy2);
+    }
+
+    SAKA_DEVICE inline dval2 select(bool mask, dval2 a, dval2 b)
+    {
+        dval2 u;
+        u.v = select(mask, a.v, b.v);
+        u.g1 = select(mask, a.g1, b.g1);
+        u.g2 = select(mask, a.g2, b.g2);
+        u.g12 = select(mask, a.g12, b.g12);
+        return u;
+    }
+    SAKA_DEVICE inline dval2 abs(dval2 x)
+    {
+        return select(x.v < 0.0f, -x, x);
+    }
+    SAKA_DEVICE inline dval2 min(dval2 x, dval2 y)
+    {
+        return select(x.v <= y.v, x, y);
+    }
+    SAKA_DEVICE inline dval2 max(dval2 x, dval2 y)
+    {
+        return select(x.v >= y.v, x, y);
+    }
+    SAKA_DEVICE inline dval2 clamp(dval2 x, dval2 lower, dval2 upper)
+    {
+        return min(max(x, lower), upper);
+    }
+    SAKA_DEVICE inline dval2 fma(dval2 a, dval2 b, dval2 c)
+    {
+        dval2 u;
+        u.v = fmaf(a.v, b.v, c.v);
+        u.g1 = fmaf(a.g1, b.v, fmaf(a.v, b.g1, c.g1));
+        u.g2 = fmaf(a.g2, b.v, fmaf(a.v, b.g2, c.g2));
+        u.g12 = fmaf(a.g12, b.v, fmaf(a.v, b.g12, fmaf(a.g1, b.g2, fmaf(a.g2, b.g1, c.g12))));
+        return u;
+    }
+
+    struct dval2_3
+    {
+        dval2 x;
+        dval2 y;
+        dval2 z;
+    };
+
+    SAKA_DEVICE inline dval2_3 select(bool mask, dval2_3 a, dval2_3 b)
+    {
+        return {
+            select(mask, a.x, b.x),
+            select(mask, a.y, b.y),
+            select(mask, a.z, b.z)
+        };
+    }
+
+    SAKA_DEVICE inline dval2_3 make_dval2_3(dval2 x, dval2 y, dval2 z)
+    {
+        return { x, y, z };
+    }
+
+    template <class T>
+    SAKA_DEVICE inline dval2_3 make_dval2_3(T v)
+    {
+        return { v.x, v.y, v.z };
+    }
+
+    SAKA_DEVICE inline dval2_3 operator+(dval2_3 a, dval2_3 b)
+    {
+        return {
+            a.x + b.x,
+            a.y + b.y,
+            a.z + b.z
+        };
+    }
+
+    SAKA_DEVICE inline dval2_3 operator-(dval2_3 a)
+    {
+        return {
+            -a.x,
+            -a.y,
+            -a.z
+        };
+    }
+    SAKA_DEVICE inline dval2_3 operator-(dval2_3 a, dval2_3 b)
+    {
+        return {
+            a.x - b.x,
+            a.y - b.y,
+            a.z - b.z
+        };
+    }
+
+    SAKA_DEVICE inline dval2_3 operator*(dval2_3 a, dval2 s)
+    {
+        return {
+            a.x * s,
+            a.y * s,
+            a.z * s
+        };
+    }
+    SAKA_DEVICE inline dval2_3 operator*(dval2_3 a, dval2_3 b)
+    {
+        return {
+            a.x * b.x,
+            a.y * b.y,
+            a.z * b.z
+        };
+    }
+    SAKA_DEVICE inline dval2_3 operator/(dval2_3 a, dval2 s)
+    {
+        return {
+            a.x / s,
+            a.y / s,
+            a.z / s
+        };
+    }
+
+    SAKA_DEVICE inline dval2 dot(dval2_3 a, dval2_3 b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+    SAKA_DEVICE inline dval2_3 normalize(dval2_3 p)
+    {
+        return p * rsqrt(dot(p, p));
+    }
+    SAKA_DEVICE inline dval2_3 cross(dval2_3 a, dval2_3 b)
+    {
+        return {
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+        };
+    }
+
+    SAKA_DEVICE inline dval2_3 reflection(dval2_3 wi, dval2_3 n)
+    {
+        return n * dot(wi, n) * 2.0f / dot(n, n) - wi;
+    }
+    SAKA_DEVICE inline dval2_3 refraction_norm_free(dval2_3 wi, dval2_3 n, float eta /* = eta_t / eta_i */, bool* tir)
+    {
+        return details::refraction_norm_free<dval2>(wi, n, eta, tir);
+    }
+    SAKA_DEVICE inline dval2_3 refraction_norm_free(dval2_3 wi, dval2_3 n, float eta /* = eta_t / eta_i */)
+    {
+        bool tir;
+        return refraction_norm_free(wi, n, eta, &tir);
+    }
+
+    // Forward mode with N tangent lanes: one pass gives the derivatives with respect to N seeded parameters.
+    // The tangent operation counts are per lane, so they scale with N.
+    template <int N>
+    class dvaln
+    {
+    public:
+        SAKA_DEVICE dvaln() : v(0.0f)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                g[i] = 0.0f;
+            }
+        }
+        SAKA_DEVICE dvaln(float x) : v(x)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                g[i] = 0.0f;
+            }
+        }
+
+        SAKA_DEVICE void requires_grad(int lane)
+        {
+            g[lane] = 1.0f;
+        }
+
+        float v;
+        float g[N];
+    };
+
+    namespace details
+    {
+        // f(x) from its value and derivative at x.v
+        template <int N>
+        SAKA_DEVICE inline dvaln<N> chain(dvaln<N> x, float v, float dvdx)
+        {
+            SAKA_COUNT(tangent, mul, N);
+
+            dvaln<N> u;
+            u.v = v;
+            for (int i = 0; i < N; i++)
+            {
+                u.g[i] = dvdx * x.g[i];
+            }
+            return u;
+        }
+        template <int N>
+        SAKA_DEVICE inline dvaln<N> chain(dvaln<N> x, dvaln<N> y, float v, float dvdx, float dvdy)
+        {
+            SAKA_COUNT(tangent, mul, 2 * N);
+            SAKA_COUNT(tangent, add, N);
+
+            dvaln<N> u;
+            u.v = v;
+            for (int i = 0; i < N; i++)
+            {
+                u.g[i] = dvdx * x.g[i] + dvdy * y.g[i];
+            }
+            return u;
+        }
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator+(dvaln<N> x, dvaln<N> y)
+    {
+        SAKA_COUNT(primal, add, 1);
+
+        return details::chain(x, y, x.v + y.v, 1.0f, 1.0f);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator-(dvaln<N> x)
+    {
+        SAKA_COUNT(primal, add, 1);
+
+        return details::chain(x, -x.v, -1.0f);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator-(dvaln<N> x, dvaln<N> y)
+    {
+        SAKA_COUNT(primal, add, 1);
+
+        return details::chain(x, y, x.v - y.v, 1.0f, -1.0f);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator*(dvaln<N> x, dvaln<N> y)
+    {
+        SAKA_COUNT(primal, mul, 1);
+
+        return details::chain(x, y, x.v * y.v, y.v, x.v);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator/(dvaln<N> x, dvaln<N> y)
+    {
+        SAKA_COUNT(primal, div, 1);
+        SAKA_COUNT(primal, mul, 1);
+        SAKA_COUNT(tangent, mul, 1);
+
+        float r = 1.0f / y.v;
+        float v = x.v * r;
+        return details::chain(x, y, v, r, -v * r);
+    }
+
+    // A float operand is a constant, as it converts to one for dval. Template deduction does not convert,
+    // so the mixed forms are spelled out.
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator+(dvaln<N> x, float y)
+    {
+        return x + dvaln<N>(y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator+(float x, dvaln<N> y)
+    {
+        return dvaln<N>(x) + y;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator-(dvaln<N> x, float y)
+    {
+        return x - dvaln<N>(y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator-(float x, dvaln<N> y)
+    {
+        return dvaln<N>(x) - y;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator*(dvaln<N> x, float y)
+    {
+        return x * dvaln<N>(y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator*(float x, dvaln<N> y)
+    {
+        return dvaln<N>(x) * y;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator/(dvaln<N> x, float y)
+    {
+        return x / dvaln<N>(y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> operator/(float x, dvaln<N> y)
+    {
+        return dvaln<N>(x) / y;
+    }
+
+    template <class Math = default_math, int N>
+    SAKA_DEVICE inline dvaln<N> sqrt(dvaln<N> x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, div, 1);
+
+        float v = Math::sqrt(x.v);
+        return details::chain(x, v, 0.5f / v);
+    }
+
+    template <class Math = default_math, int N>
+    SAKA_DEVICE inline dvaln<N> sin(dvaln<N> x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, s, c);
+    }
+    template <class Math = default_math, int N>
+    SAKA_DEVICE inline dvaln<N> cos(dvaln<N> x)
+    {
+        SAKA_COUNT(primal, transcendental, 1);
+        SAKA_COUNT(tangent, add, 1);
+
+        float s, c;
+        Math::sincos(x.v, &s, &c);
+        return details::chain(x, c, -s);
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> select(bool mask, dvaln<N> a, dvaln<N> b)
+    {
+        dvaln<N> u;
+        u.v = select(mask, a.v, b.v);
+        for (int i = 0; i < N; i++)
+        {
+            u.g[i] = select(mask, a.g[i], b.g[i]);
+        }
+        return u;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> min(dvaln<N> x, dvaln<N> y)
+    {
+        return select(x.v <= y.v, x, y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> max(dvaln<N> x, dvaln<N> y)
+    {
+        return select(x.v >= y.v, x, y);
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> max(dvaln<N> x, float y)
+    {
+        return max(x, dvaln<N>(y));
+    }
+
+    template <int N>
+    struct dvaln3
+    {
+        dvaln<N> x;
+        dvaln<N> y;
+        dvaln<N> z;
+    };
+
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> select(bool mask, dvaln3<N> a, dvaln3<N> b)
+    {
+        return {
+            select(mask, a.x, b.x),
+            select(mask, a.y, b.y),
+            select(mask, a.z, b.z)
+        };
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> operator+(dvaln3<N> a, dvaln3<N> b)
+    {
+        return {
+            a.x + b.x,
+            a.y + b.y,
+            a.z + b.z
+        };
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> operator-(dvaln3<N> a)
+    {
+        return {
+            -a.x,
+            -a.y,
+            -a.z
+        };
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> operator-(dvaln3<N> a, dvaln3<N> b)
+    {
+        return {
+            a.x - b.x,
+            a.y - b.y,
+            a.z - b.z
+        };
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> operator*(dvaln3<N> a, dvaln<N> s)
+    {
+        return {
+            a.x * s,
+            a.y * s,
+            a.z * s
+        };
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> operator/(dvaln3<N> a, dvaln<N> s)
+    {
+        return {
+            a.x / s,
+            a.y / s,
+            a.z / s
+        };
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln<N> dot(dvaln3<N> a, dvaln3<N> b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> normalize(dvaln3<N> p)
+    {
+        return p / sqrt(dot(p, p));
+    }
+
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> reflection(dvaln3<N> wi, dvaln3<N> n)
+    {
+        return n * (dot(wi, n) * 2.0f / dot(n, n)) - wi;
+    }
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> refraction_norm_free(dvaln3<N> wi, dvaln3<N> n, float eta /* = eta_t / eta_i */, bool* tir)
+    {
+        return details::refraction_norm_free<dvaln<N>>(wi, n, eta, tir);
+    }
+    // with a differentiable eta, e.g. for derivatives with respect to an IOR
+    template <int N>
+    SAKA_DEVICE inline dvaln3<N> refraction_norm_free(dvaln3<N> wi, dvaln3<N> n, dvaln<N> eta /* = eta_t / eta_i */, bool* tir)
+    {
+        return details::refraction_norm_free<dvaln<N>>(wi, n, eta, tir);
+    }
+#if defined( SAKA_COUNT_OPS )
+}
+#endif
 }
@@ -1,3 +1,9 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
 #include <memory>
 #include <stack>
 #include <map>
@@ -39,6 +45,65 @@ namespace saka
        std::string nodeType() const { return "Value"; }
    };
 
+   // Optionally filled by ValRef::backward() to see why a reverse sweep is slow.
+   struct BackwardStats
+   {
+       std::map<std::string, int> nodeCounts; // by nodeType(), "Value" counts the distinct leaves
+       int maxGeneration = 0;
+       int pushes = 0;        // priority queue pushes
+       int duplicatePops = 0; // pops skipped because the value was already processed
+       size_t graphBytes = 0; // approximate, nodes plus their shared_ptr control blocks
+       double forwardSeconds = 0.0;  // from beginForward() to the start of backward(), if beginForward() was called
+       double backwardSeconds = 0.0;
+
+       std::chrono::steady_clock::time_point forwardBegin;
+       bool forwardStarted = false;
+
+       // Call before building the graph to have the build time recorded.
+       void beginForward()
+       {
+           forwardBegin = std::chrono::steady_clock::now();
+           forwardStarted = true;
+       }
+       int nodeCount() const
+       {
+           int n = 0;
+           for (auto kv : nodeCounts)
+           {
+               n += kv.second;
+           }
+           return n;
+       }
+       std::string json() const
+       {
+           std::string s;
+           char buffer[256];
+           s += "{\n";
+           s += "  \"node_counts\": {";
+           int i = 0;
+           for (auto kv : nodeCounts)
+           {
+               sprintf(buffer, "%s\"%s\": %d", i++ ? ", " : " ", kv.first.c_str(), kv.second);
+               s += buffer;
+           }
+           s += " },\n";
+           sprintf(buffer, "  \"max_generation\": %d,\n", maxGeneration);
+           s += buffer;
+           sprintf(buffer, "  \"pushes\": %d,\n", pushes);
+           s += buffer;
+           sprintf(buffer, "  \"duplicate_pops\": %d,\n", duplicatePops);
+           s += buffer;
+           sprintf(buffer, "  \"graph_bytes\": %zu,\n", graphBytes);
+           s += buffer;
+           sprintf(buffer, "  \"forward_seconds\": %.9f,\n", forwardSeconds);
+           s += buffer;
+           sprintf(buffer, "  \"backward_seconds\": %.9f\n", backwardSeconds);
+           s += buffer;
+           s += "}\n";
+           return s;
+       }
+   };
+
    class ValRef
    {
    public:
@@ -47,8 +112,25 @@ namespace saka
        {
            m_impl->value = value;
        }
-       void backward()
+       void backward(BackwardStats* stats = nullptr)
        {
+           auto backwardBegin = std::chrono::steady_clock::now();
+           std::set<std::shared_ptr<Val>> leaves;
+           if (stats)
+           {
+               BackwardStats fresh;
+               fresh.forwardBegin = stats->forwardBegin;
+               fresh.forwardStarted = stats->forwardStarted;
+               *stats = fresh;
+               if (stats->forwardStarted)
+               {
+                   stats->forwardSeconds = std::chrono::duration<double>(backwardBegin - stats->forwardBegin).count();
+               }
+           }
+
+           // shared_ptr<T>(new T) allocates a separate control block; the vtable pointer and the two counts are the usual layout.
+           const size_t controlBlockBytes = sizeof(void*) + 2 * sizeof(long);
+
            m_impl->derivative = 1.0f;
 
            auto generationOrder = [](std::shared_ptr<Val> lhs, std::shared_ptr<Val> rhs)
@@ -66,23 +148,43 @@ namespace saka
            std::set<std::shared_ptr<Val>> processed;
 
            stack.push(m_impl);
-
-           
+           if (stats)
+           {
+               stats->pushes++;
+           }
 
            while (!stack.empty())
            {
                std::shared_ptr<Val> val = stack.top(); stack.pop();
                if (!val->manufacturer)
                {
+                   if (stats && leaves.insert(val).second)
+                   {
+                       stats->nodeCounts[val->nodeType()]++;
+                       stats->graphBytes += sizeof(Val) + controlBlockBytes;
+                   }
                    continue;
                }
 
                if (processed.count(val))
                {
+                   if (stats)
+                   {
+                       stats->duplicatePops++;
+                   }
                    continue;
                }
                processed.insert(val);
 
+               if (stats)
+               {
+                   // a value and the function that made it
+                   stats->nodeCounts[val->manufacturer->nodeType()]++;
+                   stats->graphBytes += sizeof(Val) + sizeof(Func) + 2 * controlBlockBytes;
+                   stats->maxGeneration = std::max(stats->maxGeneration, val->generation);
+                   stats->pushes += val->manufacturer->inputs.rhs ? 2 : 1;
+               }
+
                // printf("g: %d, %s\n", val->generation, val->manufacturer->nodeType().c_str());
 
                Pair<std::shared_ptr<Val>> inputs = val->manufacturer->inputs;
@@ -96,6 +198,14 @@ namespace saka
                    stack.push(inputs.rhs);
                }
            }
+
+           if (stats)
+           {
+               stats->backwardSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - backwardBegin).count();
+           }
+       }
+       float value() const {
+           return m_impl->value;
        }
        float derivative() const {
            return m_impl->derivative;
@@ -225,14 +335,40 @@ namespace saka
    public:
        virtual float forward(Pair<float> xs) const override
        {
-           return std::expf(xs.lhs);
+           return expf(xs.lhs);
        }
        virtual Pair<float> backward(Pair<float> xs, float dy) const override
        {
-           return { dy * std::expf(xs.lhs), 0.0f };
+           return { dy * expf(xs.lhs), 0.0f };
        }
        std::string nodeType() const { return "Exp"; }
    };
+   class Sqrt : public Func
+   {
+   public:
+       virtual float forward(Pair<float> xs) const override
+       {
+           return sqrtf(xs.lhs);
+       }
+       virtual Pair<float> backward(Pair<float> xs, float dy) const override
+       {
+           return { dy * 0.5f / sqrtf(xs.lhs), 0.0f };
+       }
+       std::string nodeType() const { return "Sqrt"; }
+   };
+   class Negate : public Func
+   {
+   public:
+       virtual float forward(Pair<float> xs) const override
+       {
+           return -xs.lhs;
+       }
+       virtual Pair<float> backward(Pair<float> xs, float dy) const override
+       {
+           return { -dy, 0.0f };
+       }
+       std::string nodeType() const { return "Negate"; }
+   };
 
    class Plus : public Func
    {
@@ -247,6 +383,19 @@ namespace saka
        }
        std::string nodeType() const { return "Plus"; }
    };
+   class Minus : public Func
+   {
+   public:
+       virtual float forward(Pair<float> xs) const override
+       {
+           return xs.lhs - xs.rhs;
+       }
+       virtual Pair<float> backward(Pair<float> xs, float dy) const override
+       {
+           return { dy, -dy };
+       }
+       std::string nodeType() const { return "Minus"; }
+   };
    class Mul : public Func
    {
    public:
@@ -260,6 +409,19 @@ namespace saka
        }
        std::string nodeType() const { return "Mul"; }
    };
+   class Div : public Func
+   {
+   public:
+       virtual float forward(Pair<float> xs) const override
+       {
+           return xs.lhs / xs.rhs;
+       }
+       virtual Pair<float> backward(Pair<float> xs, float dy) const override
+       {
+           return { dy / xs.rhs, -dy * xs.lhs / (xs.rhs * xs.rhs) };
+       }
+       std::string nodeType() const { return "Div"; }
+   };
 
    inline ValRef square(ValRef x)
    {
@@ -271,14 +433,34 @@ namespace saka
        FuncRef f(std::shared_ptr<Func>(new Exp()));
        return f.forward({ x, ValRef() });
    }
+   inline ValRef sqrt(ValRef x)
+   {
+       FuncRef f(std::shared_ptr<Func>(new Sqrt()));
+       return f.forward({ x, ValRef() });
+   }
+   inline ValRef operator-(ValRef x)
+   {
+       FuncRef f(std::shared_ptr<Func>(new Negate()));
+       return f.forward({ x, ValRef() });
+   }
    inline ValRef operator+(ValRef a, ValRef b)
    {
        FuncRef f(std::shared_ptr<Func>(new Plus()));
        return f.forward({ a, b });
    }
+   inline ValRef operator-(ValRef a, ValRef b)
+   {
+       FuncRef f(std::shared_ptr<Func>(new Minus()));
+       return f.forward({ a, b });
+   }
    inline ValRef operator*(ValRef a, ValRef b)
    {
        FuncRef f(std::shared_ptr<Func>(new Mul()));
        return f.forward({ a, b });
    }
+   inline ValRef operator/(ValRef a, ValRef b)
+   {
+       FuncRef f(std::shared_ptr<Func>(new Div()));
+       return f.forward({ a, b });
+   }
 }
\ No newline at end of file
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cmath>
+#include "saka.h"
+
+// Microfacet BSDF kernels on dval. The terms below evaluate their value and local derivatives together in floats
+// and make a single chain rule step, instead of one tangent update per arithmetic operation.
+// Directions point away from the surface and are unit length, alpha is the GGX roughness (not squared).
+namespace saka
+{
+    // GGX normal distribution for the cosine between the normal and the half vector
+    SAKA_DEVICE inline dval ggx_d(dval alpha, dval NoH)
+    {
+        if (NoH.v <= 0.0f)
+        {
+            return 0.0f;
+        }
+        const float invPi = 0.318309886f;
+        float a = alpha.v;
+        float a2 = a * a;
+        float c = NoH.v;
+        float c2 = c * c;
+        float d = c2 * (a2 - 1.0f) + 1.0f;
+        float invD = 1.0f / d;
+        float v = a2 * invPi * invD * invD;
+        float dvda = 2.0f * a * invPi * invD * invD * (1.0f - 2.0f * a2 * c2 * invD);
+        float dvdc = -4.0f * v * c * (a2 - 1.0f) * invD;
+        return details::chain(alpha, NoH, v, dvda, dvdc);
+    }
+
+    // Smith masking for one direction
+    SAKA_DEVICE inline dval smith_g1(dval alpha, dval NoV)
+    {
+        float a = alpha.v;
+        float a2 = a * a;
+        float c = NoV.v;
+        float r = sqrtf(a2 + (1.0f - a2) * c * c);
+        float invDen = 1.0f / (c + r);
+        float v = 2.0f * c * invDen;
+        float invR = 1.0f / r;
+        float drda = a * (1.0f - c * c) * invR;
+        float drdc = (1.0f - a2) * c * invR;
+        float dvda = -v * drda * invDen;
+        float dvdc = (2.0f - v * (1.0f + drdc)) * invDen;
+        return details::chain(alpha, NoV, v, dvda, dvdc);
+    }
+
+    // Height correlated Smith masking and shadowing
+    SAKA_DEVICE inline dval smith_g2(dval alpha, dval NoL, dval NoV)
+    {
+        float a = alpha.v;
+        float a2 = a * a;
+        float l = NoL.v;
+        float c = NoV.v;
+        float rl = sqrtf(a2 + (1.0f - a2) * l * l);
+        float rv = sqrtf(a2 + (1.0f - a2) * c * c);
+        float invDen = 1.0f / (c * rl + l * rv);
+        float v = 2.0f * l * c * invDen;
+        float drlda = a * (1.0f - l * l) / rl;
+        float drvda = a * (1.0f - c * c) / rv;
+        float drldl = (1.0f - a2) * l / rl;
+        float drvdc = (1.0f - a2) * c / rv;
+        float dvda = -v * (c * drlda + l * drvda) * invDen;
+        float dvdl = (2.0f * c - v * (c * drldl + rv)) * invDen;
+        float dvdc = (2.0f * l - v * (rl + l * drvdc)) * invDen;
+        return details::chain(alpha, NoL, NoV, v, dvda, dvdl, dvdc);
+    }
+
+    // Unpolarized Fresnel reflectance of a dielectric. cosi >= 0, eta = eta_t / eta_i. 1 under total internal reflection.
+    SAKA_DEVICE inline dval fresnel_dielectric(dval cosi, dval eta)
+    {
+        float c = cosi.v;
+        float e = eta.v;
+        float invE = 1.0f / e;
+        float s2 = 1.0f - c * c;
+        float st2 = s2 * invE * invE;
+        if (1.0f <= st2)
+        {
+            return 1.0f;
+        }
+        float ct = sqrtf(1.0f - st2);
+
+        // tangents of the transmitted cosine and the four terms of rs = (A - B) / (A + B), rp = (C - D) / (C + D)
+        float dct = (c * cosi.g + s2 * invE * eta.g) * invE * invE / ct;
+        float A = c;
+        float B = e * ct;
+        float C = e * c;
+        float D = ct;
+        float dA = cosi.g;
+        float dB = eta.g * ct + e * dct;
+        float dC = eta.g * c + e * cosi.g;
+        float dD = dct;
+
+        float invAB = 1.0f / (A + B);
+        float invCD = 1.0f / (C + D);
+        float rs = (A - B) * invAB;
+        float rp = (C - D) * invCD;
+        float drs = 2.0f * (B * dA - A * dB) * invAB * invAB;
+        float drp = 2.0f * (D * dC - C * dD) * invCD * invCD;
+
+        dval u;
+        u.v = 0.5f * (rs * rs + rp * rp);
+        u.g = rs * drs + rp * drp;
+        return u;
+    }
+
+    // Unpolarized Fresnel reflectance of a conductor with the complex index eta + i k, per color channel. cosi >= 0.
+    SAKA_DEVICE inline dval fresnel_conductor(dval cosi, dval eta, dval k)
+    {
+        float c = cosi.v;
+        float c2 = c * c;
+        float s2 = 1.0f - c2;
+        float n2 = eta.v * eta.v;
+        float k2 = k.v * k.v;
+        float dc2 = 2.0f * c * cosi.g;
+        float dn2 = 2.0f * eta.v * eta.g;
+        float dk2 = 2.0f * k.v * k.g;
+
+        // t = a^2 + b^2 and a of the usual formulation
+        float A = n2 - k2 - s2;
+        float dA = dn2 - dk2 + dc2;
+        float t = sqrtf(A * A + 4.0f * n2 * k2);
+        float dt = (A * dA + 2.0f * (dn2 * k2 + n2 * dk2)) / t;
+        float a = sqrtf(fmaxf(0.5f * (t + A), 1.0e-20f));
+        float da = 0.25f * (dt + dA) / a;
+
+        // one reciprocal per denominator serves the value and the tangent
+        float ac = a * c;
+        float dac = da * c + a * cosi.g;
+        float invD1 = 1.0f / (t + 2.0f * ac + c2);
+        float rs = (t - 2.0f * ac + c2) * invD1;
+        float drs = (dt - 2.0f * dac + dc2 - rs * (dt + 2.0f * dac + dc2)) * invD1;
+
+        float P = c2 * t;
+        float Q = 2.0f * ac * s2;
+        float S = s2 * s2;
+        float dP = dc2 * t + c2 * dt;
+        float dQ = 2.0f * (dac * s2 - ac * dc2);
+        float dS = -2.0f * s2 * dc2;
+        float invD2 = 1.0f / (P + Q + S);
+        float ratio = (P - Q + S) * invD2;
+        float dratio = (dP - dQ + dS - ratio * (dP + dQ + dS)) * invD2;
+        float rp = rs * ratio;
+        float drp = drs * ratio + rs * dratio;
+
+        dval u;
+        u.v = 0.5f * (rs + rp);
+        u.g = 0.5f * (drs + drp);
+        return u;
+    }
+
+    namespace details
+    {
+        // D G F / (4 NoI NoO) with one division, the tangent by the logarithmic derivative of the product
+        SAKA_DEVICE inline dval product(dval D, dval G, dval F, dval NoI, dval NoO)
+        {
+            float invI = 1.0f / NoI.v;
+            float invO = 1.0f / NoO.v;
+            float DG = D.v * G.v;
+            dval u;
+            u.v = 0.25f * DG * F.v * invI * invO;
+            u.g = 0.25f * invI * invO * ((D.g * G.v + D.v * G.g) * F.v + DG * F.g) - u.v * (NoI.g * invI + NoO.g * invO);
+            return u;
+        }
+    }
+
+    // GGX reflection off a conductor, per color channel, without the cosine of wo
+    SAKA_DEVICE inline dval ggx_conductor_brdf(dval3 wi, dval3 wo, dval3 n, dval alpha, dval eta, dval k)
+    {
+        dval NoI = dot(n, wi);
+        dval NoO = dot(n, wo);
+        if (NoI.v <= 0.0f || NoO.v <= 0.0f)
+        {
+            return 0.0f;
+        }
+        dval3 h = normalize(wi + wo);
+        dval D = ggx_d(alpha, dot(n, h));
+        dval G = smith_g2(alpha, NoI, NoO);
+        dval F = fresnel_conductor(dot(h, wi), eta, k);
+        return details::product(D, G, F, NoI, NoO);
+    }
+
+    // GGX reflection and transmission of a rough dielectric, without the cosine of wo.
+    // n points to the side with ior 1, eta is the ior of the other side. Radiance, not importance, is transported.
+    SAKA_DEVICE inline dval ggx_dielectric_bsdf(dval3 wi, dval3 wo, dval3 n, dval alpha, dval eta)
+    {
+        dval NoI = dot(n, wi);
+        if (NoI.v < 0.0f)
+        {
+            n = -n;
+            NoI = -NoI;
+            eta = 1.0f / eta;
+        }
+        dval NoO = dot(n, wo);
+        if (NoI.v == 0.0f || NoO.v == 0.0f)
+        {
+            return 0.0f;
+        }
+
+        if (0.0f < NoO.v)
+        {
+            dval3 h = normalize(wi + wo);
+            dval D = ggx_d(alpha, dot(n, h));
+            dval G = smith_g2(alpha, NoI, NoO);
+            dval F = fresnel_dielectric(dot(h, wi), eta);
+            return details::product(D, G, F, NoI, NoO);
+        }
+
+        // the generalized half vector of the refraction, on the side of n
+        dval3 h = normalize(wi + wo * eta);
+        if (dot(h, n).v < 0.0f)
+        {
+            h = -h;
+        }
+        dval HoI = dot(h, wi);
+        dval HoO = dot(h, wo);
+        if (HoI.v <= 0.0f || 0.0f <= HoO.v)
+        {
+            return 0.0f;
+        }
+        dval F = fresnel_dielectric(HoI, eta);
+        dval D = ggx_d(alpha, dot(n, h));
+        dval G = smith_g2(alpha, NoI, -NoO);
+        dval denom = HoI + HoO * eta;
+        return -HoI * HoO * eta * eta * (1.0f - F) * D * G / (NoI * -NoO * denom * denom);
+    }
+
+    // A microfacet normal around n distributed by D(m) cos(m), from two uniform numbers.
+    // The sample moves with alpha and n, so its tangent is that of the reparameterized sample.
+    SAKA_DEVICE inline dval3 sample_ggx_normal(dval3 n, dval alpha, float u0, float u1)
+    {
+        const float pi = 3.14159265f;
+        dval tan2 = alpha * alpha * (u0 / (1.0f - u0));
+        dval cosTheta = rsqrt(tan2 + 1.0f);
+        dval sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+        float phi = 2.0f * pi * u1;
+        dval3 axis = fabsf(n.x.v) < 0.9f ? dval3{ 1.0f, 0.0f, 0.0f } : dval3{ 0.0f, 1.0f, 0.0f };
+        dval3 t = normalize(cross(axis, n));
+        dval3 b = cross(n, t);
+        return t * (sinTheta * cosf(phi)) + b * (sinTheta * sinf(phi)) + n * cosTheta;
+    }
+
+    SAKA_DEVICE inline dval3 sample_ggx_reflection(dval3 wi, dval3 n, dval alpha, float u0, float u1)
+    {
+        return reflection(wi, sample_ggx_normal(n, alpha, u0, u1));
+    }
+
+    // n and eta as in ggx_dielectric_bsdf. Returns the zero vector on total internal reflection at the sampled normal.
+    SAKA_DEVICE inline dval3 sample_ggx_refraction(dval3 wi, dval3 n, dval alpha, dval eta, float u0, float u1, bool* tir)
+    {
+        if (dot(n, wi).v < 0.0f)
+        {
+            n = -n;
+            eta = 1.0f / eta;
+        }
+        dval3 m = sample_ggx_normal(n, alpha, u0, u1);
+        if (dot(m, wi).v < 0.0f)
+        {
+            m = -m;
+        }
+        dval3 t = refraction_norm_free(wi, m, eta, tir);
+        return select(*tir, t, normalize(t));
+    }
+
+    // Directions of many samples in the shading frame (n = +z), structure of arrays
+    struct BsdfSamples
+    {
+        const float* wix; const float* wiy; const float* wiz;
+        const float* wox; const float* woy; const float* woz;
+        int count;
+    };
+
+    // value[i] and tangent[i] of ggx_conductor_brdf for every sample, with the tangents of the material parameters.
+    // These are plain loops over the single sample kernels, for callers that keep samples in this layout; not a SIMD path.
+    inline void ggx_conductor_brdf(const BsdfSamples& s, dval alpha, dval eta, dval k, float* value, float* tangent)
+    {
+        const dval3 n = { 0.0f, 0.0f, 1.0f };
+        for (int i = 0; i < s.count; i++)
+        {
+            dval f = ggx_conductor_brdf({ s.wix[i], s.wiy[i], s.wiz[i] }, { s.wox[i], s.woy[i], s.woz[i] }, n, alpha, eta, k);
+            value[i] = f.v;
+            tangent[i] = f.g;
+        }
+    }
+    inline void ggx_dielectric_bsdf(const BsdfSamples& s, dval alpha, dval eta, float* value, float* tangent)
+    {
+        const dval3 n = { 0.0f, 0.0f, 1.0f };
+        for (int i = 0; i < s.count; i++)
+        {
+            dval f = ggx_dielectric_bsdf({ s.wix[i], s.wiy[i], s.wiz[i] }, { s.wox[i], s.woy[i], s.woz[i] }, n, alpha, eta);
+            value[i] = f.v;
+            tangent[i] = f.g;
+        }
+    }
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "saka.h"
+
+namespace saka
+{
+    // 32 bytes: the bounds and two indices
+    struct BVHNode
+    {
+        float lower[3];
+        float upper[3];
+        int offset; // leaf: first entry in BVH::indices, inner: index of the second child, the first one follows this node
+        int count;  // leaf: number of triangles, inner: 0
+    };
+    static_assert(sizeof(BVHNode) == 32, "BVHNode is expected to be 32 bytes");
+
+    // Bounding volume hierarchy over dtriangles, built with a binned surface area heuristic.
+    // Traversal and triangle tests run on the float values only. The closest hit is re-intersected with dval once,
+    // so a ray against thousands of triangles costs one triangle's worth of tangent arithmetic.
+    class BVH
+    {
+    public:
+        enum
+        {
+            MAX_LEAF_SIZE = 4,
+            BIN_COUNT = 16,
+            MAX_DEPTH = 64, // of a leaf below the root, which bounds the traversal stack
+        };
+
+        void build(const dtriangles& tris)
+        {
+            nodes.clear();
+            indices.resize(tris.count);
+
+            std::vector<Box> bounds(tris.count);
+            std::vector<float> centroids(tris.count * 3);
+            for (int i = 0; i < tris.count; i++)
+            {
+                const dval* xs[3][3] = {
+                    { tris.x0, tris.y0, tris.z0 },
+                    { tris.x1, tris.y1, tris.z1 },
+                    { tris.x2, tris.y2, tris.z2 },
+                };
+                Box b;
+                for (int v = 0; v < 3; v++)
+                {
+                    b.extend(xs[v][0][i].v, xs[v][1][i].v, xs[v][2][i].v);
+                }
+                bounds[i] = b;
+                for (int a = 0; a < 3; a++)
+                {
+                    centroids[i * 3 + a] = (b.lower[a] + b.upper[a]) * 0.5f;
+                }
+                indices[i] = i;
+            }
+
+            if (tris.count == 0)
+            {
+                return;
+            }
+            nodes.reserve(tris.count * 2);
+            buildRecursive(bounds, centroids, 0, tris.count, 0);
+        }
+
+        // The closest triangle hit by the ray, or -1. tris has to be the triangles the BVH was built from.
+        int intersect(dval3 ro, dval3 rd, const dtriangles& tris, dhit* hit, float tmax = 3.402823466e+38f) const
+        {
+            float o[3] = { ro.x.v, ro.y.v, ro.z.v };
+            float d[3] = { rd.x.v, rd.y.v, rd.z.v };
+            float t;
+            int closest = intersect_primal(o, d, tris, tmax, &t);
+            if (closest != -1)
+            {
+                *hit = details::intersect_triangle_tangent(ro, rd,
+                    { tris.x0[closest], tris.y0[closest], tris.z0[closest] },
+                    { tris.x1[closest], tris.y1[closest], tris.z1[closest] },
+                    { tris.x2[closest], tris.y2[closest], tris.z2[closest] });
+            }
+            return closest;
+        }
+
+        // The float part of intersect(), e.g. for shadow rays that need no tangents.
+        int intersect_primal(const float o[3], const float d[3], const dtriangles& tris, float tmax, float* tHit) const
+        {
+            if (nodes.empty())
+            {
+                return -1;
+            }
+
+            float invD[3] = { 1.0f / d[0], 1.0f / d[1], 1.0f / d[2] };
+
+            int closest = -1;
+            // an inner node pushes at most one child, so a path from the root pushes fewer than MAX_DEPTH
+            int stack[MAX_DEPTH];
+            float stackT[MAX_DEPTH];
+            int sp = 0;
+            int node = 0;
+            for (;;)
+            {
+                const BVHNode& n = nodes[node];
+                if (0 < n.count)
+                {
+                    for (int j = 0; j < n.count; j++)
+                    {
+                        int i = indices[n.offset + j];
+                        float t;
+                        if (details::intersect_triangle_primal(
+                            o[0], o[1], o[2], d[0], d[1], d[2],
+                            tris.x0[i].v, tris.y0[i].v, tris.z0[i].v,
+                            tris.x1[i].v, tris.y1[i].v, tris.z1[i].v,
+                            tris.x2[i].v, tris.y2[i].v, tris.z2[i].v, tmax, &t))
+                        {
+                            tmax = t;
+                            closest = i;
+                        }
+                    }
+                }
+                else
+                {
+                    // visit the nearer child first and skip the farther one if a closer hit turns up
+                    int a = node + 1;
+                    int b = n.offset;
+                    float ta = slab(nodes[a], o, invD, tmax);
+                    float tb = slab(nodes[b], o, invD, tmax);
+                    if (tb < ta)
+                    {
+                        std::swap(a, b);
+                        std::swap(ta, tb);
+                    }
+                    if (ta < tmax)
+                    {
+                        if (tb < tmax)
+                        {
+                            stack[sp] = b;
+                            stackT[sp] = tb;
+                            sp++;
+                        }
+                        node = a;
+                        continue;
+                    }
+                }
+
+                // pop, skipping nodes entered beyond the current closest hit
+                for (;;)
+                {
+                    if (sp == 0)
+                    {
+                        *tHit = tmax;
+                        return closest;
+                    }
+                    sp--;
+                    if (stackT[sp] < tmax)
+                    {
+                        node = stack[sp];
+                        break;
+                    }
+                }
+            }
+        }
+
+        std::vector<BVHNode> nodes;
+        std::vector<int> indices;
+
+    private:
+        struct Box
+        {
+            float lower[3] = { 3.402823466e+38f, 3.402823466e+38f, 3.402823466e+38f };
+            float upper[3] = { -3.402823466e+38f, -3.402823466e+38f, -3.402823466e+38f };
+
+            void extend(float x, float y, float z)
+            {
+                float p[3] = { x, y, z };
+                for (int a = 0; a < 3; a++)
+                {
+                    lower[a] = std::min(lower[a], p[a]);
+                    upper[a] = std::max(upper[a], p[a]);
+                }
+            }
+            void extend(const Box& b)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    lower[a] = std::min(lower[a], b.lower[a]);
+                    upper[a] = std::max(upper[a], b.upper[a]);
+                }
+            }
+            float area() const
+            {
+                float e[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    e[a] = std::max(upper[a] - lower[a], 0.0f);
+                }
+                return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+            }
+        };
+
+        // entry distance of the ray into the node, or the float max on a miss
+        static float slab(const BVHNode& n, const float o[3], const float invD[3], float tmax)
+        {
+            float t0 = 0.0f;
+            float t1 = tmax;
+            for (int a = 0; a < 3; a++)
+            {
+                float tNear = (n.lower[a] - o[a]) * invD[a];
+                float tFar = (n.upper[a] - o[a]) * invD[a];
+                if (tFar < tNear)
+                {
+                    std::swap(tNear, tFar);
+                }
+                t0 = std::max(t0, tNear);
+                t1 = std::min(t1, tFar);
+            }
+            return t0 <= t1 ? t0 : 3.402823466e+38f;
+        }
+
+        int buildRecursive(const std::vector<Box>& bounds, const std::vector<float>& centroids, int begin, int end, int depth)
+        {
+            int nodeIndex = (int)nodes.size();
+            nodes.emplace_back();
+
+            Box box;
+            Box centroidBox;
+            for (int i = begin; i < end; i++)
+            {
+                int t = indices[i];
+                box.extend(bounds[t]);
+                centroidBox.extend(centroids[t * 3], centroids[t * 3 + 1], centroids[t * 3 + 2]);
+            }
+            for (int a = 0; a < 3; a++)
+            {
+                nodes[nodeIndex].lower[a] = box.lower[a];
+                nodes[nodeIndex].upper[a] = box.upper[a];
+            }
+
+            // Deep down the SAH gives way to median splits, which halve the count, so any int count ends in a leaf
+            // by MAX_DEPTH. The leaf at MAX_DEPTH only guards against that arithmetic being wrong.
+            int count = end - begin;
+            bool median = MAX_DEPTH - 32 <= depth;
+            if (MAX_DEPTH <= depth)
+            {
+                nodes[nodeIndex].offset = begin;
+                nodes[nodeIndex].count = count;
+                return nodeIndex;
+            }
+
+            int axis = -1;
+            int splitBin = 0;
+            if (MAX_LEAF_SIZE < count && !median)
+            {
+                // binned SAH over the centroids. The cost is relative to intersecting every triangle here.
+                float bestCost = (float)count;
+                for (int a = 0; a < 3; a++)
+                {
+                    float extent = centroidBox.upper[a] - centroidBox.lower[a];
+                    if (extent <= 0.0f)
+                    {
+                        continue;
+                    }
+                    Box binBoxes[BIN_COUNT];
+                    int binCounts[BIN_COUNT] = {};
+                    for (int i = begin; i < end; i++)
+                    {
+                        int t = indices[i];
+                        int bin = binOf(centroids[t * 3 + a], centroidBox.lower[a], extent);
+                        binBoxes[bin].extend(bounds[t]);
+                        binCounts[bin]++;
+                    }
+
+                    float rightAreas[BIN_COUNT];
+                    int rightCounts[BIN_COUNT];
+                    Box right;
+                    int rightCount = 0;
+                    for (int b = BIN_COUNT - 1; 0 < b; b--)
+                    {
+                        right.extend(binBoxes[b]);
+                        rightCount += binCounts[b];
+                        rightAreas[b] = right.area();
+                        rightCounts[b] = rightCount;
+                    }
+                    Box left;
+                    int leftCount = 0;
+                    float invArea = 1.0f / box.area();
+                    for (int b = 1; b < BIN_COUNT; b++)
+                    {
+                        left.extend(binBoxes[b - 1]);
+                        leftCount += binCounts[b - 1];
+                        if (leftCount == 0 || rightCounts[b] == 0)
+                        {
+                            continue;
+                        }
+                        float cost = 1.0f + (left.area() * leftCount + rightAreas[b] * rightCounts[b]) * invArea;
+                        if (cost < bestCost)
+                        {
+                            bestCost = cost;
+                            axis = a;
+                            splitBin = b;
+                        }
+                    }
+                }
+            }
+
+            if (axis < 0)
+            {
+                // no split beats the leaf. Very large leaves are split at the median anyway to keep the traversal stack bounded.
+                if (count <= (median ? MAX_LEAF_SIZE : MAX_LEAF_SIZE * 4))
+                {
+                    nodes[nodeIndex].offset = begin;
+                    nodes[nodeIndex].count = count;
+                    return nodeIndex;
+                }
+            }
+
+            int mid;
+            if (0 <= axis)
+            {
+                float extent = centroidBox.upper[axis] - centroidBox.lower[axis];
+                int* it = std::partition(indices.data() + begin, indices.data() + end, [&](int t) {
+                    return binOf(centroids[t * 3 + axis], centroidBox.lower[axis], extent) < splitBin;
+                });
+                mid = (int)(it - indices.data());
+            }
+            else
+            {
+                mid = (begin + end) / 2;
+            }
+
+            nodes[nodeIndex].count = 0;
+            buildRecursive(bounds, centroids, begin, mid, depth + 1);
+            int second = buildRecursive(bounds, centroids, mid, end, depth + 1);
+            nodes[nodeIndex].offset = second;
+            return nodeIndex;
+        }
+
+        static int binOf(float c, float lower, float extent)
+        {
+            int bin = (int)((c - lower) / extent * BIN_COUNT);
+            return std::min(std::max(bin, 0), BIN_COUNT - 1);
+        }
+    };
+}
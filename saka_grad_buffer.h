@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include "saka_backward.h"
+#include "saka_pool.h"
+
+namespace saka
+{
+    // Gradient accumulation for many threads scattering into one parameter array (texels, vertex positions).
+    // Every thread writes its own shard, so add() is a plain, lock-free += and never an atomic.
+    // Shards start on their own cache lines, so neighbouring shards never false-share.
+    // reduce() sums the shards in a fixed order, which makes it deterministic for given shard contents.
+    class grad_buffer
+    {
+    public:
+        enum
+        {
+            CACHE_LINE_FLOATS = 16,
+            REDUCE_CHUNK = 4096, // indices per reduce task
+        };
+
+        // compensated: Kahan summation within each shard, for long runs of small contributions to few parameters
+        grad_buffer(int size, int shardCount, bool compensated = false)
+            : m_size(size), m_shardCount(shardCount), m_compensated(compensated)
+        {
+            m_stride = (size + CACHE_LINE_FLOATS - 1) / CACHE_LINE_FLOATS * CACHE_LINE_FLOATS;
+            m_storage.resize((size_t)m_stride * shardCount * (compensated ? 2 : 1) + CACHE_LINE_FLOATS);
+
+            // align the first shard; the stride keeps the rest aligned
+            uintptr_t p = (uintptr_t)m_storage.data();
+            uintptr_t aligned = (p + CACHE_LINE_FLOATS * sizeof(float) - 1) & ~(uintptr_t)(CACHE_LINE_FLOATS * sizeof(float) - 1);
+            m_sums = m_storage.data() + (aligned - p) / sizeof(float);
+            m_compensations = compensated ? m_sums + (size_t)m_stride * shardCount : nullptr;
+        }
+        grad_buffer(const grad_buffer&) = delete;
+        grad_buffer& operator=(const grad_buffer&) = delete;
+
+        int size() const { return m_size; }
+        int shardCount() const { return m_shardCount; }
+
+        // A shard must only be written by one thread at a time, e.g. shard = worker index of WorkStealingPool::run
+        void add(int shard, int index, float value)
+        {
+            float* sum = m_sums + (size_t)m_stride * shard + index;
+            if (m_compensated)
+            {
+                float* c = m_compensations + (size_t)m_stride * shard + index;
+                float y = value - *c;
+                float t = *sum + y;
+                *c = (t - *sum) - y;
+                *sum = t;
+            }
+            else
+            {
+                *sum += value;
+            }
+        }
+
+        // Derivatives of leaves after ValRef::backward(), leaf i goes to indices[i]. A leaf's derivative is only
+        // complete at the end of the sweep, so this is one add per leaf instead of one per edge into it.
+        void add(int shard, const ValRef* leaves, const int* indices, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                add(shard, indices[i], leaves[i].derivative());
+            }
+        }
+
+        void clear(WorkStealingPool* pool = nullptr)
+        {
+            forChunks(pool, [this](int begin, int end) {
+                for (int s = 0; s < m_shardCount; s++)
+                {
+                    std::fill(m_sums + (size_t)m_stride * s + begin, m_sums + (size_t)m_stride * s + end, 0.0f);
+                    if (m_compensated)
+                    {
+                        std::fill(m_compensations + (size_t)m_stride * s + begin, m_compensations + (size_t)m_stride * s + end, 0.0f);
+                    }
+                }
+            });
+        }
+
+        // out[i] = the sum of all shards at i. Shards are added in order in double precision, chunks of indices run in parallel.
+        void reduce(float* out, WorkStealingPool* pool = nullptr) const
+        {
+            forChunks(pool, [this, out](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                {
+                    double sum = 0.0;
+                    for (int s = 0; s < m_shardCount; s++)
+                    {
+                        sum += m_sums[(size_t)m_stride * s + i];
+                        if (m_compensated)
+                        {
+                            sum -= m_compensations[(size_t)m_stride * s + i];
+                        }
+                    }
+                    out[i] = (float)sum;
+                }
+            });
+        }
+
+    private:
+        template <class F>
+        void forChunks(WorkStealingPool* pool, F f) const
+        {
+            int chunks = (m_size + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+            run(pool, chunks, [&](int c, int) {
+                f(c * REDUCE_CHUNK, std::min((c + 1) * REDUCE_CHUNK, m_size));
+            });
+        }
+
+        int m_size;
+        int m_shardCount;
+        bool m_compensated;
+        int m_stride;
+        std::vector<float> m_storage;
+        float* m_sums;
+        float* m_compensations;
+    };
+}
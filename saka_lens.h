@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+#include "saka.h"
+#include "saka_pool.h"
+
+namespace saka
+{
+    // One refracting surface of a sequential lens system. The optical axis is +z, the first vertex is at z = 0.
+    // The sag is the even asphere z(r) = c r^2 / (1 + sqrt(1 - (1 + k) c^2 r^2)) + a4 r^4 + a6 r^6.
+    struct LensSurface
+    {
+        float curvature = 0.0f;  // 1 / radius, 0 for a plane
+        float thickness = 0.0f;  // along the axis to the next vertex, or to the image plane after the last surface
+        float ior = 1.0f;        // behind the surface
+        float conic = 0.0f;
+        float a4 = 0.0f;
+        float a6 = 0.0f;
+        float aperture = 1.0e30f; // clear semi-diameter, rays outside are vignetted
+    };
+
+    // Ray bundle in structure of arrays layout. Directions need not be normalized.
+    struct LensRays
+    {
+        std::vector<float> ox, oy, oz;
+        std::vector<float> dx, dy, dz;
+
+        int size() const { return (int)ox.size(); }
+        void push(float x, float y, float z, float u, float v, float w)
+        {
+            ox.push_back(x); oy.push_back(y); oz.push_back(z);
+            dx.push_back(u); dy.push_back(v); dz.push_back(w);
+        }
+    };
+
+    // Image plane positions of a bundle and their Jacobian. Rays that miss a surface, hit an aperture stop
+    // or are totally reflected are marked invalid and have zero derivatives.
+    struct LensSpots
+    {
+        std::vector<float> x, y;
+        std::vector<float> dxdp, dydp; // ray major, LensSystem::parameterCount() entries per ray
+        std::vector<uint8_t> valid;
+        int parameterCount = 0;
+
+        int size() const { return (int)x.size(); }
+    };
+
+    class LensSystem
+    {
+    public:
+        enum
+        {
+            LANES = 8,          // parameters per forward pass
+            RAYS_PER_TASK = 32,
+            NEWTON_ITERATIONS = 16,
+        };
+        enum
+        {
+            CURVATURE = 0,
+            THICKNESS = 1,
+            IOR = 2,
+            PARAMETERS_PER_SURFACE = 3,
+        };
+
+        std::vector<LensSurface> surfaces;
+        float objectIor = 1.0f;
+
+        int parameterCount() const { return (int)surfaces.size() * PARAMETERS_PER_SURFACE; }
+        static int parameterIndex(int surface, int kind) { return surface * PARAMETERS_PER_SURFACE + kind; }
+
+        // Spot positions and their Jacobian with respect to every curvature, thickness and IOR.
+        // Each ray takes parameterCount() / LANES forward passes, bundles of rays run in parallel on the pool.
+        void trace(const LensRays& rays, LensSpots* spots, WorkStealingPool* pool = nullptr) const
+        {
+            int n = rays.size();
+            int P = parameterCount();
+            spots->parameterCount = P;
+            spots->x.resize(n);
+            spots->y.resize(n);
+            spots->dxdp.resize((size_t)n * P);
+            spots->dydp.resize((size_t)n * P);
+            spots->valid.resize(n);
+
+            int tasks = (n + RAYS_PER_TASK - 1) / RAYS_PER_TASK;
+            auto task = [&](int t, int) {
+                for (int i = t * RAYS_PER_TASK; i < std::min((t + 1) * RAYS_PER_TASK, n); i++)
+                {
+                    traceRay(rays, i, spots);
+                }
+            };
+            run(pool, tasks, task);
+        }
+
+        // RMS distance of the valid spots from their centroid, with its gradient with respect to all parameters if gradient is not null.
+        static float rmsSpotSize(const LensSpots& spots, float* gradient)
+        {
+            int P = spots.parameterCount;
+            double cx = 0.0, cy = 0.0;
+            int count = 0;
+            for (int i = 0; i < spots.size(); i++)
+            {
+                if (spots.valid[i])
+                {
+                    cx += spots.x[i];
+                    cy += spots.y[i];
+                    count++;
+                }
+            }
+            if (count == 0)
+            {
+                if (gradient)
+                {
+                    std::fill(gradient, gradient + P, 0.0f);
+                }
+                return 0.0f;
+            }
+            cx /= count;
+            cy /= count;
+
+            // the centroid terms of the gradient sum to zero, so only the spots' own derivatives remain
+            double sum = 0.0;
+            std::vector<double> g(gradient ? P : 0, 0.0);
+            for (int i = 0; i < spots.size(); i++)
+            {
+                if (!spots.valid[i])
+                {
+                    continue;
+                }
+                double ex = spots.x[i] - cx;
+                double ey = spots.y[i] - cy;
+                sum += ex * ex + ey * ey;
+                for (int p = 0; p < (int)g.size(); p++)
+                {
+                    g[p] += ex * spots.dxdp[(size_t)i * P + p] + ey * spots.dydp[(size_t)i * P + p];
+                }
+            }
+            double rms = std::sqrt(sum / count);
+            for (int p = 0; p < (int)g.size(); p++)
+            {
+                gradient[p] = 0.0 < rms ? (float)(g[p] / (count * rms)) : 0.0f;
+            }
+            return (float)rms;
+        }
+
+    private:
+        void traceRay(const LensRays& rays, int i, LensSpots* spots) const
+        {
+            int P = parameterCount();
+            float* dxdp = &spots->dxdp[(size_t)i * P];
+            float* dydp = &spots->dydp[(size_t)i * P];
+            bool valid = true;
+            for (int first = 0; first < std::max(P, 1) && valid; first += LANES)
+            {
+                dvaln<LANES> x, y;
+                valid = traceLanes<LANES>(rays, i, first, &x, &y);
+                spots->x[i] = x.v;
+                spots->y[i] = y.v;
+                for (int lane = 0; lane < LANES && first + lane < P; lane++)
+                {
+                    dxdp[first + lane] = x.g[lane];
+                    dydp[first + lane] = y.g[lane];
+                }
+            }
+            spots->valid[i] = valid;
+            if (!valid)
+            {
+                std::fill(dxdp, dxdp + P, 0.0f);
+                std::fill(dydp, dydp + P, 0.0f);
+            }
+        }
+
+        // parameters [first, first + N) are seeded on the lanes
+        template <int N>
+        bool traceLanes(const LensRays& rays, int i, int first, dvaln<N>* imageX, dvaln<N>* imageY) const
+        {
+            typedef dvaln<N> real;
+            typedef dvaln3<N> real3;
+
+            auto parameter = [first](float value, int index) {
+                real p = value;
+                if (first <= index && index < first + N)
+                {
+                    p.requires_grad(index - first);
+                }
+                return p;
+            };
+
+            real3 o = { rays.ox[i], rays.oy[i], rays.oz[i] };
+            real3 d = { rays.dx[i], rays.dy[i], rays.dz[i] };
+            real vertex = 0.0f;
+            real iorBefore = objectIor;
+            for (int s = 0; s < (int)surfaces.size(); s++)
+            {
+                const LensSurface& surface = surfaces[s];
+                real c = parameter(surface.curvature, parameterIndex(s, CURVATURE));
+                real thickness = parameter(surface.thickness, parameterIndex(s, THICKNESS));
+                real ior = parameter(surface.ior, parameterIndex(s, IOR));
+                float k1 = 1.0f + surface.conic;
+
+                // Newton on the sag starting from the vertex plane. The last iteration runs at the converged point,
+                // which makes the tangents the implicit derivatives of the intersection.
+                real t = (vertex - o.z) / d.z;
+                real dsdu;
+                real3 p;
+                bool converged = false;
+                for (int iteration = 0; iteration < NEWTON_ITERATIONS && !converged; iteration++)
+                {
+                    p = o + d * t;
+                    real u = p.x * p.x + p.y * p.y;
+                    real q2 = 1.0f - k1 * c * c * u;
+                    if (q2.v <= 0.0f)
+                    {
+                        return false; // beyond the edge of the conic
+                    }
+                    real q = sqrt(q2);
+                    real sag = c * u / (1.0f + q) + (surface.a4 + surface.a6 * u) * u * u;
+                    dsdu = c / (2.0f * q) + (2.0f * surface.a4 + 3.0f * surface.a6 * u) * u;
+                    real f = p.z - vertex - sag;
+                    real df = d.z - dsdu * 2.0f * (p.x * d.x + p.y * d.y);
+                    real step = f / df;
+                    t = t - step;
+                    converged = std::fabs(step.v) <= 1.0e-6f * (1.0f + std::fabs(t.v));
+                }
+                if (!converged || t.v < 0.0f)
+                {
+                    return false;
+                }
+                p = o + d * t;
+                if (surface.aperture * surface.aperture < p.x.v * p.x.v + p.y.v * p.y.v)
+                {
+                    return false;
+                }
+
+                // the gradient of z - sag(x^2 + y^2), at the dsdu of the last iteration
+                real3 n = { -2.0f * p.x * dsdu, -2.0f * p.y * dsdu, 1.0f };
+                real3 wi = -d;
+                if (dot(n, wi).v < 0.0f)
+                {
+                    n = -n;
+                }
+                bool tir;
+                d = normalize(refraction_norm_free(wi, n, ior / iorBefore, &tir));
+                if (tir)
+                {
+                    return false;
+                }
+
+                o = p;
+                vertex = vertex + thickness;
+                iorBefore = ior;
+            }
+
+            real t = (vertex - o.z) / d.z;
+            *imageX = o.x + d.x * t;
+            *imageY = o.y + d.y * t;
+            return 0.0f < t.v;
+        }
+    };
+}
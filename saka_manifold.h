@@ -0,0 +1,397 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+#include "saka.h"
+#include "saka_pool.h"
+
+namespace saka
+{
+    // A specular height field z = height + amplitude * sin(fx x + px) * cos(fy y + py), parameterized by (x, y).
+    // amplitude = 0 is a plane.
+    struct SpecularSurface
+    {
+        float height = 0.0f;
+        float amplitude = 0.0f;
+        float frequency[2] = { 1.0f, 1.0f };
+        float phase[2] = { 0.0f, 0.0f };
+        float eta = 0.0f; // ior below / ior above, 0 for a mirror
+    };
+
+    // 2x2 blocks, row major
+    struct Block2
+    {
+        float m[4];
+    };
+
+    namespace details
+    {
+        SAKA_DEVICE inline Block2 mul(Block2 a, Block2 b)
+        {
+            return { {
+                a.m[0] * b.m[0] + a.m[1] * b.m[2], a.m[0] * b.m[1] + a.m[1] * b.m[3],
+                a.m[2] * b.m[0] + a.m[3] * b.m[2], a.m[2] * b.m[1] + a.m[3] * b.m[3]
+            } };
+        }
+        SAKA_DEVICE inline void mul(Block2 a, const float x[2], float r[2])
+        {
+            float r0 = a.m[0] * x[0] + a.m[1] * x[1];
+            float r1 = a.m[2] * x[0] + a.m[3] * x[1];
+            r[0] = r0;
+            r[1] = r1;
+        }
+        SAKA_DEVICE inline bool inverse(Block2 a, Block2* r)
+        {
+            float det = a.m[0] * a.m[3] - a.m[1] * a.m[2];
+            if (!(1.0e-20f < std::fabs(det)))
+            {
+                return false;
+            }
+            float inv = 1.0f / det;
+            *r = { { a.m[3] * inv, -a.m[1] * inv, -a.m[2] * inv, a.m[0] * inv } };
+            return true;
+        }
+
+        // Block Thomas algorithm for lower[i] x[i - 1] + diagonal[i] x[i] + upper[i] x[i + 1] = rhs[i], i in [0, n).
+        // lower[0] and upper[n - 1] are ignored. diagonal and rhs are overwritten. Returns false on a singular pivot block.
+        SAKA_DEVICE inline bool solve_block_tridiagonal(int n, const Block2* lower, Block2* diagonal, const Block2* upper, float (*rhs)[2], float (*x)[2])
+        {
+            Block2 inv;
+            for (int i = 1; i < n; i++)
+            {
+                if (!inverse(diagonal[i - 1], &inv))
+                {
+                    return false;
+                }
+                Block2 f = mul(lower[i], inv);
+                Block2 fu = mul(f, upper[i - 1]);
+                for (int j = 0; j < 4; j++)
+                {
+                    diagonal[i].m[j] -= fu.m[j];
+                }
+                float fr[2];
+                mul(f, rhs[i - 1], fr);
+                rhs[i][0] -= fr[0];
+                rhs[i][1] -= fr[1];
+            }
+            for (int i = n - 1; 0 <= i; i--)
+            {
+                float r[2] = { rhs[i][0], rhs[i][1] };
+                if (i + 1 < n)
+                {
+                    float ux[2];
+                    mul(upper[i], x[i + 1], ux);
+                    r[0] -= ux[0];
+                    r[1] -= ux[1];
+                }
+                if (!inverse(diagonal[i], &inv))
+                {
+                    return false;
+                }
+                mul(inv, r, x[i]);
+            }
+            return true;
+        }
+
+        // Real and Real3 are dval and dval3, or dvaln and dvaln3 for several tangents in one pass
+        template <class Real, class Real3>
+        SAKA_DEVICE inline Real3 surface_point(const SpecularSurface& s, Real x, Real y, Real3* normal)
+        {
+            Real ax = x * s.frequency[0] + s.phase[0];
+            Real ay = y * s.frequency[1] + s.phase[1];
+            Real sx = sin(ax);
+            Real cy = cos(ay);
+            Real hx = cos(ax) * cy * (s.amplitude * s.frequency[0]);
+            Real hy = sx * sin(ay) * (-s.amplitude * s.frequency[1]);
+            *normal = { -hx, -hy, 1.0f };
+            return { x, y, sx * cy * s.amplitude + s.height };
+        }
+
+        // The direction the surface sends light from prev into, against the direction towards next, in a frame around the latter.
+        // Zero exactly on a specular path. Returns false on total internal reflection.
+        template <class Real, class Real3>
+        SAKA_DEVICE inline bool specular_constraint(const SpecularSurface& s, Real3 prev, Real x, Real y, Real3 next, Real c[2])
+        {
+            Real3 n;
+            Real3 p = surface_point(s, x, y, &n);
+            Real3 wi = normalize(prev - p);
+            Real3 wo;
+            if (s.eta == 0.0f)
+            {
+                wo = reflection(wi, n);
+            }
+            else
+            {
+                // refraction_norm_free wants the normal on the side of wi, and eta_t / eta_i for that side
+                bool above = 0.0f < dot(wi, n).v;
+                bool tir;
+                wo = refraction_norm_free(wi, above ? n : -n, above ? s.eta : 1.0f / s.eta, &tir);
+                if (tir)
+                {
+                    return false;
+                }
+            }
+            wo = normalize(wo);
+            Real3 target = normalize(next - p);
+
+            // the frame only needs to be orthogonal to the target at the solution, so it is built from floats
+            float t[3] = { target.x.v, target.y.v, target.z.v };
+            float a[3] = { 0.0f, 0.0f, 0.0f };
+            a[std::fabs(t[0]) < 0.9f ? 0 : 1] = 1.0f;
+            float b1[3] = { a[1] * t[2] - a[2] * t[1], a[2] * t[0] - a[0] * t[2], a[0] * t[1] - a[1] * t[0] };
+            float l = 1.0f / std::sqrt(b1[0] * b1[0] + b1[1] * b1[1] + b1[2] * b1[2]);
+            b1[0] *= l; b1[1] *= l; b1[2] *= l;
+            float b2[3] = { t[1] * b1[2] - t[2] * b1[1], t[2] * b1[0] - t[0] * b1[2], t[0] * b1[1] - t[1] * b1[0] };
+
+            Real3 d = wo - target;
+            c[0] = d.x * b1[0] + d.y * b1[1] + d.z * b1[2];
+            c[1] = d.x * b2[0] + d.y * b2[1] + d.z * b2[2];
+            return true;
+        }
+    }
+
+    // Newton solver for specular chains x0 -> x1 ... xk -> xk+1 with fixed endpoints and one vertex per surface of the chain.
+    // Vertex i only couples to its neighbours, so the constraint Jacobian is block tridiagonal with 2x2 blocks,
+    // assembled with dval and solved by block elimination in O(k).
+    class SpecularManifoldSolver
+    {
+    public:
+        enum
+        {
+            MAX_VERTICES = 8,
+            LANES_PER_TASK = 64,
+        };
+
+        // Independent solves in structure of arrays layout. uv holds the initial guess on input and the solution on output.
+        struct Batch
+        {
+            std::vector<float> start;    // 3 per lane
+            std::vector<float> end;      // 3 per lane
+            std::vector<float> uv;       // 2 per vertex per lane
+            std::vector<int> iterations;
+            std::vector<uint8_t> converged;
+
+            int size() const { return (int)start.size() / 3; }
+        };
+
+        std::vector<SpecularSurface> chain;
+        int maxIterations = 32;
+        float tolerance = 1.0e-5f; // on the largest constraint component
+        int maxHalvings = 8;       // step halvings per iteration when the constraint does not decrease
+
+        // Lanes run in tasks on the pool. Within a task, converged and failed lanes leave the active list after every iteration,
+        // so they stop costing work while the slow ones finish.
+        // Returns the number of Newton iterations run over all lanes.
+        long long solve(Batch* batch, WorkStealingPool* pool = nullptr) const
+        {
+            int n = batch->size();
+            batch->iterations.assign(n, 0);
+            batch->converged.assign(n, 0);
+            if ((int)chain.size() < 1 || MAX_VERTICES < (int)chain.size())
+            {
+                return 0;
+            }
+
+            int tasks = (n + LANES_PER_TASK - 1) / LANES_PER_TASK;
+            std::vector<long long> iterations(tasks, 0);
+            auto task = [&](int t, int) {
+                int active[LANES_PER_TASK];
+                int count = 0;
+                for (int lane = t * LANES_PER_TASK; lane < std::min((t + 1) * LANES_PER_TASK, n); lane++)
+                {
+                    active[count++] = lane;
+                }
+                for (int iteration = 0; iteration < maxIterations && 0 < count; iteration++)
+                {
+                    int remaining = 0;
+                    for (int j = 0; j < count; j++)
+                    {
+                        int lane = active[j];
+                        State state = step(batch, lane);
+                        batch->iterations[lane]++;
+                        if (state == State::Converged)
+                        {
+                            batch->converged[lane] = 1;
+                        }
+                        else if (state == State::Running)
+                        {
+                            active[remaining++] = lane;
+                        }
+                    }
+                    iterations[t] += count;
+                    count = remaining;
+                }
+            };
+            run(pool, tasks, task);
+
+            long long total = 0;
+            for (long long i : iterations)
+            {
+                total += i;
+            }
+            return total;
+        }
+
+        // Largest constraint component of a lane, or a negative value if a surface reflects it totally
+        float residual(const Batch& batch, int lane) const
+        {
+            float c[MAX_VERTICES][2];
+            if (!constraints(batch, lane, &batch.uv[(size_t)lane * chain.size() * 2], c))
+            {
+                return -1.0f;
+            }
+            return maxAbs(c, (int)chain.size());
+        }
+
+    private:
+        enum class State
+        {
+            Running,
+            Converged,
+            Failed,
+        };
+
+        static float maxAbs(const float (*c)[2], int k)
+        {
+            float m = 0.0f;
+            for (int i = 0; i < k; i++)
+            {
+                m = std::max(m, std::max(std::fabs(c[i][0]), std::fabs(c[i][1])));
+            }
+            return m;
+        }
+
+        // the endpoints for i = -1 and i = k, otherwise the point of surface i at (x, y)
+        template <class Real, class Real3>
+        Real3 vertex(const Batch& batch, int lane, int i, Real x, Real y) const
+        {
+            int k = (int)chain.size();
+            if (i < 0)
+            {
+                const float* s = &batch.start[lane * 3];
+                return { s[0], s[1], s[2] };
+            }
+            if (k <= i)
+            {
+                const float* e = &batch.end[lane * 3];
+                return { e[0], e[1], e[2] };
+            }
+            Real3 n;
+            return details::surface_point(chain[i], x, y, &n);
+        }
+        dval3 vertex(const Batch& batch, int lane, const float* uv, int i) const
+        {
+            int k = (int)chain.size();
+            if (i < 0 || k <= i)
+            {
+                return vertex<dval, dval3>(batch, lane, i, 0.0f, 0.0f);
+            }
+            return vertex<dval, dval3>(batch, lane, i, uv[i * 2], uv[i * 2 + 1]);
+        }
+
+        bool constraints(const Batch& batch, int lane, const float* uv, float (*c)[2]) const
+        {
+            for (int i = 0; i < (int)chain.size(); i++)
+            {
+                dval ci[2];
+                if (!details::specular_constraint(chain[i], vertex(batch, lane, uv, i - 1), dval(uv[i * 2]), dval(uv[i * 2 + 1]), vertex(batch, lane, uv, i + 1), ci))
+                {
+                    return false;
+                }
+                c[i][0] = ci[0].v;
+                c[i][1] = ci[1].v;
+            }
+            return true;
+        }
+
+        State step(Batch* batch, int lane) const
+        {
+            int k = (int)chain.size();
+            float* uv = &batch->uv[(size_t)lane * k * 2];
+
+            // One pass per vertex with the coordinates of the previous vertex, the vertex and the next one
+            // on the six tangent lanes, giving its three blocks. Endpoints are not seeded, their blocks come out zero.
+            Block2 lower[MAX_VERTICES], diagonal[MAX_VERTICES], upper[MAX_VERTICES];
+            float c[MAX_VERTICES][2];
+            for (int i = 0; i < k; i++)
+            {
+                typedef dvaln<6> real;
+                typedef dvaln3<6> real3;
+                real xs[3], ys[3];
+                for (int neighbour = 0; neighbour < 3; neighbour++)
+                {
+                    int v = i - 1 + neighbour;
+                    if (v < 0 || k <= v)
+                    {
+                        continue;
+                    }
+                    xs[neighbour] = uv[v * 2];
+                    ys[neighbour] = uv[v * 2 + 1];
+                    xs[neighbour].requires_grad(neighbour * 2);
+                    ys[neighbour].requires_grad(neighbour * 2 + 1);
+                }
+                real3 prev = vertex<real, real3>(*batch, lane, i - 1, xs[0], ys[0]);
+                real3 next = vertex<real, real3>(*batch, lane, i + 1, xs[2], ys[2]);
+                real ci[2];
+                if (!details::specular_constraint(chain[i], prev, xs[1], ys[1], next, ci))
+                {
+                    return State::Failed;
+                }
+                c[i][0] = ci[0].v;
+                c[i][1] = ci[1].v;
+                Block2* blocks[3] = { &lower[i], &diagonal[i], &upper[i] };
+                for (int neighbour = 0; neighbour < 3; neighbour++)
+                {
+                    *blocks[neighbour] = { {
+                        ci[0].g[neighbour * 2], ci[0].g[neighbour * 2 + 1],
+                        ci[1].g[neighbour * 2], ci[1].g[neighbour * 2 + 1]
+                    } };
+                }
+            }
+
+            float current = maxAbs(c, k);
+            if (current < tolerance)
+            {
+                return State::Converged;
+            }
+
+            float rhs[MAX_VERTICES][2];
+            float delta[MAX_VERTICES][2];
+            for (int i = 0; i < k; i++)
+            {
+                rhs[i][0] = -c[i][0];
+                rhs[i][1] = -c[i][1];
+            }
+            if (!details::solve_block_tridiagonal(k, lower, diagonal, upper, rhs, delta))
+            {
+                return State::Failed;
+            }
+
+            // halve the step until the constraint decreases
+            float trial[MAX_VERTICES * 2];
+            float scale = 1.0f;
+            for (int h = 0; h <= maxHalvings; h++, scale *= 0.5f)
+            {
+                for (int i = 0; i < k; i++)
+                {
+                    trial[i * 2] = uv[i * 2] + delta[i][0] * scale;
+                    trial[i * 2 + 1] = uv[i * 2 + 1] + delta[i][1] * scale;
+                }
+                float ct[MAX_VERTICES][2];
+                if (!constraints(*batch, lane, trial, ct))
+                {
+                    continue;
+                }
+                float next = maxAbs(ct, k);
+                if (next < current)
+                {
+                    std::copy(trial, trial + k * 2, uv);
+                    return next < tolerance ? State::Converged : State::Running;
+                }
+            }
+            return State::Failed;
+        }
+    };
+}
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include "saka.h"
+#include "saka_backward.h"
+
+namespace saka
+{
+    // The loss at x, with its gradient written to grad. Optimizers only see floats, so any differentiation mode can feed them.
+    using Objective = std::function<float(const float* x, float* grad)>;
+
+    // loss(const dval* x) -> dval. Forward mode carries one tangent, so this evaluates the loss once per parameter:
+    // fine for a handful of parameters, use a reverse mode objective beyond that.
+    template <class F>
+    Objective make_objective_dval(F loss, int n)
+    {
+        std::vector<dval> xs(n);
+        return [loss, xs](const float* x, float* grad) mutable {
+            float value = 0.0f;
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                xs[i] = dval(x[i]);
+            }
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                xs[i].requires_grad();
+                dval y = loss(xs.data());
+                xs[i].g = 0.0f;
+                grad[i] = y.g;
+                value = y.v;
+            }
+            return value;
+        };
+    }
+
+    // loss(const ValRef* x) -> ValRef, one backward() per evaluation
+    template <class F>
+    Objective make_objective_valref(F loss, int n)
+    {
+        std::vector<ValRef> xs(n);
+        return [loss, xs](const float* x, float* grad) mutable {
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                xs[i] = ValRef(x[i]);
+            }
+            ValRef y = loss(xs.data());
+            y.backward();
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                grad[i] = xs[i].derivative();
+            }
+            return y.value();
+        };
+    }
+
+    // loss(const Var* x) -> Var for autodiff::var, one reverse sweep per evaluation like autodiff::gradient without Eigen
+    template <class Var, class F>
+    Objective make_objective_var(F loss, int n)
+    {
+        std::vector<Var> xs(n);
+        std::vector<double> gs(n);
+        return [loss, xs, gs](const float* x, float* grad) mutable {
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                xs[i] = Var(x[i]);
+                gs[i] = 0.0;
+                xs[i].expr->bind_value(&gs[i]);
+            }
+            Var y = loss(xs.data());
+            y.expr->propagate(1.0);
+            for (int i = 0; i < (int)xs.size(); i++)
+            {
+                xs[i].expr->bind_value(nullptr);
+                grad[i] = (float)gs[i];
+            }
+            return (float)val(y);
+        };
+    }
+
+    namespace details
+    {
+        // Single pass, in place updates. Plain loops over restrict pointers so they auto-vectorize.
+        inline void adam_update(float* __restrict x, float* __restrict m, float* __restrict v, const float* __restrict g, int n,
+            float learningRate, float beta1, float beta2, float epsilon, float correction1, float correction2)
+        {
+            float step = learningRate / correction1;
+            float invCorrection2 = 1.0f / correction2;
+            for (int i = 0; i < n; i++)
+            {
+                float mi = beta1 * m[i] + (1.0f - beta1) * g[i];
+                float vi = beta2 * v[i] + (1.0f - beta2) * g[i] * g[i];
+                m[i] = mi;
+                v[i] = vi;
+                x[i] -= step * mi / (std::sqrt(vi * invCorrection2) + epsilon);
+            }
+        }
+        inline void momentum_update(float* __restrict x, float* __restrict velocity, const float* __restrict g, int n,
+            float learningRate, float momentum)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                float vi = momentum * velocity[i] - learningRate * g[i];
+                velocity[i] = vi;
+                x[i] += vi;
+            }
+        }
+        inline float dot(const float* __restrict a, const float* __restrict b, int n)
+        {
+            // double accumulation: L-BFGS curvature pairs lose their sign to rounding with float sums over many parameters
+            double s = 0.0;
+            for (int i = 0; i < n; i++)
+            {
+                s += (double)a[i] * b[i];
+            }
+            return (float)s;
+        }
+        // y += a * x
+        inline void axpy(float* __restrict y, float a, const float* __restrict x, int n)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                y[i] += a * x[i];
+            }
+        }
+        // r = a + t * b
+        inline void add_scaled(float* __restrict r, const float* __restrict a, float t, const float* __restrict b, int n)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                r[i] = a[i] + t * b[i];
+            }
+        }
+    }
+
+    // All optimizers allocate their state in the constructor and never during step().
+
+    struct AdamConfig
+    {
+        float learningRate = 1.0e-2f;
+        float beta1 = 0.9f;
+        float beta2 = 0.999f;
+        float epsilon = 1.0e-8f;
+    };
+
+    class Adam
+    {
+    public:
+        Adam(int n, AdamConfig config = AdamConfig()) : m_config(config), m_m(n), m_v(n), m_g(n) {}
+
+        // Evaluates f at x, updates x in place and returns the loss before the update.
+        float step(float* x, const Objective& f)
+        {
+            int n = (int)m_g.size();
+            float loss = f(x, m_g.data());
+            m_t++;
+            float correction1 = 1.0f - std::pow(m_config.beta1, (float)m_t);
+            float correction2 = 1.0f - std::pow(m_config.beta2, (float)m_t);
+            details::adam_update(x, m_m.data(), m_v.data(), m_g.data(), n,
+                m_config.learningRate, m_config.beta1, m_config.beta2, m_config.epsilon, correction1, correction2);
+            return loss;
+        }
+        void reset()
+        {
+            std::fill(m_m.begin(), m_m.end(), 0.0f);
+            std::fill(m_v.begin(), m_v.end(), 0.0f);
+            m_t = 0;
+        }
+        const std::vector<float>& gradient() const { return m_g; }
+
+    private:
+        AdamConfig m_config;
+        std::vector<float> m_m;
+        std::vector<float> m_v;
+        std::vector<float> m_g;
+        int m_t = 0;
+    };
+
+    struct SGDMomentumConfig
+    {
+        float learningRate = 1.0e-2f;
+        float momentum = 0.9f;
+    };
+
+    class SGDMomentum
+    {
+    public:
+        SGDMomentum(int n, SGDMomentumConfig config = SGDMomentumConfig()) : m_config(config), m_velocity(n), m_g(n) {}
+
+        // Evaluates f at x, updates x in place and returns the loss before the update.
+        float step(float* x, const Objective& f)
+        {
+            float loss = f(x, m_g.data());
+            details::momentum_update(x, m_velocity.data(), m_g.data(), (int)m_g.size(), m_config.learningRate, m_config.momentum);
+            return loss;
+        }
+        void reset()
+        {
+            std::fill(m_velocity.begin(), m_velocity.end(), 0.0f);
+        }
+        const std::vector<float>& gradient() const { return m_g; }
+
+    private:
+        SGDMomentumConfig m_config;
+        std::vector<float> m_velocity;
+        std::vector<float> m_g;
+    };
+
+    struct LBFGSConfig
+    {
+        int history = 8;
+        float c1 = 1.0e-4f;        // sufficient decrease
+        float shrink = 0.5f;       // step scale per rejected trial
+        int maxLineSearch = 20;
+    };
+
+    // Limited memory BFGS with a backtracking Armijo line search.
+    // Every trial point of the line search is evaluated with its gradient, so the accepted one hands its gradient
+    // straight to the next iteration: an iteration costs as many evaluations as line search trials, usually one.
+    // x must not be changed between steps from outside, call reset() if it is.
+    class LBFGS
+    {
+    public:
+        LBFGS(int n, LBFGSConfig config = LBFGSConfig())
+            : m_config(config), m_n(n),
+            m_g(n), m_d(n), m_xTrial(n), m_gTrial(n),
+            m_s(config.history * n), m_y(config.history * n), m_rho(config.history), m_alpha(config.history)
+        {
+        }
+
+        // Moves x along the quasi-Newton direction and returns the loss at the new x.
+        // Returns the loss at x unchanged if no step decreases it, which is the case at a minimum.
+        float step(float* x, const Objective& f)
+        {
+            int n = m_n;
+            if (!m_hasGradient)
+            {
+                m_loss = f(x, m_g.data());
+                m_hasGradient = true;
+            }
+
+            direction();
+            float slope = details::dot(m_g.data(), m_d.data(), n);
+            if (0.0f <= slope)
+            {
+                // not a descent direction, the curvature pairs are stale
+                m_count = 0;
+                direction();
+                slope = details::dot(m_g.data(), m_d.data(), n);
+            }
+            if (0.0f <= slope)
+            {
+                return m_loss; // zero gradient
+            }
+
+            // without history the direction is the raw gradient, so make the first trial a unit length step
+            float t = m_count == 0 ? 1.0f / std::sqrt(-slope) : 1.0f;
+            for (int trial = 0; trial < m_config.maxLineSearch; trial++)
+            {
+                details::add_scaled(m_xTrial.data(), x, t, m_d.data(), n);
+                float loss = f(m_xTrial.data(), m_gTrial.data());
+                if (loss <= m_loss + m_config.c1 * t * slope)
+                {
+                    accept(x, loss);
+                    return m_loss;
+                }
+                t *= m_config.shrink;
+            }
+            m_count = 0;
+            return m_loss;
+        }
+        void reset()
+        {
+            m_count = 0;
+            m_hasGradient = false;
+        }
+        const std::vector<float>& gradient() const { return m_g; }
+
+    private:
+        // m_d = -H g by the two loop recursion over the stored pairs
+        void direction()
+        {
+            int n = m_n;
+            for (int i = 0; i < n; i++)
+            {
+                m_d[i] = -m_g[i];
+            }
+            for (int k = 0; k < m_count; k++)
+            {
+                int j = slot(m_count - 1 - k);
+                m_alpha[j] = m_rho[j] * details::dot(&m_s[j * n], m_d.data(), n);
+                details::axpy(m_d.data(), -m_alpha[j], &m_y[j * n], n);
+            }
+            if (0 < m_count)
+            {
+                int j = slot(m_count - 1);
+                const float* y = &m_y[j * n];
+                float gamma = 1.0f / (m_rho[j] * details::dot(y, y, n));
+                for (int i = 0; i < n; i++)
+                {
+                    m_d[i] *= gamma;
+                }
+            }
+            for (int k = 0; k < m_count; k++)
+            {
+                int j = slot(k);
+                float beta = m_rho[j] * details::dot(&m_y[j * n], m_d.data(), n);
+                details::axpy(m_d.data(), m_alpha[j] - beta, &m_s[j * n], n);
+            }
+        }
+
+        void accept(float* x, float loss)
+        {
+            int n = m_n;
+            int history = m_config.history;
+            double sy = 0.0;
+            for (int i = 0; i < n; i++)
+            {
+                sy += (double)(m_xTrial[i] - x[i]) * (m_gTrial[i] - m_g[i]);
+            }
+
+            // a pair without positive curvature would break the positive definiteness of H, skip it
+            if (0.0 < sy)
+            {
+                int j = (m_head + m_count) % history;
+                float* s = &m_s[j * n];
+                float* y = &m_y[j * n];
+                for (int i = 0; i < n; i++)
+                {
+                    s[i] = m_xTrial[i] - x[i];
+                    y[i] = m_gTrial[i] - m_g[i];
+                }
+                m_rho[j] = (float)(1.0 / sy);
+                if (m_count < history)
+                {
+                    m_count++;
+                }
+                else
+                {
+                    m_head = (m_head + 1) % history;
+                }
+            }
+            std::copy(m_xTrial.begin(), m_xTrial.end(), x);
+            std::swap(m_g, m_gTrial);
+            m_loss = loss;
+        }
+
+        // k-th oldest stored pair
+        int slot(int k) const
+        {
+            return (m_head + k) % m_config.history;
+        }
+
+        LBFGSConfig m_config;
+        int m_n;
+        std::vector<float> m_g;
+        std::vector<float> m_d;
+        std::vector<float> m_xTrial;
+        std::vector<float> m_gTrial;
+        std::vector<float> m_s; // history x n, a ring starting at m_head
+        std::vector<float> m_y;
+        std::vector<float> m_rho;
+        std::vector<float> m_alpha;
+        int m_head = 0;
+        int m_count = 0;
+        float m_loss = 0.0f;
+        bool m_hasGradient = false;
+    };
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace saka
+{
+    // Runs batches of independent tasks on a fixed set of threads.
+    // Each worker owns a deque, pops its own tasks from the back and steals from the front of the others when it runs dry,
+    // so uneven tiles (background vs. the box) still keep every core busy until the batch is drained.
+    class WorkStealingPool
+    {
+    public:
+        explicit WorkStealingPool(int nThreads = 0)
+        {
+            if (nThreads <= 0)
+            {
+                nThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+            }
+            m_queues = std::vector<Queue>(nThreads);
+            for (int i = 0; i < nThreads; i++)
+            {
+                m_threads.emplace_back([this, i]() { worker(i); });
+            }
+        }
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+            }
+            m_wake.notify_all();
+            for (std::thread& t : m_threads)
+            {
+                t.join();
+            }
+        }
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        int threadCount() const { return (int)m_threads.size(); }
+
+        // Calls task(i) for every i in [0, count) and blocks until all of them are done. task gets the worker index too.
+        // Not reentrant: one batch at a time.
+        void run(int count, const std::function<void(int i, int worker)>& task)
+        {
+            if (count <= 0)
+            {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_task = &task;
+            m_remaining = count;
+            m_batch++;
+
+            // deal the tasks round-robin, so neighbouring tiles start on different threads
+            for (int i = 0; i < count; i++)
+            {
+                Queue& q = m_queues[i % m_queues.size()];
+                std::lock_guard<std::mutex> queueLock(q.mutex);
+                q.tasks.push_back({ m_batch, i });
+            }
+            m_wake.notify_all();
+            m_done.wait(lock, [this]() { return m_remaining == 0; });
+            m_task = nullptr;
+        }
+
+    private:
+        struct Entry
+        {
+            uint64_t batch;
+            int index;
+        };
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<Entry> tasks;
+        };
+
+        // Entries of a later batch are left alone: a worker that woke up late must not run them with the task of its batch.
+        bool pop(int self, uint64_t batch, int* task)
+        {
+            {
+                Queue& q = m_queues[self];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (!q.tasks.empty() && q.tasks.back().batch == batch)
+                {
+                    *task = q.tasks.back().index;
+                    q.tasks.pop_back();
+                    return true;
+                }
+            }
+            for (int k = 1; k < (int)m_queues.size(); k++)
+            {
+                Queue& q = m_queues[(self + k) % m_queues.size()];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (!q.tasks.empty() && q.tasks.front().batch == batch)
+                {
+                    *task = q.tasks.front().index;
+                    q.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker(int self)
+        {
+            uint64_t seen = 0;
+            for (;;)
+            {
+                const std::function<void(int, int)>* task;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [&]() { return m_quit || seen != m_batch; });
+                    if (m_quit)
+                    {
+                        return;
+                    }
+                    seen = m_batch;
+                    task = m_task;
+                }
+
+                int i;
+                int finished = 0;
+                while (pop(self, seen, &i))
+                {
+                    (*task)(i, self);
+                    finished++;
+                }
+
+                if (finished)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_remaining -= finished;
+                    if (m_remaining == 0)
+                    {
+                        m_done.notify_all();
+                    }
+                }
+            }
+        }
+
+        std::vector<Queue> m_queues;
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        const std::function<void(int, int)>* m_task = nullptr;
+        int m_remaining = 0;
+        uint64_t m_batch = 0;
+        bool m_quit = false;
+    };
+
+    // pool->run(count, task), or the tasks in order on the calling thread as worker 0 without a pool.
+    // A single task runs on the calling thread too, sparing the hand-off to a worker.
+    template <class F>
+    inline void run(WorkStealingPool* pool, int count, F task)
+    {
+        if (pool && 1 < count)
+        {
+            pool->run(count, task);
+        }
+        else
+        {
+            for (int i = 0; i < count; i++)
+            {
+                task(i, 0);
+            }
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include "saka_pool.h"
+
+namespace saka
+{
+    // Stable LSD radix sort of 32-bit keys, a digit of 8 bits per pass, in parallel on a WorkStealingPool.
+    // It sorts indices along with the keys, so the result is a permutation to apply to any number of SoA arrays.
+    // Every pass is a per chunk histogram, a scan in bucket major, chunk minor order and a scatter of each chunk in order.
+    // Passes over a digit that is the same for all keys are skipped.
+    class RadixSort
+    {
+    public:
+        enum
+        {
+            DIGIT_BITS = 8,
+            BUCKETS = 1 << DIGIT_BITS,
+            PASSES = 32 / DIGIT_BITS,
+            CHUNK = 4096, // keys per pool task
+        };
+
+        RadixSort() {}
+        explicit RadixSort(int capacity) { reserve(capacity); }
+
+        // allocates for up to n keys, so sort() does not allocate
+        void reserve(int n)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if ((int)m_keys[i].size() < n)
+                {
+                    m_keys[i].resize(n);
+                    m_order[i].resize(n);
+                }
+            }
+            int chunks = chunkCount(n);
+            if ((int)m_histograms.size() < chunks * BUCKETS)
+            {
+                m_histograms.resize((size_t)chunks * BUCKETS);
+            }
+        }
+
+        // After the call order()[i] is the index of the i-th smallest key, equal keys keep their order
+        void sort(const uint32_t* keys, int n, WorkStealingPool* pool = nullptr)
+        {
+            reserve(n);
+            m_count = n;
+            m_current = 0;
+            m_passes = 0;
+            int chunks = chunkCount(n);
+            run(pool, chunks, [&](int c, int) {
+                for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, n); i++)
+                {
+                    m_keys[0][i] = keys[i];
+                    m_order[0][i] = (uint32_t)i;
+                }
+            });
+
+            for (int pass = 0; pass < PASSES; pass++)
+            {
+                int shift = pass * DIGIT_BITS;
+                const uint32_t* keysIn = m_keys[m_current].data();
+                const uint32_t* orderIn = m_order[m_current].data();
+                uint32_t* keysOut = m_keys[1 - m_current].data();
+                uint32_t* orderOut = m_order[1 - m_current].data();
+
+                run(pool, chunks, [&](int c, int) {
+                    int* histogram = &m_histograms[(size_t)c * BUCKETS];
+                    std::fill(histogram, histogram + BUCKETS, 0);
+                    for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, n); i++)
+                    {
+                        histogram[(keysIn[i] >> shift) & (BUCKETS - 1)]++;
+                    }
+                });
+
+                // the histograms become the first output slot of every chunk in every bucket
+                bool trivial = false;
+                int slot = 0;
+                for (int b = 0; b < BUCKETS; b++)
+                {
+                    int bucketBegin = slot;
+                    for (int c = 0; c < chunks; c++)
+                    {
+                        int count = m_histograms[(size_t)c * BUCKETS + b];
+                        m_histograms[(size_t)c * BUCKETS + b] = slot;
+                        slot += count;
+                    }
+                    trivial = trivial || slot - bucketBegin == n;
+                }
+                if (trivial)
+                {
+                    continue;
+                }
+
+                run(pool, chunks, [&](int c, int) {
+                    int* slots = &m_histograms[(size_t)c * BUCKETS];
+                    for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, n); i++)
+                    {
+                        int s = slots[(keysIn[i] >> shift) & (BUCKETS - 1)]++;
+                        keysOut[s] = keysIn[i];
+                        orderOut[s] = orderIn[i];
+                    }
+                });
+                m_current = 1 - m_current;
+                m_passes++;
+            }
+        }
+
+        const uint32_t* order() const { return m_order[m_current].data(); }
+        const uint32_t* sortedKeys() const { return m_keys[m_current].data(); }
+        int size() const { return m_count; }
+
+        // passes the last sort() did not skip
+        int passes() const { return m_passes; }
+
+    private:
+        static int chunkCount(int n) { return (n + CHUNK - 1) / CHUNK; }
+
+        std::vector<uint32_t> m_keys[2];
+        std::vector<uint32_t> m_order[2];
+        std::vector<int> m_histograms; // chunk major, BUCKETS per chunk
+        int m_current = 0;
+        int m_count = 0;
+        int m_passes = 0;
+    };
+}
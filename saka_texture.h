@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <assert.h>
+#include <stdint.h>
+#include "saka.h"
+#include "saka_grad_buffer.h"
+#include "saka_pool.h"
+
+namespace saka
+{
+    enum class TextureWrap
+    {
+        Repeat,
+        Clamp,
+    };
+
+    // RGB float texture stored in 8x8 texel tiles, Morton order inside a tile and tiles in row major order.
+    // A tile is 768 bytes, and 49 of the 64 bilinear footprints starting in a tile stay inside it.
+    // data() holds the texels in this layout, which is also the layout of texel gradients, so an optimizer can step data() directly.
+    class Texture
+    {
+    public:
+        enum
+        {
+            TILE_BITS = 3,
+            TILE_SIZE = 1 << TILE_BITS,
+            TILE_TEXELS = TILE_SIZE * TILE_SIZE,
+            CHANNELS = 3,
+        };
+
+        Texture() {}
+        Texture(int width, int height, TextureWrap wrap = TextureWrap::Repeat)
+            : m_width(width), m_height(height), m_wrap(wrap)
+        {
+            m_tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+            int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+            m_texels.resize((size_t)m_tilesX * tilesY * TILE_TEXELS * CHANNELS);
+        }
+
+        int width() const { return m_width; }
+        int height() const { return m_height; }
+        TextureWrap wrap() const { return m_wrap; }
+
+        // floats in data(), including the padding of partial tiles
+        int size() const { return (int)m_texels.size(); }
+        float* data() { return m_texels.data(); }
+        const float* data() const { return m_texels.data(); }
+
+        // index in data() of the red channel of texel (x, y)
+        int offset(int x, int y) const
+        {
+            int tile = (y >> TILE_BITS) * m_tilesX + (x >> TILE_BITS);
+            return (tile * TILE_TEXELS + morton(x & (TILE_SIZE - 1), y & (TILE_SIZE - 1))) * CHANNELS;
+        }
+        const float* texel(int x, int y) const { return &m_texels[offset(x, y)]; }
+        void set(int x, int y, float r, float g, float b)
+        {
+            float* p = &m_texels[offset(x, y)];
+            p[0] = r;
+            p[1] = g;
+            p[2] = b;
+        }
+
+        // conversions from and to row major rgb, e.g. for images or for the reduced texel gradient
+        void fromLinear(const float* rgb)
+        {
+            for (int y = 0; y < m_height; y++)
+            {
+                for (int x = 0; x < m_width; x++)
+                {
+                    const float* p = rgb + ((size_t)y * m_width + x) * CHANNELS;
+                    set(x, y, p[0], p[1], p[2]);
+                }
+            }
+        }
+        void toLinear(float* rgb) const { toLinear(m_texels.data(), rgb); }
+        void toLinear(const float* tiled, float* rgb) const
+        {
+            for (int y = 0; y < m_height; y++)
+            {
+                for (int x = 0; x < m_width; x++)
+                {
+                    const float* p = tiled + offset(x, y);
+                    std::copy(p, p + CHANNELS, rgb + ((size_t)y * m_width + x) * CHANNELS);
+                }
+            }
+        }
+
+        // texel index along one axis after the wrap mode
+        int wrapX(int x) const { return wrapIndex(x, m_width); }
+        int wrapY(int y) const { return wrapIndex(y, m_height); }
+
+    private:
+        static int morton(int x, int y)
+        {
+            // spread the three bits of each coordinate to the even and the odd bits
+            x = (x | (x << 2)) & 0x33;
+            x = (x | (x << 1)) & 0x55;
+            y = (y | (y << 2)) & 0x33;
+            y = (y | (y << 1)) & 0x55;
+            return x | (y << 1);
+        }
+        int wrapIndex(int i, int n) const
+        {
+            if (m_wrap == TextureWrap::Clamp)
+            {
+                return std::min(std::max(i, 0), n - 1);
+            }
+            i %= n;
+            return i < 0 ? i + n : i;
+        }
+
+        int m_width = 0;
+        int m_height = 0;
+        int m_tilesX = 0;
+        TextureWrap m_wrap = TextureWrap::Repeat;
+        std::vector<float> m_texels;
+    };
+
+    // The four texels read by a bilinear lookup. The derivative of the color with respect to channel c of texel i
+    // is weight[i] in channel c and zero in the other channels.
+    struct TextureFootprint
+    {
+        int offset[4]; // into Texture::data(), in the order (x0, y0), (x1, y0), (x0, y1), (x1, y1)
+        float weight[4];
+        float fx;      // fractional position between the texel centers
+        float fy;
+    };
+
+    // Bilinear footprint at (u, v), where texel (x, y) has its center at ((x + 0.5) / width, (y + 0.5) / height)
+    inline TextureFootprint texture_footprint(const Texture& tex, float u, float v)
+    {
+        float x = u * tex.width() - 0.5f;
+        float y = v * tex.height() - 0.5f;
+        float xf = std::floor(x);
+        float yf = std::floor(y);
+        int x0 = (int)xf;
+        int y0 = (int)yf;
+        TextureFootprint f;
+        f.fx = x - xf;
+        f.fy = y - yf;
+        int xa = tex.wrapX(x0), xb = tex.wrapX(x0 + 1);
+        int ya = tex.wrapY(y0), yb = tex.wrapY(y0 + 1);
+        f.offset[0] = tex.offset(xa, ya);
+        f.offset[1] = tex.offset(xb, ya);
+        f.offset[2] = tex.offset(xa, yb);
+        f.offset[3] = tex.offset(xb, yb);
+        f.weight[0] = (1.0f - f.fx) * (1.0f - f.fy);
+        f.weight[1] = f.fx * (1.0f - f.fy);
+        f.weight[2] = (1.0f - f.fx) * f.fy;
+        f.weight[3] = f.fx * f.fy;
+        return f;
+    }
+
+    namespace details
+    {
+        // color and its derivatives along the texel axes, from the four texels of a footprint
+        inline void bilinear(const float* texels, const TextureFootprint& f, float color[3], float dcdx[3], float dcdy[3])
+        {
+            const float* t00 = texels + f.offset[0];
+            const float* t10 = texels + f.offset[1];
+            const float* t01 = texels + f.offset[2];
+            const float* t11 = texels + f.offset[3];
+            for (int c = 0; c < 3; c++)
+            {
+                float bottom = t00[c] + (t10[c] - t00[c]) * f.fx;
+                float top = t01[c] + (t11[c] - t01[c]) * f.fx;
+                color[c] = bottom + (top - bottom) * f.fy;
+                dcdx[c] = (t10[c] - t00[c]) * (1.0f - f.fy) + (t11[c] - t01[c]) * f.fy;
+                dcdy[c] = top - bottom;
+            }
+        }
+
+        inline dval3 sample(const Texture& tex, const TextureFootprint& f, dval u, dval v)
+        {
+            float color[3], dcdx[3], dcdy[3];
+            bilinear(tex.data(), f, color, dcdx, dcdy);
+            float du = u.g * tex.width();
+            float dv = v.g * tex.height();
+            dval3 r;
+            r.x.v = color[0]; r.x.g = dcdx[0] * du + dcdy[0] * dv;
+            r.y.v = color[1]; r.y.g = dcdx[1] * du + dcdy[1] * dv;
+            r.z.v = color[2]; r.z.g = dcdx[2] * du + dcdy[2] * dv;
+            return r;
+        }
+    }
+
+    // Bilinear lookup. The tangent is the derivative along the tangents of u and v; the derivative is piecewise,
+    // it jumps where the footprint moves to the next texel. Texel derivatives are those of texture_footprint().
+    inline dval3 sample(const Texture& tex, dval u, dval v)
+    {
+        return details::sample(tex, texture_footprint(tex, u.v, v.v), u, v);
+    }
+
+    // The same lookup, with texelTangent (same size and layout as tex) as the tangent of the texels,
+    // so the result carries the derivative along texelTangent plus the one along the tangents of u and v.
+    inline dval3 sample(const Texture& tex, const Texture& texelTangent, dval u, dval v)
+    {
+        TextureFootprint f = texture_footprint(tex, u.v, v.v);
+        dval3 r = details::sample(tex, f, u, v);
+        float t[3], unused[6];
+        details::bilinear(texelTangent.data(), f, t, unused, unused + 3);
+        r.x.g += t[0];
+        r.y.g += t[1];
+        r.z.g += t[2];
+        return r;
+    }
+
+    // Reverse mode of sample(): adds adjoint^T dcolor/dtexel to the texels' gradients in the given shard
+    // and returns adjoint^T dcolor/du and dcolor/dv in du and dv when they are not null.
+    // texelGradients indexes like Texture::data(), so it needs Texture::size() entries.
+    inline void sample_backward(const Texture& tex, float u, float v, const float adjoint[3], grad_buffer* texelGradients, int shard,
+        float* du = nullptr, float* dv = nullptr)
+    {
+        TextureFootprint f = texture_footprint(tex, u, v);
+        if (texelGradients)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    texelGradients->add(shard, f.offset[i] + c, f.weight[i] * adjoint[c]);
+                }
+            }
+        }
+        if (du || dv)
+        {
+            float color[3], dcdx[3], dcdy[3];
+            details::bilinear(tex.data(), f, color, dcdx, dcdy);
+            if (du)
+            {
+                *du = (adjoint[0] * dcdx[0] + adjoint[1] * dcdx[1] + adjoint[2] * dcdx[2]) * tex.width();
+            }
+            if (dv)
+            {
+                *dv = (adjoint[0] * dcdy[0] + adjoint[1] * dcdy[1] + adjoint[2] * dcdy[2]) * tex.height();
+            }
+        }
+    }
+
+    // sample_backward() for count lookups, adjoints are rgb interleaved. Lookups run in parallel on the pool,
+    // each worker scattering into its own shard, then the shards are reduced into texelGradient (Texture::size() floats).
+    // du and dv may be null.
+    inline void sample_backward(const Texture& tex, const float* u, const float* v, const float* adjoints, int count,
+        grad_buffer* shards, float* texelGradient, float* du, float* dv, WorkStealingPool* pool = nullptr)
+    {
+        const int lookupsPerTask = 1024;
+        int tasks = (count + lookupsPerTask - 1) / lookupsPerTask;
+        // workers index the shards
+        assert(shards->shardCount() >= (pool ? pool->threadCount() : 1));
+        shards->clear(pool);
+        auto task = [&](int t, int worker) {
+            for (int i = t * lookupsPerTask; i < std::min((t + 1) * lookupsPerTask, count); i++)
+            {
+                sample_backward(tex, u[i], v[i], adjoints + (size_t)i * 3, shards, worker, du ? du + i : nullptr, dv ? dv + i : nullptr);
+            }
+        };
+        run(pool, tasks, task);
+        shards->reduce(texelGradient, pool);
+    }
+}
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "saka.h"
+#include "saka_bsdf.h"
+#include "saka_bvh.h"
+#include "saka_pool.h"
+
+namespace saka
+{
+    struct TracerCamera
+    {
+        float origin[3] = { 0.0f, -4.0f, 1.0f };
+        float lookat[3] = { 0.0f, 0.0f, 1.0f };
+        float up[3] = { 0.0f, 0.0f, 1.0f };
+        float fovy = 0.785398f; // radians, vertical
+
+        bool operator==(const TracerCamera& rhs) const
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                if (origin[i] != rhs.origin[i] || lookat[i] != rhs.lookat[i] || up[i] != rhs.up[i])
+                {
+                    return false;
+                }
+            }
+            return fovy == rhs.fovy;
+        }
+        bool operator!=(const TracerCamera& rhs) const { return !(*this == rhs); }
+    };
+
+    // The scene parameter the tangent image is taken with respect to
+    enum class TracerParameter
+    {
+        BoxOffset,   // x translation of the box
+        LightHeight, // z of the point light
+    };
+
+    // A Cornell box with a z-up room of [-1, 1] x [-1, 1] x [0, 2], open towards -y, a box and a point light.
+    // The parameter is the only dval with a tangent, so every pixel carries d(radiance)/d(parameter).
+    // The box is lambertian, or smooth glass with glassBox.
+    struct TracerScene
+    {
+        TracerScene(TracerParameter parameter, float value, bool glassBox = false)
+        {
+            dval p(value, true);
+            dval boxOffset = parameter == TracerParameter::BoxOffset ? p : dval(0.0f);
+            dval lightHeight = parameter == TracerParameter::LightHeight ? p : dval(1.8f);
+
+            const float white[3] = { 0.75f, 0.75f, 0.75f };
+            const float red[3] = { 0.65f, 0.06f, 0.05f };
+            const float green[3] = { 0.12f, 0.45f, 0.15f };
+            quad({ -1, -1, 0 }, { 1, -1, 0 }, { 1, 1, 0 }, { -1, 1, 0 }, white); // floor
+            quad({ -1, -1, 2 }, { -1, 1, 2 }, { 1, 1, 2 }, { 1, -1, 2 }, white); // ceiling
+            quad({ -1, 1, 0 }, { 1, 1, 0 }, { 1, 1, 2 }, { -1, 1, 2 }, white);   // back
+            quad({ -1, -1, 0 }, { -1, 1, 0 }, { -1, 1, 2 }, { -1, -1, 2 }, red); // left
+            quad({ 1, -1, 0 }, { 1, -1, 2 }, { 1, 1, 2 }, { 1, 1, 0 }, green);   // right
+
+            // a box of 0.6 x 0.6 x 1.2 slightly rotated around z, standing on the floor without a bottom face.
+            // The faces are wound to have their normals outside, which glass relies on.
+            const float c = 0.9553f, s = 0.2955f, h = 0.3f;
+            const float boxIor = glassBox ? 1.5f : 0.0f;
+            dval3 corners[8];
+            for (int i = 0; i < 8; i++)
+            {
+                float lx = (i & 1) ? h : -h;
+                float ly = (i & 2) ? h : -h;
+                corners[i] = {
+                    c * lx - s * ly + boxOffset,
+                    s * lx + c * ly + 0.2f,
+                    (i & 4) ? 1.2f : 0.0f
+                };
+            }
+            quad(corners[4], corners[5], corners[7], corners[6], white, boxIor); // top
+            quad(corners[0], corners[1], corners[5], corners[4], white, boxIor);
+            quad(corners[1], corners[3], corners[7], corners[5], white, boxIor);
+            quad(corners[3], corners[2], corners[6], corners[7], white, boxIor);
+            quad(corners[2], corners[0], corners[4], corners[6], white, boxIor);
+
+            light = { 0.0f, 0.0f, lightHeight };
+            bvh.build(triangles());
+        }
+
+        dtriangles triangles() const
+        {
+            int count = (int)albedo.size() / 3;
+            return {
+                xs[0].data(), xs[1].data(), xs[2].data(),
+                xs[3].data(), xs[4].data(), xs[5].data(),
+                xs[6].data(), xs[7].data(), xs[8].data(),
+                count
+            };
+        }
+
+        std::vector<dval> xs[9]; // x0, y0, z0, x1, ... z2
+        std::vector<float> albedo; // rgb per triangle
+        std::vector<float> ior;    // per triangle, 0 for a lambertian surface
+        BVH bvh;
+        dval3 light;
+        float lightIntensity = 4.0f;
+
+    private:
+        void triangle(dval3 a, dval3 b, dval3 c, const float rgb[3], float eta)
+        {
+            dval3 vs[3] = { a, b, c };
+            for (int i = 0; i < 3; i++)
+            {
+                xs[i * 3 + 0].push_back(vs[i].x);
+                xs[i * 3 + 1].push_back(vs[i].y);
+                xs[i * 3 + 2].push_back(vs[i].z);
+            }
+            albedo.insert(albedo.end(), rgb, rgb + 3);
+            ior.push_back(eta);
+        }
+        void quad(dval3 a, dval3 b, dval3 c, dval3 d, const float rgb[3], float eta = 0.0f)
+        {
+            triangle(a, b, c, rgb, eta);
+            triangle(a, c, d, rgb, eta);
+        }
+    };
+
+    namespace details
+    {
+        // pcg32 with the stream fixed, enough for path sampling
+        struct TracerRandom
+        {
+            uint64_t state;
+
+            explicit TracerRandom(uint64_t seed) : state(seed * 6364136223846793005ULL + 1442695040888963407ULL) { next(); }
+
+            // continues a stream from a stored state
+            static TracerRandom resume(uint64_t state)
+            {
+                TracerRandom r(0);
+                r.state = state;
+                return r;
+            }
+            uint32_t next()
+            {
+                uint64_t old = state;
+                state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint32_t shifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+                uint32_t rot = (uint32_t)(old >> 59u);
+                return (shifted >> rot) | (shifted << ((~rot + 1u) & 31));
+            }
+            float uniform()
+            {
+                return (next() >> 8) * (1.0f / 16777216.0f);
+            }
+        };
+    }
+
+    namespace details
+    {
+        const float TRACER_EPSILON = 1.0e-4f;
+
+        // The hit point and the normal of triangle i facing the ray. entering is true if the ray is on the side
+        // the triangle's winding makes its normal point to.
+        inline void tracer_surface(const dtriangles& tris, int i, dval3 ro, dval3 rd, dhit hit, dval3* p, dval3* n, bool* entering)
+        {
+            *p = ro + rd * hit.t;
+            dval3 v0 = { tris.x0[i], tris.y0[i], tris.z0[i] };
+            dval3 v1 = { tris.x1[i], tris.y1[i], tris.z1[i] };
+            dval3 v2 = { tris.x2[i], tris.y2[i], tris.z2[i] };
+            *n = normalize(cross(v1 - v0, v2 - v0));
+            *entering = dot(*n, rd).v <= 0.0f;
+            if (!*entering)
+            {
+                *n = -*n;
+            }
+        }
+
+        // A lambertian bounce at the hit of triangle i: adds next event estimation towards the point light
+        // to radiance and moves ro, rd and throughput to the next segment of the path.
+        inline void tracer_diffuse(const TracerScene& scene, const dtriangles& tris, int i, dhit hit, TracerRandom* random,
+            dval3* ro, dval3* rd, dval3* throughput, dval3* radiance)
+        {
+            const float pi = 3.14159265f;
+            dval3 p, n;
+            bool entering;
+            tracer_surface(tris, i, *ro, *rd, hit, &p, &n, &entering);
+            dval3 albedo = { scene.albedo[i * 3], scene.albedo[i * 3 + 1], scene.albedo[i * 3 + 2] };
+            *throughput = *throughput * albedo;
+            dval3 origin = p + n * TRACER_EPSILON;
+
+            // next event estimation
+            dval3 toLight = scene.light - origin;
+            dval distance2 = dot(toLight, toLight);
+            dval distance = sqrt(distance2);
+            dval3 l = toLight / distance;
+            dval cosTheta = dot(n, l);
+            if (0.0f < cosTheta.v)
+            {
+                float o[3] = { origin.x.v, origin.y.v, origin.z.v };
+                float d[3] = { l.x.v, l.y.v, l.z.v };
+                float tShadow;
+                if (scene.bvh.intersect_primal(o, d, tris, distance.v, &tShadow) < 0)
+                {
+                    *radiance = *radiance + *throughput * (cosTheta * (scene.lightIntensity / pi) / distance2);
+                }
+            }
+
+            // cosine weighted bounce: cos / pdf cancels the 1 / pi of the lambertian
+            float u0 = random->uniform();
+            float u1 = random->uniform();
+            float r = std::sqrt(u0);
+            float phi = 2.0f * pi * u1;
+            float lx = r * std::cos(phi);
+            float ly = r * std::sin(phi);
+            float lz = std::sqrt(std::max(1.0f - u0, 0.0f));
+            dval3 axis = std::fabs(n.x.v) < 0.9f ? dval3{ 1.0f, 0.0f, 0.0f } : dval3{ 0.0f, 1.0f, 0.0f };
+            dval3 t = normalize(cross(axis, n));
+            dval3 b = cross(n, t);
+            *ro = origin;
+            *rd = t * lx + b * ly + n * lz;
+        }
+
+        // A smooth dielectric at the hit of triangle i: reflects with the probability of the Fresnel reflectance and refracts otherwise.
+        // The throughput is weighted by F / F.v or (1 - F) / (1 - F.v), which is 1 but carries the tangent of the chosen event.
+        inline void tracer_dielectric(const TracerScene& scene, const dtriangles& tris, int i, dhit hit, TracerRandom* random,
+            dval3* ro, dval3* rd, dval3* throughput)
+        {
+            dval3 p, n;
+            bool entering;
+            tracer_surface(tris, i, *ro, *rd, hit, &p, &n, &entering);
+            dval3 wi = -*rd;
+            float eta = entering ? scene.ior[i] : 1.0f / scene.ior[i];
+            dval F = fresnel_dielectric(dot(n, wi), eta);
+            if (random->uniform() < F.v)
+            {
+                *throughput = *throughput * (F / F.v);
+                *ro = p + n * TRACER_EPSILON;
+                *rd = reflection(wi, n);
+                return;
+            }
+            bool tir;
+            *throughput = *throughput * ((1.0f - F) / (1.0f - F.v));
+            *ro = p - n * TRACER_EPSILON;
+            *rd = normalize(refraction_norm_free(wi, n, eta, &tir));
+        }
+    }
+
+    // Radiance along ro + t * rd with diffuse bounces and next event estimation towards the point light,
+    // and reflection or refraction at glass.
+    // Visibility is evaluated on floats, so the tangent is the interior derivative: silhouettes and shadow edges
+    // moving with the parameter are not accounted for. Shadow rays do not pass glass.
+    inline dval3 trace_path(const TracerScene& scene, dval3 ro, dval3 rd, uint64_t seed, int maxDepth)
+    {
+        dtriangles tris = scene.triangles();
+        details::TracerRandom random(seed);
+
+        dval3 radiance = { 0.0f, 0.0f, 0.0f };
+        dval3 throughput = { 1.0f, 1.0f, 1.0f };
+        for (int depth = 0; depth < maxDepth; depth++)
+        {
+            dhit hit;
+            int i = scene.bvh.intersect(ro, rd, tris, &hit);
+            if (i < 0)
+            {
+                break;
+            }
+            if (0.0f < scene.ior[i])
+            {
+                details::tracer_dielectric(scene, tris, i, hit, &random, &ro, &rd, &throughput);
+            }
+            else
+            {
+                details::tracer_diffuse(scene, tris, i, hit, &random, &ro, &rd, &throughput, &radiance);
+            }
+        }
+        return radiance;
+    }
+
+    inline dval3 camera_ray(const TracerCamera& camera, int width, int height, float px, float py)
+    {
+        float f[3], r[3], u[3];
+        for (int i = 0; i < 3; i++)
+        {
+            f[i] = camera.lookat[i] - camera.origin[i];
+        }
+        auto normalize3 = [](float v[3]) {
+            float s = 1.0f / std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+            v[0] *= s; v[1] *= s; v[2] *= s;
+        };
+        normalize3(f);
+        r[0] = f[1] * camera.up[2] - f[2] * camera.up[1];
+        r[1] = f[2] * camera.up[0] - f[0] * camera.up[2];
+        r[2] = f[0] * camera.up[1] - f[1] * camera.up[0];
+        normalize3(r);
+        u[0] = r[1] * f[2] - r[2] * f[1];
+        u[1] = r[2] * f[0] - r[0] * f[2];
+        u[2] = r[0] * f[1] - r[1] * f[0];
+
+        float tanHalf = std::tan(camera.fovy * 0.5f);
+        float sx = (2.0f * px / width - 1.0f) * tanHalf * width / height;
+        float sy = (1.0f - 2.0f * py / height) * tanHalf;
+        dval3 d = {
+            f[0] + r[0] * sx + u[0] * sy,
+            f[1] + r[1] * sx + u[1] * sy,
+            f[2] + r[2] * sx + u[2] * sy
+        };
+        return normalize(d);
+    }
+
+    // The jittered primary ray of a pixel sample and the seed of its path
+    inline uint64_t pixel_sample(const TracerCamera& camera, int width, int height, int x, int y, int sample, dval3* ro, dval3* rd)
+    {
+        uint64_t seed = ((uint64_t)sample << 40) ^ ((uint64_t)y * width + x);
+        details::TracerRandom jitter(seed ^ 0x9E3779B97F4A7C15ULL);
+        *rd = camera_ray(camera, width, height, x + jitter.uniform(), y + jitter.uniform());
+        *ro = { camera.origin[0], camera.origin[1], camera.origin[2] };
+        return seed;
+    }
+
+    // Progressive differentiable rendering on a WorkStealingPool, driven by its own thread.
+    // Each pass adds one sample per pixel, tile by tile. The UI thread only calls setup() and fetch() which never wait for a pass.
+    class Tracer
+    {
+    public:
+        enum
+        {
+            TILE_SIZE = 16,
+        };
+
+        struct Settings
+        {
+            int width = 256;
+            int height = 256;
+            TracerCamera camera;
+            TracerParameter parameter = TracerParameter::BoxOffset;
+            float value = 0.0f;
+            int maxDepth = 4;
+            bool glassBox = false;
+
+            bool operator==(const Settings& rhs) const
+            {
+                return width == rhs.width && height == rhs.height && camera == rhs.camera &&
+                    parameter == rhs.parameter && value == rhs.value && maxDepth == rhs.maxDepth && glassBox == rhs.glassBox;
+            }
+            bool operator!=(const Settings& rhs) const { return !(*this == rhs); }
+        };
+
+        explicit Tracer(int nThreads = 0) : m_pool(nThreads)
+        {
+            m_thread = std::thread([this]() { loop(); });
+        }
+        ~Tracer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+            }
+            m_generation++;
+            m_wake.notify_all();
+            m_thread.join();
+        }
+        Tracer(const Tracer&) = delete;
+        Tracer& operator=(const Tracer&) = delete;
+
+        int threadCount() const { return m_pool.threadCount(); }
+
+        // Restarts the accumulation if anything changed. Tiles of the pass in flight bail out early.
+        void setup(const Settings& settings)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_hasSettings && settings == m_settings)
+            {
+                return;
+            }
+            m_settings = settings;
+            m_hasSettings = true;
+            m_generation++;
+            m_wake.notify_all();
+        }
+
+        // Copies the latest finished pass, rgb floats averaged over the samples. Returns false if nothing new arrived since the last call.
+        bool fetch(std::vector<float>* primal, std::vector<float>* tangent, int* width, int* height, int* samples)
+        {
+            std::lock_guard<std::mutex> lock(m_resultMutex);
+            if (m_resultVersion == m_fetchedVersion)
+            {
+                return false;
+            }
+            m_fetchedVersion = m_resultVersion;
+            *primal = m_resultPrimal;
+            *tangent = m_resultTangent;
+            *width = m_resultWidth;
+            *height = m_resultHeight;
+            *samples = m_resultSamples;
+            return true;
+        }
+
+        // seconds spent on the last pass
+        double passSeconds() const { return m_passSeconds.load(); }
+
+    private:
+        void loop()
+        {
+            std::vector<float> primal;
+            std::vector<float> tangent;
+            std::vector<float> averaged[2];
+            for (;;)
+            {
+                Settings settings;
+                uint64_t generation;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [this]() { return m_quit || m_hasSettings; });
+                    if (m_quit)
+                    {
+                        return;
+                    }
+                    settings = m_settings;
+                    generation = m_generation.load();
+                }
+
+                TracerScene scene(settings.parameter, settings.value, settings.glassBox);
+                int w = settings.width;
+                int h = settings.height;
+                int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+                int tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+                primal.assign(w * h * 3, 0.0f);
+                tangent.assign(w * h * 3, 0.0f);
+
+                for (int sample = 0; generation == m_generation.load(); sample++)
+                {
+                    auto begin = std::chrono::steady_clock::now();
+                    m_pool.run(tilesX * tilesY, [&](int tile, int) {
+                        if (generation != m_generation.load())
+                        {
+                            return;
+                        }
+                        int x0 = (tile % tilesX) * TILE_SIZE;
+                        int y0 = (tile / tilesX) * TILE_SIZE;
+                        for (int y = y0; y < std::min(y0 + TILE_SIZE, h); y++)
+                        for (int x = x0; x < std::min(x0 + TILE_SIZE, w); x++)
+                        {
+                            dval3 ro, rd;
+                            uint64_t seed = pixel_sample(settings.camera, w, h, x, y, sample, &ro, &rd);
+                            dval3 L = trace_path(scene, ro, rd, seed, settings.maxDepth);
+                            float* pv = &primal[(y * w + x) * 3];
+                            float* pg = &tangent[(y * w + x) * 3];
+                            pv[0] += L.x.v; pv[1] += L.y.v; pv[2] += L.z.v;
+                            pg[0] += L.x.g; pg[1] += L.y.g; pg[2] += L.z.g;
+                        }
+                    });
+                    if (generation != m_generation.load())
+                    {
+                        break;
+                    }
+                    m_passSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+                    // publish the average outside of the result lock, then swap it in
+                    float scale = 1.0f / (sample + 1);
+                    averaged[0].resize(primal.size());
+                    averaged[1].resize(tangent.size());
+                    for (size_t i = 0; i < primal.size(); i++)
+                    {
+                        averaged[0][i] = primal[i] * scale;
+                        averaged[1][i] = tangent[i] * scale;
+                    }
+                    std::lock_guard<std::mutex> lock(m_resultMutex);
+                    std::swap(m_resultPrimal, averaged[0]);
+                    std::swap(m_resultTangent, averaged[1]);
+                    m_resultWidth = w;
+                    m_resultHeight = h;
+                    m_resultSamples = sample + 1;
+                    m_resultVersion++;
+                }
+            }
+        }
+
+        WorkStealingPool m_pool;
+        std::thread m_thread;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        Settings m_settings;
+        bool m_hasSettings = false;
+        bool m_quit = false;
+        std::atomic<uint64_t> m_generation{ 0 };
+        std::atomic<double> m_passSeconds{ 0.0 };
+
+        std::mutex m_resultMutex;
+        std::vector<float> m_resultPrimal;
+        std::vector<float> m_resultTangent;
+        int m_resultWidth = 0;
+        int m_resultHeight = 0;
+        int m_resultSamples = 0;
+        uint64_t m_resultVersion = 0;
+        uint64_t m_fetchedVersion = 0;
+    };
+}
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "saka.h"
+#include "saka_pool.h"
+#include "saka_sort.h"
+#include "saka_tracer.h"
+
+namespace saka
+{
+    // Rays of a wavefront in structure of arrays layout, with a fixed capacity allocated up front
+    struct WavefrontRays
+    {
+        std::vector<dval> ox, oy, oz;
+        std::vector<dval> dx, dy, dz;
+        std::vector<dval> tx, ty, tz; // throughput
+        std::vector<dval> t;          // hit distance, from the intersection stage
+        std::vector<int> triangle;    // hit triangle, from the intersection stage
+        std::vector<int> path;        // index of the path in its wave
+        std::vector<int> depth;       // bounces so far
+        std::vector<uint64_t> random; // state of the path's details::TracerRandom
+        std::vector<uint8_t> next;    // queue of the ray's next stage, written by a kernel and read by the compaction
+        int size = 0;
+
+        void allocate(int capacity)
+        {
+            for (std::vector<dval>* v : { &ox, &oy, &oz, &dx, &dy, &dz, &tx, &ty, &tz, &t })
+            {
+                v->resize(capacity);
+            }
+            triangle.resize(capacity);
+            path.resize(capacity);
+            depth.resize(capacity);
+            random.resize(capacity);
+            next.resize(capacity);
+            size = 0;
+        }
+        int capacity() const { return (int)path.size(); }
+
+        dval3 origin(int i) const { return { ox[i], oy[i], oz[i] }; }
+        dval3 direction(int i) const { return { dx[i], dy[i], dz[i] }; }
+        dval3 throughput(int i) const { return { tx[i], ty[i], tz[i] }; }
+        void set(int i, dval3 o, dval3 d, dval3 throughput)
+        {
+            ox[i] = o.x; oy[i] = o.y; oz[i] = o.z;
+            dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+            tx[i] = throughput.x; ty[i] = throughput.y; tz[i] = throughput.z;
+        }
+
+        void copy(int from, WavefrontRays* to, int slot) const
+        {
+            to->ox[slot] = ox[from]; to->oy[slot] = oy[from]; to->oz[slot] = oz[from];
+            to->dx[slot] = dx[from]; to->dy[slot] = dy[from]; to->dz[slot] = dz[from];
+            to->tx[slot] = tx[from]; to->ty[slot] = ty[from]; to->tz[slot] = tz[from];
+            to->t[slot] = t[from];
+            to->triangle[slot] = triangle[from];
+            to->path[slot] = path[from];
+            to->depth[slot] = depth[from];
+            to->random[slot] = random[from];
+            to->next[slot] = next[from];
+        }
+    };
+
+    // Time and ray count of every stage over the last WavefrontTracer::render(), in total and per bounce
+    struct WavefrontStats
+    {
+        enum
+        {
+            GENERATE,
+            INTERSECT,
+            SORT,
+            DIFFUSE,
+            DIELECTRIC,
+            TERMINATE,
+            COMPACT,
+            STAGE_COUNT,
+        };
+        enum
+        {
+            MAX_BOUNCES = 16, // later bounces are counted in the last one
+        };
+        double seconds[STAGE_COUNT] = {};
+        int64_t rays[STAGE_COUNT] = {};
+        double bounceSeconds[MAX_BOUNCES][STAGE_COUNT] = {};
+        int bounces = 0;
+
+        static const char* name(int stage)
+        {
+            static const char* names[STAGE_COUNT] = { "generate", "intersect", "sort", "diffuse", "dielectric", "terminate", "compact" };
+            return names[stage];
+        }
+        double totalSeconds() const
+        {
+            double s = 0.0;
+            for (int i = 0; i < STAGE_COUNT; i++)
+            {
+                s += seconds[i];
+            }
+            return s;
+        }
+
+        // The cost of sorting per bounce and its gain: the time the other stages of the bounce saved against baseline,
+        // a pass of the same scene and size with other sort settings, e.g. none
+        std::string sortReport(const WavefrontStats& baseline) const
+        {
+            std::string s;
+            char buffer[256];
+            sprintf(buffer, "%-7s %12s %12s %12s %12s\n", "bounce", "sort ms", "others ms", "baseline ms", "gain ms");
+            s += buffer;
+            for (int b = 0; b < std::max(bounces, baseline.bounces); b++)
+            {
+                double others = 0.0, othersBaseline = 0.0;
+                for (int i = 0; i < STAGE_COUNT; i++)
+                {
+                    others += i == SORT ? 0.0 : bounceSeconds[b][i];
+                    othersBaseline += i == SORT ? 0.0 : baseline.bounceSeconds[b][i];
+                }
+                double sort = bounceSeconds[b][SORT] - baseline.bounceSeconds[b][SORT];
+                sprintf(buffer, "%-7d %12.3f %12.3f %12.3f %12.3f\n", b, sort * 1000.0, others * 1000.0, othersBaseline * 1000.0,
+                    (othersBaseline - others - sort) * 1000.0);
+                s += buffer;
+            }
+            return s;
+        }
+    };
+
+    // Renders TracerScene passes like Tracer, but as a wavefront: instead of one thread following a path through
+    // all its bounces, every stage runs its kernel over a dense queue of rays on all workers of the pool,
+    //   generate -> intersect -> diffuse (next event estimation, BSDF sampling) | dielectric (reflection, refraction) -> terminate
+    // and the rays are compacted into the queue of their next stage in between, keeping their order.
+    // The stages share their bounce code and random numbers with trace_path(), so a pass is the same image as Tracer's.
+    //
+    // Bounces chosen by setSortBounces() sort the rays after the intersection by the hit triangle, which stands for
+    // the material, then the octant of the direction and the Morton code of the hit point. Shading then runs over
+    // neighbouring rays of the same surface, and since compaction keeps the order, so does the next intersection.
+    // Sorting does not change the image, only the order of the work.
+    class WavefrontTracer
+    {
+    public:
+        enum
+        {
+            CHUNK = 256, // rays per pool task
+        };
+        enum
+        {
+            QUEUE_ACTIVE,
+            QUEUE_DIFFUSE,
+            QUEUE_DIELECTRIC,
+            QUEUE_COUNT,
+            TERMINATED = QUEUE_COUNT, // a next value that drops the ray
+        };
+
+        // capacity: paths per wave, a pass runs ceil(pixels / capacity) waves. pool may be null to run on the calling thread.
+        explicit WavefrontTracer(WorkStealingPool* pool, int capacity = 1 << 16) : m_pool(pool), m_capacity(capacity)
+        {
+            for (WavefrontRays& q : m_queues)
+            {
+                q.allocate(capacity);
+            }
+            m_scratch.allocate(capacity);
+            m_radiance.resize(capacity);
+            m_counts.resize((size_t)chunkCount(capacity) * QUEUE_COUNT);
+            m_keys.resize(capacity);
+            m_sort.reserve(capacity);
+        }
+
+        int capacity() const { return m_capacity; }
+
+        // bit b sorts the rays of bounce b, where the camera rays are bounce 0. Sorting is off by default.
+        void setSortBounces(uint32_t mask) { m_sortBounces = mask; }
+        uint32_t sortBounces() const { return m_sortBounces; }
+
+        // Adds sample index `sample` of every pixel to primal and tangent, rgb with width * height * 3 floats each
+        void render(const TracerScene& scene, const TracerCamera& camera, int width, int height, int sample, int maxDepth,
+            float* primal, float* tangent)
+        {
+            m_stats = WavefrontStats();
+            dtriangles tris = scene.triangles();
+            WavefrontRays& active = m_queues[QUEUE_ACTIVE];
+            WavefrontRays& diffuse = m_queues[QUEUE_DIFFUSE];
+            WavefrontRays& dielectric = m_queues[QUEUE_DIELECTRIC];
+            int pixels = width * height;
+            for (int first = 0; first < pixels; first += m_capacity)
+            {
+                int count = std::min(m_capacity, pixels - first);
+                m_bounce = 0;
+                stage(WavefrontStats::GENERATE, count, [&](int i) {
+                    int pixel = first + i;
+                    dval3 ro, rd;
+                    uint64_t seed = pixel_sample(camera, width, height, pixel % width, pixel / width, sample, &ro, &rd);
+                    active.set(i, ro, rd, { 1.0f, 1.0f, 1.0f });
+                    active.path[i] = i;
+                    active.depth[i] = 0;
+                    active.random[i] = details::TracerRandom(seed).state;
+                    m_radiance[i] = { 0.0f, 0.0f, 0.0f };
+                });
+                active.size = count;
+
+                for (m_bounce = 0; 0 < active.size; m_bounce++)
+                {
+                    stage(WavefrontStats::INTERSECT, active.size, [&](int i) {
+                        dhit hit;
+                        int tri = scene.bvh.intersect(active.origin(i), active.direction(i), tris, &hit);
+                        active.triangle[i] = tri;
+                        active.t[i] = hit.t;
+                        active.next[i] = tri < 0 ? TERMINATED : 0.0f < scene.ior[tri] ? QUEUE_DIELECTRIC : QUEUE_DIFFUSE;
+                    });
+                    if (m_bounce < 32 && (m_sortBounces >> m_bounce & 1))
+                    {
+                        sortActive(scene);
+                    }
+                    compact(&active);
+
+                    stage(WavefrontStats::DIFFUSE, diffuse.size, [&](int i) {
+                        dval3 ro = diffuse.origin(i), rd = diffuse.direction(i), throughput = diffuse.throughput(i);
+                        details::TracerRandom random = details::TracerRandom::resume(diffuse.random[i]);
+                        details::tracer_diffuse(scene, tris, diffuse.triangle[i], { diffuse.t[i], 0.0f, 0.0f }, &random,
+                            &ro, &rd, &throughput, &m_radiance[diffuse.path[i]]);
+                        diffuse.set(i, ro, rd, throughput);
+                        diffuse.random[i] = random.state;
+                        diffuse.depth[i]++;
+                    });
+                    stage(WavefrontStats::DIELECTRIC, dielectric.size, [&](int i) {
+                        dval3 ro = dielectric.origin(i), rd = dielectric.direction(i), throughput = dielectric.throughput(i);
+                        details::TracerRandom random = details::TracerRandom::resume(dielectric.random[i]);
+                        details::tracer_dielectric(scene, tris, dielectric.triangle[i], { dielectric.t[i], 0.0f, 0.0f }, &random,
+                            &ro, &rd, &throughput);
+                        dielectric.set(i, ro, rd, throughput);
+                        dielectric.random[i] = random.state;
+                        dielectric.depth[i]++;
+                    });
+
+                    for (WavefrontRays* q : { &diffuse, &dielectric })
+                    {
+                        stage(WavefrontStats::TERMINATE, q->size, [&](int i) {
+                            q->next[i] = q->depth[i] < maxDepth ? QUEUE_ACTIVE : TERMINATED;
+                        });
+                        compact(q);
+                    }
+                }
+
+                // every path of a wave has its own pixel
+                forEach(count, [&](int i) {
+                    float* pv = &primal[(size_t)(first + i) * 3];
+                    float* pg = &tangent[(size_t)(first + i) * 3];
+                    const dval3& L = m_radiance[i];
+                    pv[0] += L.x.v; pv[1] += L.y.v; pv[2] += L.z.v;
+                    pg[0] += L.x.g; pg[1] += L.y.g; pg[2] += L.z.g;
+                });
+            }
+        }
+
+        const WavefrontStats& stats() const { return m_stats; }
+
+    private:
+        static int chunkCount(int count) { return (count + CHUNK - 1) / CHUNK; }
+
+        // f(chunk) for every chunk, on the pool if there is one
+        template <class F>
+        void forChunks(int chunks, F f)
+        {
+            run(m_pool, chunks, [&](int c, int) { f(c); });
+        }
+        template <class F>
+        void forEach(int count, F f)
+        {
+            forChunks(chunkCount(count), [&](int c) {
+                for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, count); i++)
+                {
+                    f(i);
+                }
+            });
+        }
+
+        template <class F>
+        void stage(int which, int count, F f)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            forEach(count, f);
+            record(which, count, begin);
+        }
+        void record(int which, int count, std::chrono::steady_clock::time_point begin)
+        {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            int bounce = std::min(m_bounce, (int)WavefrontStats::MAX_BOUNCES - 1);
+            m_stats.seconds[which] += seconds;
+            m_stats.rays[which] += count;
+            m_stats.bounceSeconds[bounce][which] += seconds;
+            m_stats.bounces = std::max(m_stats.bounces, bounce + 1);
+        }
+
+        static uint32_t spreadBits(uint32_t x)
+        {
+            // the low 10 bits to every third bit
+            x = (x | (x << 16)) & 0x030000FF;
+            x = (x | (x << 8)) & 0x0300F00F;
+            x = (x | (x << 4)) & 0x030C30C3;
+            x = (x | (x << 2)) & 0x09249249;
+            return x;
+        }
+
+        // Reorders the intersected active queue by (triangle, direction octant, Morton code of the hit point), misses last
+        void sortActive(const TracerScene& scene)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            WavefrontRays& active = m_queues[QUEUE_ACTIVE];
+            int n = active.size;
+
+            // as many high bits for the triangle as it needs up to 12, then 3 for the octant and the top of the Morton code
+            int triangleCount = (int)scene.ior.size();
+            int triangleBits = 1;
+            while ((1 << triangleBits) < triangleCount)
+            {
+                triangleBits++;
+            }
+            int triangleShift = std::max(triangleBits - 12, 0);
+            triangleBits -= triangleShift;
+            int mortonShift = 1 + triangleBits; // the 30 bit code into the remaining 29 - triangleBits
+
+            float lower[3] = { 0.0f, 0.0f, 0.0f }, scale[3] = { 0.0f, 0.0f, 0.0f };
+            if (!scene.bvh.nodes.empty())
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    lower[a] = scene.bvh.nodes[0].lower[a];
+                    float extent = scene.bvh.nodes[0].upper[a] - lower[a];
+                    scale[a] = 0.0f < extent ? 1023.0f / extent : 0.0f;
+                }
+            }
+
+            forEach(n, [&](int i) {
+                int tri = active.triangle[i];
+                if (tri < 0)
+                {
+                    m_keys[i] = 0xFFFFFFFFu;
+                    return;
+                }
+                float d[3] = { active.dx[i].v, active.dy[i].v, active.dz[i].v };
+                float t = active.t[i].v;
+                uint32_t morton = 0;
+                for (int a = 0; a < 3; a++)
+                {
+                    float p = (a == 0 ? active.ox[i].v : a == 1 ? active.oy[i].v : active.oz[i].v) + d[a] * t;
+                    float cell = std::min(std::max((p - lower[a]) * scale[a], 0.0f), 1023.0f);
+                    morton |= spreadBits((uint32_t)cell) << (2 - a);
+                }
+                uint32_t octant = (d[0] < 0.0f ? 1u : 0u) | (d[1] < 0.0f ? 2u : 0u) | (d[2] < 0.0f ? 4u : 0u);
+                m_keys[i] = ((uint32_t)(tri >> triangleShift) << (32 - triangleBits)) | (octant << (29 - triangleBits)) | (morton >> mortonShift);
+            });
+            m_sort.sort(m_keys.data(), n, m_pool);
+
+            const uint32_t* order = m_sort.order();
+            forEach(n, [&](int i) {
+                active.copy((int)order[i], &m_scratch, i);
+            });
+            std::swap(active, m_scratch);
+            active.size = n;
+            record(WavefrontStats::SORT, n, begin);
+        }
+
+        // Appends the rays of source to the queues named by their next, in order, and empties source.
+        // Per chunk counts, an exclusive scan over them and a scatter, so no atomics and a deterministic order.
+        void compact(WavefrontRays* source)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            int n = source->size;
+            int chunks = chunkCount(n);
+            forChunks(chunks, [&](int c) { countChunk(*source, c); });
+
+            // counts become the first slot of every chunk in every queue
+            for (int q = 0; q < QUEUE_COUNT; q++)
+            {
+                int slot = m_queues[q].size;
+                for (int c = 0; c < chunks; c++)
+                {
+                    int count = m_counts[(size_t)c * QUEUE_COUNT + q];
+                    m_counts[(size_t)c * QUEUE_COUNT + q] = slot;
+                    slot += count;
+                }
+                m_queues[q].size = slot;
+            }
+
+            forChunks(chunks, [&](int c) {
+                int slots[QUEUE_COUNT];
+                std::copy(&m_counts[(size_t)c * QUEUE_COUNT], &m_counts[(size_t)c * QUEUE_COUNT] + QUEUE_COUNT, slots);
+                for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, n); i++)
+                {
+                    int q = source->next[i];
+                    if (q < QUEUE_COUNT)
+                    {
+                        source->copy(i, &m_queues[q], slots[q]++);
+                    }
+                }
+            });
+            source->size = 0;
+            record(WavefrontStats::COMPACT, n, begin);
+        }
+        void countChunk(const WavefrontRays& source, int c)
+        {
+            int* counts = &m_counts[(size_t)c * QUEUE_COUNT];
+            std::fill(counts, counts + QUEUE_COUNT, 0);
+            for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, source.size); i++)
+            {
+                if (source.next[i] < QUEUE_COUNT)
+                {
+                    counts[source.next[i]]++;
+                }
+            }
+        }
+
+        WorkStealingPool* m_pool;
+        int m_capacity;
+        WavefrontRays m_queues[QUEUE_COUNT];
+        WavefrontRays m_scratch;        // the active queue in sorted order, then swapped with it
+        std::vector<dval3> m_radiance; // per path of the wave
+        std::vector<int> m_counts;     // chunk major, QUEUE_COUNT per chunk
+        std::vector<uint32_t> m_keys;
+        RadixSort m_sort;
+        uint32_t m_sortBounces = 0;
+        int m_bounce = 0;
+        WavefrontStats m_stats;
+    };
+}
@@ -2,8 +2,21 @@
 #include "pr.hpp"
 #include <autodiff/forward/dual.hpp>
 #include "saka.h"
+#include "saka_bvh.h"
+#include "saka_tracer.h"
+#include "saka_optimize.h"
+#include "saka_grad_buffer.h"
+#include "saka_lens.h"
+#include "saka_manifold.h"
+#include "saka_bsdf.h"
+#include "saka_texture.h"
+#include "saka_wavefront.h"
+#include "saka_sort.h"
 
+#include <chrono>
 #include <functional>
+#include <random>
+#include <vector>
 
 using namespace autodiff;
 using namespace saka;
@@ -109,4 +122,1383 @@ TEST_CASE("complex_1", "") {
 
         REQUIRE(fabsf(dudx - u.g) < 1.0e-5f);
     }
+}
+// d/dx of a one-argument function against autodiff::dual, for x in [lo, hi)
+template <class RefF, class F>
+void check_unary(RefF f_ref, F f, float lo, float hi)
+{
+    pr::PCG rng;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        dual x_ref = lo + (hi - lo) * rng.uniformf();
+        dual u_ref = f_ref(x_ref);
+        double dudx = derivative(f_ref, wrt(x_ref), at(x_ref));
+
+        dval x = x_ref.val; x.requires_grad();
+        dval u = f(x);
+
+        REQUIRE(fabs(u_ref.val - u.v) < 1.0e-5 * (1.0 + fabs(u_ref.val)));
+        REQUIRE(fabs(dudx - u.g) < 1.0e-4 * (1.0 + fabs(dudx)));
+    }
+}
+
+// d/dx and d/dy of a two-argument function against autodiff::dual, for x in [xlo, xhi) and y in [ylo, yhi)
+template <class RefF, class F>
+void check_binary(RefF f_ref, F f, float xlo, float xhi, float ylo, float yhi)
+{
+    pr::PCG rng;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        dual x_ref = xlo + (xhi - xlo) * rng.uniformf();
+        dual y_ref = ylo + (yhi - ylo) * rng.uniformf();
+        dual u_ref = f_ref(x_ref, y_ref);
+        double dudx = derivative(f_ref, wrt(x_ref), at(x_ref, y_ref));
+        double dudy = derivative(f_ref, wrt(y_ref), at(x_ref, y_ref));
+
+        dval x = x_ref.val; x.requires_grad();
+        dval y = y_ref.val;
+        dval u = f(x, y);
+        REQUIRE(fabs(u_ref.val - u.v) < 1.0e-5 * (1.0 + fabs(u_ref.val)));
+        REQUIRE(fabs(dudx - u.g) < 1.0e-4 * (1.0 + fabs(dudx)));
+
+        x = x_ref.val;
+        y = y_ref.val; y.requires_grad();
+        u = f(x, y);
+        REQUIRE(fabs(dudy - u.g) < 1.0e-4 * (1.0 + fabs(dudy)));
+    }
+}
+
+TEST_CASE("math", "") {
+    check_unary([](dual x) -> dual { return sin(x); }, [](dval x) { return sin(x); }, -4.0f, 4.0f);
+    check_unary([](dual x) -> dual { return cos(x); }, [](dval x) { return cos(x); }, -4.0f, 4.0f);
+    check_unary([](dual x) -> dual { return log(x); }, [](dval x) { return log(x); }, 0.1f, 4.0f);
+    check_unary([](dual x) -> dual { return tanh(x); }, [](dval x) { return tanh(x); }, -3.0f, 3.0f);
+    check_unary([](dual x) -> dual { return exp(x); }, [](dval x) { return exp(x); }, -3.0f, 3.0f);
+    check_unary([](dual x) -> dual { return sqrt(x); }, [](dval x) { return sqrt(x); }, 0.1f, 4.0f);
+    check_unary([](dual x) -> dual { return abs(x); }, [](dval x) { return abs(x); }, -2.0f, 2.0f);
+    check_unary([](dual x) -> dual { return pow(x, 2.5); }, [](dval x) { return pow(x, 2.5f); }, 0.0f, 3.0f);
+    check_unary([](dual x) -> dual { return pow(x, 3.0); }, [](dval x) { return pow(x, 3.0f); }, -2.0f, 2.0f);
+    check_unary([](dual x) -> dual { return min(max(x, dual(-0.5)), dual(0.5)); }, [](dval x) { return clamp(x, -0.5f, 0.5f); }, -1.0f, 1.0f);
+
+    check_binary([](dual x, dual y) -> dual { return pow(x, y); }, [](dval x, dval y) { return pow(x, y); }, 0.1f, 3.0f, -2.0f, 2.0f);
+    check_binary([](dual y, dual x) -> dual { return atan2(y, x); }, [](dval y, dval x) { return atan2(y, x); }, -2.0f, 2.0f, -2.0f, 2.0f);
+    check_binary([](dual x, dual y) -> dual { return min(x, y); }, [](dval x, dval y) { return min(x, y); }, -1.0f, 1.0f, -1.0f, 1.0f);
+    check_binary([](dual x, dual y) -> dual { return max(x, y); }, [](dval x, dval y) { return max(x, y); }, -1.0f, 1.0f, -1.0f, 1.0f);
+    check_binary([](dual x, dual y) -> dual { return x * y + 0.75; }, [](dval x, dval y) { return fma(x, y, 0.75f); }, -2.0f, 2.0f, -2.0f, 2.0f);
+    check_binary([](dual x, dual y) -> dual { return 1.5 * x + y; }, [](dval x, dval y) { return fma(1.5f, x, y); }, -2.0f, 2.0f, -2.0f, 2.0f);
+}
+
+// refraction_norm_free as it was with an early return, to check the branchless one against
+dval3 refraction_norm_free_branch(dval3 wi, dval3 n, float eta)
+{
+    dval NoN = dot(n, n);
+    dval WIoN = dot(wi, n);
+    dval WoW = dot(wi, wi);
+    dval k = NoN * WoW * (eta * eta - 1.0f) + WIoN * WIoN;
+    if (k.v < 0.0f)
+    {
+        return { 0.0f, 0.0f, 0.0f };
+    }
+    return -wi * NoN + n * (WIoN - sqrt(k));
+}
+
+TEST_CASE("select", "") {
+    pr::PCG rng;
+
+    dval a = 1.0f; a.requires_grad();
+    dval b = 2.0f;
+    REQUIRE(select(true, a, b).v == 1.0f);
+    REQUIRE(select(true, a, b).g == 1.0f);
+    REQUIRE(select(false, a, b).v == 2.0f);
+    REQUIRE(select(false, a, b).g == 0.0f);
+
+    int nTIR = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        dval3 wi = { -1.0f + 2.0f * rng.uniformf(), -1.0f + 2.0f * rng.uniformf(), -1.0f + 2.0f * rng.uniformf() };
+        dval3 n = { -1.0f + 2.0f * rng.uniformf(), -1.0f + 2.0f * rng.uniformf(), -1.0f + 2.0f * rng.uniformf() };
+        float eta = 0.5f + 1.5f * rng.uniformf();
+        wi.x.requires_grad();
+
+        bool tir;
+        dval3 masked = refraction_norm_free(wi, n, eta, &tir);
+        dval3 branch = refraction_norm_free_branch(wi, n, eta);
+        nTIR += tir ? 1 : 0;
+
+        REQUIRE(masked.x.v == branch.x.v);
+        REQUIRE(masked.y.v == branch.y.v);
+        REQUIRE(masked.z.v == branch.z.v);
+        REQUIRE(masked.x.g == branch.x.g);
+        REQUIRE(masked.y.g == branch.y.g);
+        REQUIRE(masked.z.g == branch.z.g);
+    }
+    REQUIRE(0 < nTIR);
+}
+
+TEST_CASE("fast_math", "") {
+    pr::PCG rng;
+
+    for (int i = 0; i < 100000; i++)
+    {
+        float x = -87.0f + 175.0f * rng.uniformf();
+        REQUIRE(fabs(fast_math::exp(x) - exp((double)x)) <= 2.5e-7 * exp((double)x));
+
+        float y = powf(10.0f, -30.0f + 60.0f * rng.uniformf());
+        REQUIRE(fabs(fast_math::log(y) - log((double)y)) <= 1.2e-7 * std::max(1.0, fabs(log((double)y))));
+        REQUIRE(fabs(fast_math::rsqrt(y) - 1.0 / sqrt((double)y)) <= 5.0e-6 / sqrt((double)y));
+        REQUIRE(fabs(fast_math::sqrt(y) - sqrt((double)y)) <= 5.0e-6 * sqrt((double)y));
+
+        float z = -1.0e4f + 2.0e4f * rng.uniformf();
+        float s, c;
+        fast_math::sincos(z, &s, &c);
+        REQUIRE(fabs(s - sin((double)z)) <= 5.0e-7);
+        REQUIRE(fabs(c - cos((double)z)) <= 5.0e-7);
+
+        float t = -10.0f + 20.0f * rng.uniformf();
+        REQUIRE(fabs(fast_math::tanh(t) - tanh((double)t)) <= 1.5e-7);
+
+        float b = powf(10.0f, -3.0f + 6.0f * rng.uniformf());
+        float p = -4.0f + 8.0f * rng.uniformf();
+        double bp = pow((double)b, (double)p);
+        REQUIRE(fabs(fast_math::pow(b, p) - bp) <= 2.5e-7 * (1.0 + fabs(p * log((double)b))) * bp);
+    }
+
+    // the tangents follow the approximated values
+    for (int i = 0; i < 1000; i++)
+    {
+        dval x = 0.1f + 4.0f * rng.uniformf(); x.requires_grad();
+
+        dval u = exp<fast_math>(x);
+        REQUIRE(u.g == u.v);
+        REQUIRE(fabsf(u.g - exp<precise_math>(x).g) <= 1.0e-6f * u.v);
+
+        u = sqrt<fast_math>(x);
+        REQUIRE(u.g == 0.5f / u.v);
+        REQUIRE(fabsf(u.g - sqrt<precise_math>(x).g) <= 1.0e-5f * u.g);
+
+        u = rsqrt<fast_math>(x);
+        REQUIRE(fabsf(u.g - rsqrt<precise_math>(x).g) <= 2.0e-5f * fabsf(u.g));
+
+        u = log<fast_math>(x);
+        REQUIRE(fabsf(u.g - log<precise_math>(x).g) <= 1.0e-6f * u.g);
+
+        u = sin<fast_math>(x);
+        REQUIRE(fabsf(u.g - sin<precise_math>(x).g) <= 1.0e-6f);
+        u = cos<fast_math>(x);
+        REQUIRE(fabsf(u.g - cos<precise_math>(x).g) <= 1.0e-6f);
+
+        dval y = -2.0f + 4.0f * rng.uniformf();
+        u = pow<fast_math>(x, y);
+        REQUIRE(fabsf(u.g - pow<precise_math>(x, y).g) <= 1.0e-5f * fabsf(u.g));
+        u = pow<fast_math>(x, y.v);
+        REQUIRE(fabsf(u.g - pow<precise_math>(x, y.v).g) <= 1.0e-5f * fabsf(u.g));
+
+        dval t = y.v; t.requires_grad();
+        u = tanh<fast_math>(t);
+        REQUIRE(fabsf(u.v - tanh<precise_math>(t).v) <= 1.5e-7f);
+        REQUIRE(fabsf(u.g - tanh<precise_math>(t).g) <= 1.0e-6f);
+    }
+}
+
+dval random_dval(pr::PCG& rng)
+{
+    dval x = -1.0f + 2.0f * rng.uniformf();
+    x.g = -1.0f + 2.0f * rng.uniformf();
+    return x;
+}
+
+TEST_CASE("dmat", "") {
+    pr::PCG rng;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        // diagonally dominant so that the inverses are well conditioned
+        dmat3 a3;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                a3.m[c][j] = random_dval(rng) + (c == j ? 4.0f : 0.0f);
+            }
+        }
+        dmat4 a4;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                a4.m[c][j] = random_dval(rng) + (c == j ? 4.0f : 0.0f);
+            }
+        }
+
+        // A A^-1 = I for the values, and its tangent vanishes
+        dmat3 i3 = a3 * inverse(a3);
+        for (int c = 0; c < 3; c++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                REQUIRE(fabsf(i3.m[c][j].v - (c == j ? 1.0f : 0.0f)) < 1.0e-5f);
+                REQUIRE(fabsf(i3.m[c][j].g) < 1.0e-5f);
+            }
+        }
+        dmat4 i4 = inverse(a4) * a4;
+        for (int c = 0; c < 4; c++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                REQUIRE(fabsf(i4.m[c][j].v - (c == j ? 1.0f : 0.0f)) < 1.0e-5f);
+                REQUIRE(fabsf(i4.m[c][j].g) < 1.0e-5f);
+            }
+        }
+
+        // the fused products against the same sums on dval operators
+        dval3 p = { random_dval(rng), random_dval(rng), random_dval(rng) };
+        dval3 q = a3 * p;
+        dval3 q_ref = {
+            a3.m[0][0] * p.x + a3.m[1][0] * p.y + a3.m[2][0] * p.z,
+            a3.m[0][1] * p.x + a3.m[1][1] * p.y + a3.m[2][1] * p.z,
+            a3.m[0][2] * p.x + a3.m[1][2] * p.y + a3.m[2][2] * p.z
+        };
+        REQUIRE(fabsf(q.x.v - q_ref.x.v) < 1.0e-5f);
+        REQUIRE(fabsf(q.y.g - q_ref.y.g) < 1.0e-5f);
+        REQUIRE(fabsf(q.z.g - q_ref.z.g) < 1.0e-5f);
+
+        dval3 t = transform_point(a4, p);
+        dval4 t_ref = a4 * make_dval4(p, 1.0f);
+        REQUIRE(fabsf(t.x.v - t_ref.x.v) < 1.0e-5f);
+        REQUIRE(fabsf(t.y.g - t_ref.y.g) < 1.0e-5f);
+        dval3 d = transform_direction(a4, p);
+        dval4 d_ref = a4 * make_dval4(p, 0.0f);
+        REQUIRE(fabsf(d.z.v - d_ref.z.v) < 1.0e-5f);
+        REQUIRE(fabsf(d.z.g - d_ref.z.g) < 1.0e-5f);
+
+        // rotations: quaternion against its matrix, and a known derivative
+        dquat r0 = { random_dval(rng), random_dval(rng), random_dval(rng), random_dval(rng) };
+        dquat r = normalize(r0);
+        dval3 rv = rotate(r, p);
+        dval3 rv_ref = to_dmat3(r) * p;
+        REQUIRE(fabsf(rv.x.v - rv_ref.x.v) < 1.0e-5f);
+        REQUIRE(fabsf(rv.y.g - rv_ref.y.g) < 1.0e-4f);
+        REQUIRE(fabsf(rv.z.g - rv_ref.z.g) < 1.0e-4f);
+
+        dquat rr = r * conjugate(r);
+        REQUIRE(fabsf(rr.w.v - 1.0f) < 1.0e-5f);
+        // |r|^2 = s y^2 with y = rsqrt(s) of relative error e, and the tangent y^2 ds (1 - s y^2) is about -2 e ds / s.
+        // e is 4.8e-6 for fast_math::rsqrt (saka.h), which bounds the tangent by 1e-5 |ds / s|, plus rounding.
+        float s = r0.w.v * r0.w.v + r0.x.v * r0.x.v + r0.y.v * r0.y.v + r0.z.v * r0.z.v;
+        float ds = 2.0f * (r0.w.v * r0.w.g + r0.x.v * r0.x.g + r0.y.v * r0.y.g + r0.z.v * r0.z.g);
+        REQUIRE(fabsf(rr.w.g) < 1.0e-5f * (1.0f + fabsf(ds / s)));
+        REQUIRE(fabsf(rr.x.v) < 1.0e-5f);
+
+        dval angle = 6.0f * rng.uniformf(); angle.requires_grad();
+        dval3 e = rotate(dquat_angle_axis(angle, { 0.0f, 0.0f, 1.0f }), { 1.0f, 0.0f, 0.0f });
+        REQUIRE(fabsf(e.x.v - cosf(angle.v)) < 1.0e-5f);
+        REQUIRE(fabsf(e.y.v - sinf(angle.v)) < 1.0e-5f);
+        REQUIRE(fabsf(e.x.g + sinf(angle.v)) < 1.0e-5f);
+        REQUIRE(fabsf(e.y.g - cosf(angle.v)) < 1.0e-5f);
+    }
+
+    // adaptors from any m[column][row] matrix and w, x, y, z quaternion
+    float m[3][3] = { { 1, 2, 3 }, { 4, 5, 6 }, { 7, 8, 10 } };
+    dmat3 a = make_dmat3(m);
+    REQUIRE(a.m[1][2].v == 6.0f);
+    REQUIRE(fabsf(determinant(a).v - (-3.0f)) < 1.0e-5f);
+    struct { float x, y, z, w; } quat = { 0.0f, 0.0f, 0.0f, 1.0f };
+    REQUIRE(make_dquat(quat).w.v == 1.0f);
+}
+
+TEST_CASE("intersect_triangle", "") {
+    pr::PCG rng;
+
+    const int N = 64;
+    std::vector<dval> coords[9];
+    for (int i = 0; i < N; i++)
+    {
+        float cx = -1.0f + 2.0f * rng.uniformf();
+        float cy = -1.0f + 2.0f * rng.uniformf();
+        float cz = -1.0f + 2.0f * rng.uniformf();
+        for (int k = 0; k < 9; k++)
+        {
+            float c = k % 3 == 0 ? cx : (k % 3 == 1 ? cy : cz);
+            dval x = c - 0.5f + rng.uniformf();
+            x.g = -1.0f + 2.0f * rng.uniformf();
+            coords[k].push_back(x);
+        }
+    }
+    dtriangles tris = {
+        coords[0].data(), coords[1].data(), coords[2].data(),
+        coords[3].data(), coords[4].data(), coords[5].data(),
+        coords[6].data(), coords[7].data(), coords[8].data(), N };
+
+    int nHits = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        dval3 ro = { random_dval(rng) * 4.0f, random_dval(rng) * 4.0f, random_dval(rng) * 4.0f };
+        dval3 target = { random_dval(rng) * 0.5f, random_dval(rng) * 0.5f, random_dval(rng) * 0.5f };
+        dval3 rd = target - ro;
+
+        // the batched closest hit against testing every triangle on its own
+        dhit batched;
+        int index = intersect_triangles(ro, rd, tris, &batched);
+        int index_ref = -1;
+        dhit scalar;
+        float tmax = 3.402823466e+38f;
+        for (int j = 0; j < N; j++)
+        {
+            dval3 v0 = { tris.x0[j], tris.y0[j], tris.z0[j] };
+            dval3 v1 = { tris.x1[j], tris.y1[j], tris.z1[j] };
+            dval3 v2 = { tris.x2[j], tris.y2[j], tris.z2[j] };
+            dhit h;
+            if (intersect_triangle(ro, rd, v0, v1, v2, &h, tmax))
+            {
+                tmax = h.t.v;
+                index_ref = j;
+                scalar = h;
+            }
+        }
+        REQUIRE(index == index_ref);
+        if (index < 0)
+        {
+            continue;
+        }
+        nHits++;
+        REQUIRE(batched.t.v == scalar.t.v);
+        REQUIRE(batched.t.g == scalar.t.g);
+
+        // the hit point on the ray and on the triangle agree, and so do their tangents
+        dval3 v0 = { tris.x0[index], tris.y0[index], tris.z0[index] };
+        dval3 v1 = { tris.x1[index], tris.y1[index], tris.z1[index] };
+        dval3 v2 = { tris.x2[index], tris.y2[index], tris.z2[index] };
+        dval3 on_ray = ro + rd * batched.t;
+        dval3 on_triangle = v0 * (1.0f - batched.u - batched.v) + v1 * batched.u + v2 * batched.v;
+        REQUIRE(fabsf(on_ray.x.v - on_triangle.x.v) < 1.0e-4f);
+        REQUIRE(fabsf(on_ray.y.v - on_triangle.y.v) < 1.0e-4f);
+        REQUIRE(fabsf(on_ray.z.v - on_triangle.z.v) < 1.0e-4f);
+        REQUIRE(fabsf(on_ray.x.g - on_triangle.x.g) < 1.0e-3f * (1.0f + fabsf(on_ray.x.g)));
+        REQUIRE(fabsf(on_ray.y.g - on_triangle.y.g) < 1.0e-3f * (1.0f + fabsf(on_ray.y.g)));
+        REQUIRE(fabsf(on_ray.z.g - on_triangle.z.g) < 1.0e-3f * (1.0f + fabsf(on_ray.z.g)));
+    }
+    REQUIRE(100 < nHits);
+}
+
+TEST_CASE("bvh", "") {
+    pr::PCG rng;
+
+    // small triangles scattered in a box, the setting the BVH is for
+    const int N = 3000;
+    std::vector<dval> coords[9];
+    for (int i = 0; i < N; i++)
+    {
+        float c[3] = { -4.0f + 8.0f * rng.uniformf(), -4.0f + 8.0f * rng.uniformf(), -4.0f + 8.0f * rng.uniformf() };
+        for (int k = 0; k < 9; k++)
+        {
+            dval x = c[k % 3] - 0.25f + 0.5f * rng.uniformf();
+            x.g = -1.0f + 2.0f * rng.uniformf();
+            coords[k].push_back(x);
+        }
+    }
+    dtriangles tris = {
+        coords[0].data(), coords[1].data(), coords[2].data(),
+        coords[3].data(), coords[4].data(), coords[5].data(),
+        coords[6].data(), coords[7].data(), coords[8].data(), N };
+
+    BVH bvh;
+    bvh.build(tris);
+
+    std::vector<int> covered(N);
+    for (const BVHNode& node : bvh.nodes)
+    {
+        REQUIRE(node.count <= BVH::MAX_LEAF_SIZE * 4);
+        for (int j = 0; j < node.count; j++)
+        {
+            covered[bvh.indices[node.offset + j]]++;
+        }
+    }
+    for (int c : covered)
+    {
+        REQUIRE(c == 1);
+    }
+
+    int nHits = 0;
+    for (int i = 0; i < 2000; i++)
+    {
+        dval3 ro = { random_dval(rng) * 8.0f, random_dval(rng) * 8.0f, random_dval(rng) * 8.0f };
+        dval3 rd = { random_dval(rng), random_dval(rng), random_dval(rng) };
+
+        dhit hit, hit_ref;
+        int index = bvh.intersect(ro, rd, tris, &hit);
+        int index_ref = intersect_triangles(ro, rd, tris, &hit_ref);
+        REQUIRE(index == index_ref);
+        if (index < 0)
+        {
+            continue;
+        }
+        nHits++;
+        REQUIRE(hit.t.v == hit_ref.t.v);
+        REQUIRE(hit.t.g == hit_ref.t.g);
+        REQUIRE(hit.u.g == hit_ref.u.g);
+        REQUIRE(hit.v.g == hit_ref.v.g);
+    }
+    REQUIRE(100 < nHits);
+
+    std::vector<int> depths(bvh.nodes.size());
+    int maxDepth = 0;
+    for (int i = 0; i < (int)bvh.nodes.size(); i++)
+    {
+        // children come after their parent
+        if (bvh.nodes[i].count == 0)
+        {
+            depths[i + 1] = depths[i] + 1;
+            depths[bvh.nodes[i].offset] = depths[i] + 1;
+        }
+        maxDepth = std::max(maxDepth, depths[i]);
+    }
+    REQUIRE(maxDepth <= BVH::MAX_DEPTH);
+}
+
+// first and mixed second derivatives of a two-argument function against autodiff::dual2nd
+template <class F>
+void check_second_order(F f, float xlo, float xhi, float ylo, float yhi)
+{
+    pr::PCG rng;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        float xv = xlo + (xhi - xlo) * rng.uniformf();
+        float yv = ylo + (yhi - ylo) * rng.uniformf();
+
+        for (int mode = 0; mode < 3; mode++)
+        {
+            // 0: d2f/dxdy, 1: d2f/dx2, 2: d2f/dy2
+            dual2nd x_ref = xv;
+            dual2nd y_ref = yv;
+            dval2 x = xv;
+            dval2 y = yv;
+            if (mode == 0 || mode == 1) { x_ref.grad.val = 1.0; x.g1 = 1.0f; }
+            if (mode == 1) { x_ref.val.grad = 1.0; x.g2 = 1.0f; }
+            if (mode == 0 || mode == 2) { y_ref.val.grad = 1.0; y.g2 = 1.0f; }
+            if (mode == 2) { y_ref.grad.val = 1.0; y.g1 = 1.0f; }
+
+            dual2nd u_ref = f(x_ref, y_ref);
+            dval2 u = f(x, y);
+
+            REQUIRE(fabs(u_ref.val.val - u.v) < 1.0e-5 * (1.0 + fabs(u_ref.val.val)));
+            REQUIRE(fabs(u_ref.grad.val - u.g1) < 1.0e-4 * (1.0 + fabs(u_ref.grad.val)));
+            REQUIRE(fabs(u_ref.val.grad - u.g2) < 1.0e-4 * (1.0 + fabs(u_ref.val.grad)));
+            REQUIRE(fabs(u_ref.grad.grad - u.g12) < 1.0e-3 * (1.0 + fabs(u_ref.grad.grad)));
+        }
+    }
+}
+
+TEST_CASE("dval2", "") {
+    check_second_order([](auto x, auto y) -> decltype(x) { return x * y * x + 1.0f; }, -2.0f, 2.0f, -2.0f, 2.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return x / y - y / x; }, 1.0f, 2.0f, 1.0f, 2.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return exp(x * y) + log(x + y); }, 0.1f, 1.0f, 0.1f, 1.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return sqrt(x * x + y) * sin(x) - cos(x * y); }, -2.0f, 2.0f, 0.1f, 2.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return tanh(x - y) + atan2(y, x); }, -2.0f, 2.0f, -2.0f, 2.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return pow(x, y) + pow(y, 3.0f); }, 0.1f, 3.0f, -2.0f, 2.0f);
+    check_second_order([](auto x, auto y) -> decltype(x) { return 1.0f / sqrt(x * x + y * y); }, 0.5f, 2.0f, 0.5f, 2.0f);
+
+    // dval2_3 against the same computation written on scalars
+    check_second_order([](auto x, auto y) -> decltype(x) {
+        using S = decltype(x);
+        S nx = x * y, ny = x + y, nz = S(1.0f);
+        S len = sqrt(nx * nx + ny * ny + nz * nz);
+        S r = -x * nx + y * ny + nz;
+        return r / len;
+    }, 0.5f, 2.0f, 0.5f, 2.0f);
+    pr::PCG rng;
+    for (int i = 0; i < 1000; i++)
+    {
+        dval2 x = 0.5f + rng.uniformf(); x.requires_grad();
+        dval2 y = 0.5f + rng.uniformf();
+        dval2_3 n = normalize(dval2_3{ x * y, x + y, 1.0f });
+        dval2 r = dot(dval2_3{ -x, y, 1.0f }, n);
+
+        dual2nd x_ref = x.v; x_ref.grad.val = 1.0; x_ref.val.grad = 1.0;
+        dual2nd y_ref = y.v;
+        dual2nd nx = x_ref * y_ref, ny = x_ref + y_ref, nz = 1.0;
+        dual2nd r_ref = (-x_ref * nx + y_ref * ny + nz) / sqrt(nx * nx + ny * ny + nz * nz);
+        REQUIRE(fabs(r_ref.grad.val - r.g1) < 1.0e-4);
+        REQUIRE(fabs(r_ref.grad.grad - r.g12) < 1.0e-3);
+    }
+}
+
+TEST_CASE("work_stealing_pool", "") {
+    WorkStealingPool pool(4);
+    for (int batch = 0; batch < 100; batch++)
+    {
+        int count = 1 + batch * 7;
+        // Catch assertions are not thread safe, so the tasks only record and the checks run here
+        std::vector<std::atomic<int>> visits(count);
+        std::vector<int> workers(count, -1);
+        pool.run(count, [&](int i, int worker) {
+            workers[i] = worker;
+            visits[i]++;
+        });
+        for (int i = 0; i < count; i++)
+        {
+            REQUIRE(visits[i] == 1);
+            REQUIRE(0 <= workers[i]);
+            REQUIRE(workers[i] < 4);
+        }
+    }
+}
+
+TEST_CASE("tracer", "") {
+    // the tangent image against central differences of the same paths. Pixels whose paths change visibility within h
+    // have no meaningful difference quotient, so only most of the pixels are required to agree.
+    for (TracerParameter parameter : { TracerParameter::BoxOffset, TracerParameter::LightHeight })
+    {
+        float value = parameter == TracerParameter::BoxOffset ? 0.1f : 1.6f;
+        float h = 1.0e-3f;
+        TracerScene scene(parameter, value);
+        TracerScene scene_p(parameter, value + h);
+        TracerScene scene_m(parameter, value - h);
+        TracerCamera camera;
+
+        int w = 24, hgt = 24;
+        int agree = 0;
+        for (int y = 0; y < hgt; y++)
+        for (int x = 0; x < w; x++)
+        {
+            dval3 ro = { camera.origin[0], camera.origin[1], camera.origin[2] };
+            dval3 rd = camera_ray(camera, w, hgt, x + 0.5f, y + 0.5f);
+            uint64_t seed = y * w + x;
+            dval3 L = trace_path(scene, ro, rd, seed, 3);
+            dval3 Lp = trace_path(scene_p, ro, rd, seed, 3);
+            dval3 Lm = trace_path(scene_m, ro, rd, seed, 3);
+            float fd = (Lp.x.v - Lm.x.v) / (2.0f * h);
+            if (fabs(fd - L.x.g) < 0.02f + fabs(fd) * 0.05f)
+            {
+                agree++;
+            }
+        }
+        REQUIRE(w * hgt * 0.9f < agree);
+    }
+
+    // the progressive renderer converges to a finished, non-empty image
+    Tracer tracer(2);
+    Tracer::Settings settings;
+    settings.width = 32;
+    settings.height = 32;
+    tracer.setup(settings);
+
+    std::vector<float> primal, tangent;
+    int width = 0, height = 0, samples = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (samples < 2 && std::chrono::steady_clock::now() < deadline)
+    {
+        tracer.fetch(&primal, &tangent, &width, &height, &samples);
+        std::this_thread::yield();
+    }
+    REQUIRE(2 <= samples);
+    REQUIRE(width == 32);
+    REQUIRE(primal.size() == 32 * 32 * 3);
+    float sum = 0.0f;
+    for (float v : primal)
+    {
+        sum += v;
+    }
+    REQUIRE(0.0f < sum);
+}
+
+TEST_CASE("optimize", "") {
+    // a shifted quadratic bowl with a unit minimum at (1, -2, 3)
+    auto bowl = [](const dval* x) {
+        dval a = x[0] - 1.0f;
+        dval b = x[1] + 2.0f;
+        dval c = x[2] - 3.0f;
+        return a * a + b * b * 4.0f + c * c + 1.0f;
+    };
+    Objective bowlObjective = make_objective_dval(bowl, 3);
+    {
+        float x[3] = {};
+        Adam adam(3, { 0.1f });
+        for (int i = 0; i < 2000; i++)
+        {
+            adam.step(x, bowlObjective);
+        }
+        REQUIRE(fabs(x[0] - 1.0f) < 1.0e-3f);
+        REQUIRE(fabs(x[1] + 2.0f) < 1.0e-3f);
+        REQUIRE(fabs(x[2] - 3.0f) < 1.0e-3f);
+    }
+    {
+        float x[3] = {};
+        SGDMomentum sgd(3, { 0.02f, 0.9f });
+        float loss = 0.0f;
+        for (int i = 0; i < 500; i++)
+        {
+            loss = sgd.step(x, bowlObjective);
+        }
+        REQUIRE(fabs(loss - 1.0f) < 1.0e-5f);
+        REQUIRE(fabs(x[1] + 2.0f) < 1.0e-3f);
+    }
+
+    // Rosenbrock in reverse mode against forward mode gradients
+    auto rosenbrock = [](auto x) -> typename std::remove_const<typename std::remove_reference<decltype(x[0])>::type>::type {
+        auto a = 1.0f - x[0];
+        auto b = x[1] - x[0] * x[0];
+        return a * a + b * b * 100.0f;
+    };
+    Objective viaValRef = make_objective_valref([&](const ValRef* x) { return rosenbrock(x); }, 2);
+    Objective viaDval = make_objective_dval([&](const dval* x) { return rosenbrock(x); }, 2);
+    {
+        float x[2] = { -1.2f, 1.0f };
+        float g0[2], g1[2];
+        float f0 = viaValRef(x, g0);
+        float f1 = viaDval(x, g1);
+        REQUIRE(fabs(f0 - f1) < 1.0e-4f);
+        REQUIRE(fabs(g0[0] - g1[0]) < 1.0e-3f);
+        REQUIRE(fabs(g0[1] - g1[1]) < 1.0e-3f);
+    }
+    {
+        float x[2] = { -1.2f, 1.0f };
+        LBFGS lbfgs(2);
+        float loss = 0.0f;
+        for (int i = 0; i < 100; i++)
+        {
+            loss = lbfgs.step(x, viaValRef);
+        }
+        REQUIRE(loss < 1.0e-6f);
+        REQUIRE(fabs(x[0] - 1.0f) < 1.0e-2f);
+        REQUIRE(fabs(x[1] - 1.0f) < 1.0e-2f);
+    }
+
+    // L-BFGS on a badly scaled quadratic over many parameters
+    {
+        int n = 1000;
+        Objective quadratic = [n](const float* x, float* grad) {
+            double loss = 0.0;
+            for (int i = 0; i < n; i++)
+            {
+                float scale = 1.0f + i % 100;
+                float d = x[i] - 0.5f;
+                loss += scale * d * d;
+                grad[i] = 2.0f * scale * d;
+            }
+            return (float)loss;
+        };
+        std::vector<float> x(n, 0.0f);
+        LBFGS lbfgs(n);
+        for (int i = 0; i < 200; i++)
+        {
+            lbfgs.step(x.data(), quadratic);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            REQUIRE(fabs(x[i] - 0.5f) < 1.0e-3f);
+        }
+    }
+}
+
+TEST_CASE("grad_buffer", "") {
+    // many threads scattering forward mode tangents into a few thousand parameters
+    WorkStealingPool pool(4);
+    int size = 5000;
+    int samples = 256;
+    grad_buffer buffer(size, pool.threadCount());
+    pool.run(samples, [&](int sample, int worker) {
+        std::mt19937 rng(sample);
+        for (int i = 0; i < 1000; i++)
+        {
+            dval x = std::generate_canonical<float, 24>(rng); x.requires_grad();
+            dval y = sin(x * 3.0f);
+            buffer.add(worker, rng() % size, y.g);
+        }
+    });
+
+    std::vector<double> expected(size, 0.0);
+    for (int sample = 0; sample < samples; sample++)
+    {
+        std::mt19937 rng(sample);
+        for (int i = 0; i < 1000; i++)
+        {
+            float x = std::generate_canonical<float, 24>(rng);
+            expected[rng() % size] += 3.0f * std::cos(x * 3.0f);
+        }
+    }
+    std::vector<float> reduced(size);
+    std::vector<float> serial(size);
+    buffer.reduce(reduced.data(), &pool);
+    buffer.reduce(serial.data());
+    for (int i = 0; i < size; i++)
+    {
+        REQUIRE(fabs(reduced[i] - expected[i]) < 1.0e-3);
+        REQUIRE(reduced[i] == serial[i]);
+    }
+
+    buffer.clear(&pool);
+    buffer.reduce(reduced.data(), &pool);
+    REQUIRE(std::all_of(reduced.begin(), reduced.end(), [](float v) { return v == 0.0f; }));
+
+    // Kahan keeps the small contributions a plain float sum drops
+    {
+        grad_buffer plain(1, 1);
+        grad_buffer compensated(1, 1, true);
+        plain.add(0, 0, 1.0f);
+        compensated.add(0, 0, 1.0f);
+        for (int i = 0; i < 100000; i++)
+        {
+            plain.add(0, 0, 1.0e-8f);
+            compensated.add(0, 0, 1.0e-8f);
+        }
+        float a, b;
+        plain.reduce(&a);
+        compensated.reduce(&b);
+        REQUIRE(a == 1.0f);
+        REQUIRE(fabs(b - 1.001f) < 1.0e-6f);
+    }
+
+    // ValRef leaves after backward()
+    {
+        grad_buffer g(3, 1);
+        ValRef xs[2] = { ValRef(2.0f), ValRef(3.0f) };
+        ValRef y = xs[0] * xs[1];
+        y.backward();
+        int indices[2] = { 2, 0 };
+        g.add(0, xs, indices, 2);
+        float out[3];
+        g.reduce(out);
+        REQUIRE(out[0] == 2.0f);
+        REQUIRE(out[1] == 0.0f);
+        REQUIRE(out[2] == 3.0f);
+    }
+}
+
+TEST_CASE("lens", "") {
+    // a cemented doublet with an aspheric front and the image plane 90 behind the last vertex
+    LensSystem lens;
+    {
+        LensSurface s;
+        s.curvature = 1.0f / 60.0f; s.thickness = 6.0f; s.ior = 1.52f; s.conic = -0.5f; s.a4 = 1.0e-7f; s.aperture = 12.0f;
+        lens.surfaces.push_back(s);
+        s = LensSurface();
+        s.curvature = -1.0f / 45.0f; s.thickness = 2.5f; s.ior = 1.72f;
+        lens.surfaces.push_back(s);
+        s = LensSurface();
+        s.curvature = -1.0f / 200.0f; s.thickness = 90.0f; s.ior = 1.0f;
+        lens.surfaces.push_back(s);
+    }
+    LensRays rays;
+    for (int i = 0; i < 200; i++)
+    {
+        float r = 8.0f * std::sqrt((i + 0.5f) / 200.0f);
+        float phi = i * 2.39996f;
+        rays.push(r * std::cos(phi), r * std::sin(phi), -10.0f, 0.0f, 0.05f, 1.0f);
+    }
+
+    WorkStealingPool pool(4);
+    LensSpots spots;
+    lens.trace(rays, &spots, &pool);
+    REQUIRE(spots.parameterCount == 9);
+    LensSpots serial;
+    lens.trace(rays, &serial);
+    REQUIRE(spots.x == serial.x);
+    REQUIRE(spots.dxdp == serial.dxdp);
+
+    // the Jacobian against central differences
+    for (int p = 0; p < lens.parameterCount(); p++)
+    {
+        int kind = p % LensSystem::PARAMETERS_PER_SURFACE;
+        float h = kind == LensSystem::CURVATURE ? 1.0e-4f : kind == LensSystem::THICKNESS ? 1.0e-2f : 1.0e-3f;
+        auto perturbed = [&](float sign) {
+            LensSystem l = lens;
+            LensSurface& s = l.surfaces[p / LensSystem::PARAMETERS_PER_SURFACE];
+            float* value = kind == LensSystem::CURVATURE ? &s.curvature : kind == LensSystem::THICKNESS ? &s.thickness : &s.ior;
+            *value += sign * h;
+            LensSpots r;
+            l.trace(rays, &r);
+            return r;
+        };
+        LensSpots plus = perturbed(1.0f);
+        LensSpots minus = perturbed(-1.0f);
+        for (int i = 0; i < rays.size(); i++)
+        {
+            if (!spots.valid[i] || !plus.valid[i] || !minus.valid[i])
+            {
+                continue;
+            }
+            float fdx = (plus.x[i] - minus.x[i]) / (2.0f * h);
+            float fdy = (plus.y[i] - minus.y[i]) / (2.0f * h);
+            REQUIRE(fabs(fdx - spots.dxdp[i * 9 + p]) < 2.0e-2f + fabs(fdx) * 1.0e-2f);
+            REQUIRE(fabs(fdy - spots.dydp[i * 9 + p]) < 2.0e-2f + fabs(fdy) * 1.0e-2f);
+        }
+    }
+
+    // focusing a plano-convex singlet by its back focal distance. The paraxial one is f (1 - (n - 1) t / (n R)).
+    {
+        LensSystem singlet;
+        LensSurface s;
+        s.curvature = 1.0f / 50.0f; s.thickness = 5.0f; s.ior = 1.5f;
+        singlet.surfaces.push_back(s);
+        s = LensSurface();
+        s.thickness = 80.0f;
+        singlet.surfaces.push_back(s);
+
+        LensRays bundle;
+        for (int i = 0; i < 64; i++)
+        {
+            float r = 1.0f * (i + 0.5f) / 64.0f;
+            bundle.push(r, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f);
+        }
+        int focus = LensSystem::parameterIndex(1, LensSystem::THICKNESS);
+        LensSpots focused;
+        std::vector<float> gradient(singlet.parameterCount());
+        Objective spotSize = [&](const float* x, float* grad) {
+            singlet.surfaces[1].thickness = x[0];
+            singlet.trace(bundle, &focused, &pool);
+            float rms = LensSystem::rmsSpotSize(focused, gradient.data());
+            grad[0] = gradient[focus];
+            return rms;
+        };
+        float x = 80.0f;
+        LBFGS lbfgs(1);
+        for (int i = 0; i < 50; i++)
+        {
+            lbfgs.step(&x, spotSize);
+        }
+        float paraxial = 100.0f * (1.0f - 0.5f * 5.0f / (1.5f * 50.0f));
+        REQUIRE(fabs(x - paraxial) < 0.05f);
+    }
+}
+
+TEST_CASE("specular_manifold", "") {
+    // block elimination against a dense solve
+    pr::PCG rng;
+    for (int n = 1; n <= SpecularManifoldSolver::MAX_VERTICES; n++)
+    {
+        Block2 lower[8], diagonal[8], upper[8];
+        float rhs[8][2], x[8][2];
+        float dense[16][17] = {};
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                lower[i].m[j] = rng.uniformf() - 0.5f;
+                upper[i].m[j] = rng.uniformf() - 0.5f;
+                diagonal[i].m[j] = rng.uniformf() - 0.5f + (j == 0 || j == 3 ? 3.0f : 0.0f);
+            }
+            rhs[i][0] = rng.uniformf();
+            rhs[i][1] = rng.uniformf();
+            for (int r = 0; r < 2; r++)
+            {
+                for (int c = 0; c < 2; c++)
+                {
+                    if (0 < i) dense[i * 2 + r][(i - 1) * 2 + c] = lower[i].m[r * 2 + c];
+                    dense[i * 2 + r][i * 2 + c] = diagonal[i].m[r * 2 + c];
+                    if (i + 1 < n) dense[i * 2 + r][(i + 1) * 2 + c] = upper[i].m[r * 2 + c];
+                }
+                dense[i * 2 + r][n * 2] = rhs[i][r];
+            }
+        }
+        REQUIRE(details::solve_block_tridiagonal(n, lower, diagonal, upper, rhs, x));
+
+        int m = n * 2;
+        for (int c = 0; c < m; c++)
+        {
+            for (int r = c + 1; r < m; r++)
+            {
+                float f = dense[r][c] / dense[c][c];
+                for (int j = c; j <= m; j++)
+                {
+                    dense[r][j] -= f * dense[c][j];
+                }
+            }
+        }
+        float ref[16];
+        for (int r = m - 1; 0 <= r; r--)
+        {
+            float s = dense[r][m];
+            for (int j = r + 1; j < m; j++)
+            {
+                s -= dense[r][j] * ref[j];
+            }
+            ref[r] = s / dense[r][r];
+        }
+        for (int i = 0; i < m; i++)
+        {
+            REQUIRE(fabs(x[i / 2][i % 2] - ref[i]) < 1.0e-4f);
+        }
+    }
+
+    // a flat mirror reflects at the midpoint
+    {
+        SpecularManifoldSolver solver;
+        solver.chain.push_back(SpecularSurface());
+        SpecularManifoldSolver::Batch batch;
+        batch.start = { -1.0f, 0.0f, 1.0f };
+        batch.end = { 1.0f, 0.0f, 1.0f };
+        batch.uv = { 0.3f, -0.2f };
+        solver.solve(&batch);
+        REQUIRE(batch.converged[0]);
+        REQUIRE(fabs(batch.uv[0]) < 1.0e-4f);
+        REQUIRE(fabs(batch.uv[1]) < 1.0e-4f);
+    }
+
+    // Snell's law through a flat interface into water
+    {
+        SpecularManifoldSolver solver;
+        SpecularSurface water;
+        water.eta = 1.33f;
+        solver.chain.push_back(water);
+        SpecularManifoldSolver::Batch batch;
+        batch.start = { 0.0f, 0.0f, 1.0f };
+        batch.end = { 1.5f, 0.0f, -1.0f };
+        batch.uv = { 0.5f, 0.0f };
+        solver.solve(&batch);
+        REQUIRE(batch.converged[0]);
+        float x = batch.uv[0];
+        float sin1 = x / std::sqrt(x * x + 1.0f);
+        float sin2 = (1.5f - x) / std::sqrt((1.5f - x) * (1.5f - x) + 1.0f);
+        REQUIRE(fabs(sin1 - 1.33f * sin2) < 1.0e-4f);
+    }
+
+    // caustics under a wavy water surface, reflected once by a wavy floor and seen through the surface again
+    {
+        SpecularManifoldSolver solver;
+        SpecularSurface surface;
+        surface.height = 1.0f;
+        surface.amplitude = 0.03f;
+        surface.frequency[0] = 3.0f;
+        surface.frequency[1] = 2.0f;
+        surface.eta = 1.33f;
+        SpecularSurface floor;
+        floor.amplitude = 0.02f;
+        floor.frequency[0] = 2.5f;
+        floor.phase[1] = 0.7f;
+        solver.chain = { surface, floor, surface };
+
+        SpecularManifoldSolver::Batch batch;
+        int lanes = 1000;
+        for (int i = 0; i < lanes; i++)
+        {
+            float ox = rng.uniformf() - 0.5f;
+            float oy = rng.uniformf() - 0.5f;
+            float ex = rng.uniformf() - 0.5f;
+            float ey = rng.uniformf() - 0.5f;
+            batch.start.insert(batch.start.end(), { ox, oy, 3.0f });
+            batch.end.insert(batch.end.end(), { ex, ey, 3.0f });
+            // straight line guesses
+            float mx = (ox + ex) * 0.5f;
+            float my = (oy + ey) * 0.5f;
+            batch.uv.insert(batch.uv.end(), { (ox + mx) * 0.5f, (oy + my) * 0.5f, mx, my, (ex + mx) * 0.5f, (ey + my) * 0.5f });
+        }
+        SpecularManifoldSolver::Batch serial = batch;
+
+        WorkStealingPool pool(4);
+        long long iterations = solver.solve(&batch, &pool);
+        solver.solve(&serial);
+        REQUIRE(batch.uv == serial.uv);
+
+        int converged = 0;
+        int maxIterations = 0;
+        long long sum = 0;
+        for (int i = 0; i < lanes; i++)
+        {
+            if (batch.converged[i])
+            {
+                converged++;
+                REQUIRE(solver.residual(batch, i) < solver.tolerance);
+            }
+            maxIterations = std::max(maxIterations, batch.iterations[i]);
+            sum += batch.iterations[i];
+        }
+        REQUIRE(lanes * 0.95f < converged);
+
+        // lanes stop costing work once they are done
+        REQUIRE(iterations == sum);
+        REQUIRE(iterations < (long long)maxIterations * lanes);
+    }
+}
+
+namespace bsdf_ref
+{
+    const double pi = 3.14159265358979;
+    dual ggx_d(dual a, dual c)
+    {
+        dual d = c * c * (a * a - 1.0) + 1.0;
+        return a * a / (pi * d * d);
+    }
+    dual lambda_r(dual a, dual c)
+    {
+        return sqrt(a * a + (1.0 - a * a) * c * c);
+    }
+    dual smith_g1(dual a, dual c)
+    {
+        return 2.0 * c / (c + lambda_r(a, c));
+    }
+    dual smith_g2(dual a, dual l, dual v)
+    {
+        return 2.0 * l * v / (v * lambda_r(a, l) + l * lambda_r(a, v));
+    }
+    dual fresnel_dielectric(dual c, dual eta)
+    {
+        dual ct = sqrt(1.0 - (1.0 - c * c) / (eta * eta));
+        dual rs = (c - eta * ct) / (c + eta * ct);
+        dual rp = (eta * c - ct) / (eta * c + ct);
+        return 0.5 * (rs * rs + rp * rp);
+    }
+    dual fresnel_conductor(dual c, dual eta, dual k)
+    {
+        dual s2 = 1.0 - c * c;
+        dual A = eta * eta - k * k - s2;
+        dual t = sqrt(A * A + 4.0 * eta * eta * k * k);
+        dual a = sqrt(0.5 * (t + A));
+        dual rs = (t - 2.0 * a * c + c * c) / (t + 2.0 * a * c + c * c);
+        dual rp = rs * (c * c * t - 2.0 * a * c * s2 + s2 * s2) / (c * c * t + 2.0 * a * c * s2 + s2 * s2);
+        return 0.5 * (rs + rp);
+    }
+}
+
+// a dval with a random tangent and the dual seeded the same way
+dval seeded(pr::PCG& rng, float lo, float hi, dual* ref)
+{
+    dval x = lo + (hi - lo) * rng.uniformf();
+    x.g = -1.0f + 2.0f * rng.uniformf();
+    *ref = x.v;
+    ref->grad = x.g;
+    return x;
+}
+
+TEST_CASE("bsdf", "") {
+    pr::PCG rng;
+    auto close = [](dual ref, dval x, double eps = 1.0e-4) {
+        REQUIRE(fabs(ref.val - x.v) < eps * (1.0 + fabs(ref.val)));
+        REQUIRE(fabs(ref.grad - x.g) < 10.0 * eps * (1.0 + fabs(ref.grad)));
+    };
+    for (int i = 0; i < 1000; i++)
+    {
+        dual a_ref, c_ref, l_ref, eta_ref, k_ref;
+        dval a = seeded(rng, 0.05f, 1.0f, &a_ref);
+        dval c = seeded(rng, 0.05f, 1.0f, &c_ref);
+        dval l = seeded(rng, 0.05f, 1.0f, &l_ref);
+        dval eta = seeded(rng, 0.4f, 2.5f, &eta_ref);
+        dval k = seeded(rng, 0.0f, 5.0f, &k_ref);
+
+        close(bsdf_ref::ggx_d(a_ref, c_ref), ggx_d(a, c));
+        close(bsdf_ref::smith_g1(a_ref, c_ref), smith_g1(a, c));
+        close(bsdf_ref::smith_g2(a_ref, l_ref, c_ref), smith_g2(a, l, c));
+        close(bsdf_ref::fresnel_conductor(c_ref, eta_ref, k_ref), fresnel_conductor(c, eta, k));
+        if ((1.0f - c.v * c.v) / (eta.v * eta.v) < 0.99f)
+        {
+            close(bsdf_ref::fresnel_dielectric(c_ref, eta_ref), fresnel_dielectric(c, eta));
+        }
+        else if (1.0f <= (1.0f - c.v * c.v) / (eta.v * eta.v))
+        {
+            REQUIRE(fresnel_dielectric(c, eta).v == 1.0f);
+        }
+    }
+
+    // the fused terms compose into the same BRDF as the primitives, and the BRDF is reciprocal
+    for (int i = 0; i < 1000; i++)
+    {
+        auto direction = [&]() {
+            float z = 0.05f + 0.95f * rng.uniformf();
+            float phi = 6.2831853f * rng.uniformf();
+            float r = std::sqrt(1.0f - z * z);
+            return dval3{ r * std::cos(phi), r * std::sin(phi), z };
+        };
+        dval3 wi = direction();
+        dval3 wo = direction();
+        dval3 n = { 0.0f, 0.0f, 1.0f };
+        dval alpha = 0.1f + 0.8f * rng.uniformf(); alpha.requires_grad();
+        dval eta = 0.2f + rng.uniformf();
+        dval k = 1.0f + 3.0f * rng.uniformf();
+
+        dval f = ggx_conductor_brdf(wi, wo, n, alpha, eta, k);
+        REQUIRE(fabs(f.v - ggx_conductor_brdf(wo, wi, n, alpha, eta, k).v) < 1.0e-4f * (1.0f + f.v));
+
+        // The half vector comes from the same normalize, so under SAKA_FAST_MATH the reference sees the same rsqrt.
+        // Otherwise its relative error of 4.8e-6 is amplified about 4 / alpha^2 times by D near the peak.
+        dual a_ref = alpha.v; a_ref.grad = 1.0;
+        dual eta_ref = eta.v, k_ref = k.v;
+        dval3 h = normalize(wi + wo);
+        dual f_ref = bsdf_ref::ggx_d(a_ref, h.z.v) * bsdf_ref::smith_g2(a_ref, wi.z.v, wo.z.v) *
+            bsdf_ref::fresnel_conductor(dot(h, wi).v, eta_ref, k_ref) / (4.0 * wi.z.v * wo.z.v);
+        close(f_ref, f);
+    }
+
+    // the rough dielectric: energy of reflection and transmission for a smooth-ish surface, and the eta tangent against differences
+    for (int i = 0; i < 200; i++)
+    {
+        dval3 n = { 0.0f, 0.0f, 1.0f };
+        float z = 0.2f + 0.8f * rng.uniformf();
+        dval3 wi = { std::sqrt(1.0f - z * z), 0.0f, rng.uniformf() < 0.5f ? z : -z };
+        dval alpha = 0.2f + 0.5f * rng.uniformf();
+        dval eta = 1.3f + 0.5f * rng.uniformf(); eta.requires_grad();
+        bool tir;
+        dval3 wo = sample_ggx_refraction(wi, n, alpha, eta, rng.uniformf(), rng.uniformf(), &tir);
+        if (tir)
+        {
+            continue;
+        }
+        REQUIRE(fabs(dot(wo, wo).v - 1.0f) < 1.0e-4f);
+        if (0.0f <= dot(wi, n).v * dot(wo, n).v)
+        {
+            continue; // refracted through a steep microfacet back to the side of wi, a rejected sample
+        }
+
+        dval3 woFixed = { wo.x.v, wo.y.v, wo.z.v };
+        dval f = ggx_dielectric_bsdf(wi, woFixed, n, alpha, eta);
+        float h = 1.0e-3f;
+        float fp = ggx_dielectric_bsdf(wi, woFixed, n, alpha, eta.v + h).v;
+        float fm = ggx_dielectric_bsdf(wi, woFixed, n, alpha, eta.v - h).v;
+        if (0.0f < f.v && 0.0f < fp && 0.0f < fm)
+        {
+            float fd = (fp - fm) / (2.0f * h);
+            REQUIRE(fabs(fd - f.g) < 2.0e-2f * (1.0f + fabs(fd)));
+        }
+    }
+
+    // batched evaluation matches the single sample one
+    {
+        float wix[4] = { 0.0f, 0.3f, -0.5f, 0.1f }, wiy[4] = { 0.0f, 0.1f, 0.2f, -0.6f }, wiz[4];
+        float wox[4] = { 0.2f, -0.4f, 0.0f, 0.3f }, woy[4] = { 0.1f, 0.0f, 0.5f, 0.3f }, woz[4];
+        for (int i = 0; i < 4; i++)
+        {
+            wiz[i] = std::sqrt(1.0f - wix[i] * wix[i] - wiy[i] * wiy[i]);
+            woz[i] = std::sqrt(1.0f - wox[i] * wox[i] - woy[i] * woy[i]);
+        }
+        BsdfSamples samples = { wix, wiy, wiz, wox, woy, woz, 4 };
+        dval alpha = 0.3f; alpha.requires_grad();
+        float value[4], tangent[4];
+        ggx_conductor_brdf(samples, alpha, 0.2f, 3.0f, value, tangent);
+        for (int i = 0; i < 4; i++)
+        {
+            dval f = ggx_conductor_brdf({ wix[i], wiy[i], wiz[i] }, { wox[i], woy[i], woz[i] }, { 0.0f, 0.0f, 1.0f }, alpha, 0.2f, 3.0f);
+            REQUIRE(value[i] == f.v);
+            REQUIRE(tangent[i] == f.g);
+        }
+    }
+}
+
+TEST_CASE("texture", "") {
+    std::mt19937 rng(11);
+    auto uniform = [&]() { return std::generate_canonical<float, 24>(rng); };
+
+    for (TextureWrap wrap : { TextureWrap::Repeat, TextureWrap::Clamp })
+    {
+        const int w = 21, h = 13; // partial tiles on both axes
+        std::vector<float> linear(w * h * 3);
+        for (float& x : linear)
+        {
+            x = uniform();
+        }
+        Texture tex(w, h, wrap);
+        tex.fromLinear(linear.data());
+        std::vector<float> back(linear.size());
+        tex.toLinear(back.data());
+        REQUIRE(back == linear);
+
+        // the value against a bilinear lookup on the row major image
+        auto reference = [&](float u, float v, int c) {
+            float x = u * w - 0.5f, y = v * h - 0.5f;
+            int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+            float fx = x - x0, fy = y - y0;
+            auto at = [&](int i, int j) { return linear[(tex.wrapY(j) * w + tex.wrapX(i)) * 3 + c]; };
+            return (at(x0, y0) * (1 - fx) + at(x0 + 1, y0) * fx) * (1 - fy) + (at(x0, y0 + 1) * (1 - fx) + at(x0 + 1, y0 + 1) * fx) * fy;
+        };
+
+        Texture tangent(w, h, wrap);
+        for (int i = 0; i < tangent.size(); i++)
+        {
+            tangent.data()[i] = uniform() - 0.5f;
+        }
+        grad_buffer gradients(tex.size(), 1);
+        for (int i = 0; i < 500; i++)
+        {
+            dval u = -0.5f + 2.0f * uniform();
+            dval v = -0.5f + 2.0f * uniform();
+            u.g = uniform() - 0.5f;
+            v.g = uniform() - 0.5f;
+            dval3 c = sample(tex, u, v);
+            REQUIRE(fabs(c.x.v - reference(u.v, v.v, 0)) < 1.0e-5f);
+            REQUIRE(fabs(c.y.v - reference(u.v, v.v, 1)) < 1.0e-5f);
+            REQUIRE(fabs(c.z.v - reference(u.v, v.v, 2)) < 1.0e-5f);
+
+            // the uv tangent against central differences, inside one footprint
+            float e = 1.0e-4f;
+            float ru = reference(u.v + e * u.g, v.v + e * v.g, 0);
+            float rl = reference(u.v - e * u.g, v.v - e * v.g, 0);
+            float fx = u.v * w - 0.5f, fy = v.v * h - 0.5f;
+            bool inside = std::floor(fx + 0.05f) == std::floor(fx - 0.05f) && std::floor(fy + 0.05f) == std::floor(fy - 0.05f);
+            if (inside)
+            {
+                REQUIRE(fabs((ru - rl) / (2.0f * e) - c.x.g) < 1.0e-2f * (1.0f + fabs(c.x.g)));
+            }
+
+            // reverse mode is the transpose of forward mode: a^T (J_uv t_uv + J_tex t_tex) = (J^T a) . t
+            float adjoint[3] = { uniform() - 0.5f, uniform() - 0.5f, uniform() - 0.5f };
+            dval3 ct = sample(tex, tangent, u, v);
+            float forward = adjoint[0] * ct.x.g + adjoint[1] * ct.y.g + adjoint[2] * ct.z.g;
+            gradients.clear();
+            float du, dv;
+            sample_backward(tex, u.v, v.v, adjoint, &gradients, 0, &du, &dv);
+            std::vector<float> g(tex.size());
+            gradients.reduce(g.data());
+            double reverse = du * u.g + dv * v.g;
+            for (int j = 0; j < tex.size(); j++)
+            {
+                reverse += (double)g[j] * tangent.data()[j];
+            }
+            REQUIRE(fabs(forward - reverse) < 1.0e-4f * (1.0f + fabs(forward)));
+        }
+    }
+
+    // batched reverse mode on the pool agrees with the serial one
+    {
+        Texture tex(64, 48);
+        for (int i = 0; i < tex.size(); i++)
+        {
+            tex.data()[i] = uniform();
+        }
+        const int n = 20000;
+        std::vector<float> u(n), v(n), adjoints(n * 3);
+        for (int i = 0; i < n; i++)
+        {
+            u[i] = uniform();
+            v[i] = uniform();
+        }
+        for (float& a : adjoints)
+        {
+            a = uniform() - 0.5f;
+        }
+        WorkStealingPool pool(4);
+        grad_buffer serialShards(tex.size(), 1), parallelShards(tex.size(), pool.threadCount());
+        std::vector<float> serial(tex.size()), parallel(tex.size()), du(n), dv(n), du1(n), dv1(n);
+        sample_backward(tex, u.data(), v.data(), adjoints.data(), n, &serialShards, serial.data(), du.data(), dv.data());
+        sample_backward(tex, u.data(), v.data(), adjoints.data(), n, &parallelShards, parallel.data(), du1.data(), dv1.data(), &pool);
+        for (int i = 0; i < tex.size(); i++)
+        {
+            REQUIRE(fabs(serial[i] - parallel[i]) < 1.0e-4f);
+        }
+        REQUIRE(du == du1);
+        REQUIRE(dv == dv1);
+    }
+}
+
+TEST_CASE("wavefront", "") {
+    // the wavefront renders the same pass as trace_path() per pixel, for diffuse and glass boxes and waves smaller than the image
+    WorkStealingPool pool(3);
+    const int w = 24, h = 18, maxDepth = 4;
+    TracerCamera camera;
+    for (bool glass : { false, true })
+    {
+        TracerScene scene(TracerParameter::BoxOffset, 0.1f, glass);
+        std::vector<float> primal(w * h * 3, 0.0f), tangent(w * h * 3, 0.0f);
+        WavefrontTracer wavefront(&pool, 100);
+        for (int sample = 0; sample < 2; sample++)
+        {
+            wavefront.render(scene, camera, w, h, sample, maxDepth, primal.data(), tangent.data());
+        }
+        REQUIRE(wavefront.stats().rays[WavefrontStats::GENERATE] == w * h);
+        REQUIRE(wavefront.stats().rays[WavefrontStats::SORT] == 0);
+
+        // sorting reorders the work, the image stays the same to the bit
+        std::vector<float> sortedPrimal(w * h * 3, 0.0f), sortedTangent(w * h * 3, 0.0f);
+        WavefrontTracer sorted(&pool, 100);
+        sorted.setSortBounces(0xFFFFFFFEu);
+        for (int sample = 0; sample < 2; sample++)
+        {
+            sorted.render(scene, camera, w, h, sample, maxDepth, sortedPrimal.data(), sortedTangent.data());
+        }
+        REQUIRE(sortedPrimal == primal);
+        REQUIRE(sortedTangent == tangent);
+        REQUIRE(0 < sorted.stats().rays[WavefrontStats::SORT]);
+        REQUIRE(sorted.stats().bounceSeconds[0][WavefrontStats::SORT] == 0.0);
+        REQUIRE(0 < wavefront.stats().rays[WavefrontStats::DIFFUSE]);
+        REQUIRE((0 < wavefront.stats().rays[WavefrontStats::DIELECTRIC]) == glass);
+
+        for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            float v[3] = {}, g[3] = {};
+            for (int sample = 0; sample < 2; sample++)
+            {
+                dval3 ro, rd;
+                uint64_t seed = pixel_sample(camera, w, h, x, y, sample, &ro, &rd);
+                dval3 L = trace_path(scene, ro, rd, seed, maxDepth);
+                v[0] += L.x.v; v[1] += L.y.v; v[2] += L.z.v;
+                g[0] += L.x.g; g[1] += L.y.g; g[2] += L.z.g;
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                REQUIRE(primal[(y * w + x) * 3 + c] == v[c]);
+                REQUIRE(tangent[(y * w + x) * 3 + c] == g[c]);
+            }
+        }
+    }
+
+    // glass: the tangent of a pixel seen through the box against central differences of the pass
+    {
+        const int size = 12;
+        float h = 1.0e-3f;
+        auto pass = [&](float value, std::vector<float>* primal, std::vector<float>* tangent) {
+            TracerScene scene(TracerParameter::BoxOffset, value, true);
+            WavefrontTracer wavefront(nullptr);
+            primal->assign(size * size * 3, 0.0f);
+            tangent->assign(size * size * 3, 0.0f);
+            for (int sample = 0; sample < 16; sample++)
+            {
+                wavefront.render(scene, camera, size, size, sample, 3, primal->data(), tangent->data());
+            }
+        };
+        std::vector<float> primal, tangent, p, m, unused;
+        pass(0.0f, &primal, &tangent);
+        pass(h, &p, &unused);
+        pass(-h, &m, &unused);
+        int agree = 0, count = 0;
+        for (int i = 0; i < size * size * 3; i++)
+        {
+            float fd = (p[i] - m[i]) / (2.0f * h);
+            count++;
+            agree += fabs(fd - tangent[i]) < 0.05f * (1.0f + fabs(fd));
+        }
+        REQUIRE(0.9f * count < agree);
+    }
+}
+
+TEST_CASE("radix_sort", "") {
+    std::mt19937 rng(5);
+    WorkStealingPool pool(3);
+    RadixSort sort;
+    for (int n : { 0, 1, 1000, 50000 })
+    {
+        // full range keys, and keys with constant digits that skip passes
+        for (uint32_t mask : { 0xFFFFFFFFu, 0x00FF00F0u, 0u })
+        {
+            std::vector<uint32_t> keys(n);
+            for (uint32_t& k : keys)
+            {
+                k = rng() & mask;
+            }
+            std::vector<uint32_t> expected(n);
+            for (int i = 0; i < n; i++)
+            {
+                expected[i] = i;
+            }
+            std::stable_sort(expected.begin(), expected.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+            for (WorkStealingPool* p : { (WorkStealingPool*)nullptr, &pool })
+            {
+                sort.sort(keys.data(), n, p);
+                REQUIRE(sort.size() == n);
+                for (int i = 0; i < n; i++)
+                {
+                    REQUIRE(sort.order()[i] == expected[i]);
+                    REQUIRE(sort.sortedKeys()[i] == keys[expected[i]]);
+                }
+            }
+            if (mask == 0u)
+            {
+                REQUIRE(sort.passes() == 0);
+            }
+            if (mask == 0x00FF00F0u && 1000 <= n)
+            {
+                REQUIRE(sort.passes() == 2);
+            }
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,506 @@
+// Tests of the autodiff extensions (parallel and sparse derivatives, packets, var), kept apart from unittest.cpp
+// because they need Eigen and because the reverse mode var and the forward mode dual cannot share "using namespace autodiff".
+#include "catch_amalgamated.hpp"
+#include <autodiff/forward/dual.hpp>
+#include <autodiff/forward/dual/eigen.hpp>
+#include <autodiff/forward/real.hpp>
+#include <autodiff/forward/real/packet.hpp>
+#include <autodiff/forward/utils/gradient.hpp>
+#include <autodiff/forward/utils/sparse.hpp>
+#include <autodiff/reverse/var.hpp>
+#include <autodiff/reverse/var/eigen.hpp>
+#include "saka_optimize.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+// the forward mode at and wrt, the reverse mode ones are spelled rev::wrt
+using autodiff::detail::at;
+using autodiff::detail::wrt;
+namespace rev = autodiff::reverse::detail;
+
+// a dense, non-trivial vector function: every output depends on every input
+autodiff::VectorXdual coupled(const autodiff::VectorXdual& x, autodiff::dual scale)
+{
+    autodiff::VectorXdual F(x.size() + 2);
+    autodiff::dual sum = x.sum();
+    for (int i = 0; i < x.size(); i++)
+    {
+        F[i] = sin(x[i] * scale) * exp(0.1 * sum) + x[(i + 1) % x.size()] * x[i];
+    }
+    F[x.size()] = log(1.0 + x.squaredNorm());
+    F[x.size() + 1] = sum * sum * scale;
+    return F;
+}
+autodiff::dual2nd coupled_scalar(const autodiff::VectorXdual2nd& x, autodiff::dual2nd scale)
+{
+    autodiff::dual2nd u = 0.0;
+    for (int i = 0; i < x.size(); i++)
+    {
+        u += cos(x[i] * scale) * x[(i + 1) % x.size()] + exp(0.2 * x[i] * x[(i + 2) % x.size()]);
+    }
+    return u * u;
+}
+
+TEST_CASE("jacobian_parallel", "") {
+    autodiff::VectorXdual x(9);
+    for (int i = 0; i < x.size(); i++)
+    {
+        x[i] = 0.3 * i - 1.0;
+    }
+    autodiff::dual scale = 1.7;
+
+    Eigen::MatrixXd J = autodiff::jacobian(coupled, wrt(x, scale), at(x, scale));
+    for (size_t nthreads : { 1, 2, 4, 7 })
+    {
+        Eigen::MatrixXd Jp = autodiff::jacobian_parallel(coupled, wrt(x, scale), at(x, scale), nthreads);
+        REQUIRE(Jp.rows() == J.rows());
+        REQUIRE(Jp.cols() == J.cols());
+        REQUIRE(Jp == J); // each column is the same evaluation as in jacobian, so the result is identical
+    }
+
+    // the arguments of the caller are not seeded by the workers
+    for (int i = 0; i < x.size(); i++)
+    {
+        REQUIRE(x[i].grad == 0.0);
+    }
+    REQUIRE(scale.grad == 0.0);
+}
+
+TEST_CASE("hessian_parallel", "") {
+    autodiff::VectorXdual2nd x(7);
+    for (int i = 0; i < x.size(); i++)
+    {
+        x[i] = 0.25 * i - 0.8;
+    }
+    autodiff::dual2nd scale = 0.9;
+
+    autodiff::dual2nd u;
+    Eigen::VectorXd g;
+    Eigen::MatrixXd H = autodiff::hessian(coupled_scalar, wrt(x, scale), at(x, scale), u, g);
+    for (size_t nthreads : { 1, 3, 4, 8 })
+    {
+        autodiff::dual2nd up;
+        Eigen::VectorXd gp;
+        Eigen::MatrixXd Hp;
+        autodiff::hessian_parallel(coupled_scalar, wrt(x, scale), at(x, scale), up, gp, Hp, nthreads);
+        REQUIRE(double(up) == double(u));
+        REQUIRE(gp == g);
+        REQUIRE(Hp == H);
+        REQUIRE(Hp == Hp.transpose());
+    }
+}
+
+// a banded vector function (a nonlinear 1D stencil) with an extra output coupling the first and last inputs
+autodiff::VectorXdual stencil(const autodiff::VectorXdual& x)
+{
+    const int n = (int)x.size();
+    autodiff::VectorXdual F(n + 1);
+    for (int i = 0; i < n; i++)
+    {
+        autodiff::dual left = 0 < i ? x[i - 1] : autodiff::dual(0.0);
+        autodiff::dual right = i + 1 < n ? x[i + 1] : autodiff::dual(0.0);
+        F[i] = left - 2.0 * x[i] + right + 0.5 * sin(x[i]) * right;
+    }
+    // dF/dx[0] is zero at x[n - 1] == 0, but the entry is still structurally nonzero
+    F[n] = x[0] * x[n - 1];
+    return F;
+}
+autodiff::dual2nd rosenbrock(const autodiff::VectorXdual2nd& x)
+{
+    autodiff::dual2nd u = 0.0;
+    for (int i = 0; i + 1 < x.size(); i++)
+    {
+        u += 100.0 * (x[i + 1] - x[i] * x[i]) * (x[i + 1] - x[i] * x[i]) + (1.0 - x[i]) * (1.0 - x[i]);
+    }
+    return u;
+}
+
+TEST_CASE("jacobian_sparse", "") {
+    const int n = 12;
+    autodiff::VectorXdual x(n);
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = 0.1 * i - 0.4;
+    }
+    x[n - 1] = 0.0;
+
+    autodiff::SparsityPattern pattern = autodiff::jacobian_sparsity(stencil, wrt(x), at(x));
+    REQUIRE(pattern.rows == n + 1);
+    REQUIRE(pattern.cols == n);
+    REQUIRE(pattern.nonzeros[n] == std::vector<size_t>{ 0, n - 1 });
+
+    // columns sharing a row never share a color
+    std::vector<size_t> colors = autodiff::color_columns(pattern);
+    REQUIRE(colors.size() == n);
+    for (const auto& row : pattern.nonzeros)
+    {
+        for (size_t a = 0; a < row.size(); a++)
+        {
+            for (size_t b = a + 1; b < row.size(); b++)
+            {
+                REQUIRE(colors[row[a]] != colors[row[b]]);
+            }
+        }
+    }
+    size_t colorCount = *std::max_element(colors.begin(), colors.end()) + 1;
+    REQUIRE(colorCount < n);
+
+    Eigen::MatrixXd J = autodiff::jacobian(stencil, wrt(x), at(x));
+    Eigen::SparseMatrix<double> Js = autodiff::jacobian_sparse(stencil, wrt(x), at(x), pattern);
+    REQUIRE(Js.rows() == J.rows());
+    REQUIRE(Js.cols() == J.cols());
+    REQUIRE((Eigen::MatrixXd(Js) - J).cwiseAbs().maxCoeff() < 1.0e-12);
+
+    // every nonzero of the dense Jacobian is in the pattern
+    for (int row = 0; row < J.rows(); row++)
+    {
+        for (int col = 0; col < J.cols(); col++)
+        {
+            if (J(row, col) != 0.0)
+            {
+                const auto& cols = pattern.nonzeros[row];
+                REQUIRE(std::find(cols.begin(), cols.end(), (size_t)col) != cols.end());
+            }
+        }
+    }
+}
+
+TEST_CASE("hessian_sparse", "") {
+    const int n = 10;
+    autodiff::VectorXdual2nd x(n);
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = 0.15 * i - 0.7;
+    }
+
+    // tridiagonal, given in the lower triangle only for the off-diagonal entries
+    autodiff::SparsityPattern pattern;
+    pattern.rows = n;
+    pattern.cols = n;
+    pattern.nonzeros.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        if (0 < i)
+        {
+            pattern.nonzeros[i].push_back(i - 1);
+        }
+        pattern.nonzeros[i].push_back(i);
+    }
+
+    autodiff::dual2nd u;
+    Eigen::VectorXd g;
+    Eigen::MatrixXd H = autodiff::hessian(rosenbrock, wrt(x), at(x), u, g);
+    autodiff::dual2nd us;
+    Eigen::SparseMatrix<double> Hs;
+    autodiff::hessian_sparse(rosenbrock, wrt(x), at(x), pattern, us, Hs);
+    REQUIRE(double(us) == double(u));
+    REQUIRE(Hs.nonZeros() == 3 * n - 2);
+    REQUIRE((Eigen::MatrixXd(Hs) - H).cwiseAbs().maxCoeff() < 1.0e-12);
+}
+
+TEST_CASE("packet", "") {
+    using P = autodiff::Packet<double, 4>;
+    P a = std::array<double, 4>{ 1.0, -2.0, 3.0, 0.5 };
+    P b = 2.0;
+
+    P c = a * b + 1.0;
+    for (size_t k = 0; k < 4; k++)
+    {
+        REQUIRE(c[k] == a[k] * 2.0 + 1.0);
+    }
+    REQUIRE(alignof(P) == 32);
+
+    // comparisons hold only if they hold in all lanes, != is true if any lane differs
+    REQUIRE(a == a);
+    REQUIRE(!(a == b));
+    REQUIRE(a != b);
+    REQUIRE(P(1.0) < P(2.0));
+    REQUIRE(!(a < b)); // lane 2 is 3 > 2
+    REQUIRE(!(a >= b));
+    REQUIRE(a <= 3.0);
+    REQUIRE(!(a == 0.0));
+    REQUIRE(P(0.0) == 0.0);
+
+    std::array<bool, 4> mask = { true, false, true, false };
+    P s = autodiff::select(mask, a, b);
+    REQUIRE(s[0] == 1.0);
+    REQUIRE(s[1] == 2.0);
+    REQUIRE(s[2] == 3.0);
+    REQUIRE(s[3] == 2.0);
+}
+
+TEST_CASE("real_float_casts", "") {
+    // the recurrences of Real<N, float> stay in float, and agree with Real<N, double>
+    autodiff::Real<3, float> xf;
+    xf[0] = 0.7f;
+    xf[1] = 1.0f;
+    autodiff::Real<3, double> xd;
+    xd[0] = 0.7f;
+    xd[1] = 1.0;
+
+    auto uf = sqrt(xf) * exp(xf) / (1.0f + xf) + cbrt(xf) * log(xf) + pow(xf, 2.5f) + 2.0f / xf;
+    auto ud = sqrt(xd) * exp(xd) / (1.0 + xd) + cbrt(xd) * log(xd) + pow(xd, 2.5) + 2.0 / xd;
+    static_assert(std::is_same_v<decltype(uf), autodiff::Real<3, float>>);
+    for (size_t i = 0; i <= 3; i++)
+    {
+        REQUIRE(std::abs(uf[i] - ud[i]) < 1.0e-4 * (1.0 + std::abs(ud[i])));
+    }
+}
+
+// every lane of a RealPacket against the scalar Real at the same point, including lanes where x is zero
+TEST_CASE("real_packet", "") {
+    constexpr size_t W = 8;
+    using RP = autodiff::RealPacket<3, W>;
+    using R = autodiff::Real<3, double>;
+
+    const double xs[W] = { 0.3, 0.0, 1.7, 2.2, 0.0, 0.9, 1.1, 4.0 };
+    const double ys[W] = { 1.5, 2.5, 0.4, 1.2, 0.7, 3.0, 2.0, 0.6 };
+    RP x, y;
+    for (size_t k = 0; k < W; k++)
+    {
+        x[0][k] = xs[k];
+        x[1][k] = 1.0;
+        x[2][k] = 0.5;
+        y[0][k] = ys[k];
+        y[1][k] = -0.25;
+    }
+
+    auto check = [&](auto f) {
+        RP u = f(x, y);
+        for (size_t k = 0; k < W; k++)
+        {
+            R xk, yk;
+            for (size_t i = 0; i <= 3; i++)
+            {
+                xk[i] = x[i][k];
+                yk[i] = y[i][k];
+            }
+            R uk = f(xk, yk);
+            for (size_t i = 0; i <= 3; i++)
+            {
+                REQUIRE(std::isfinite(u[i][k]) == std::isfinite(uk[i]));
+                if (std::isfinite(uk[i]))
+                {
+                    REQUIRE(std::abs(u[i][k] - uk[i]) < 1.0e-12 * (1.0 + std::abs(uk[i])));
+                }
+            }
+        }
+    };
+
+    check([](auto x, auto y) { return x * y + exp(y) / (1.0 + y * y); });
+    check([](auto x, auto y) { return sin(y) * log(y) - cos(x) * tanh(x); });
+    check([](auto x, auto y) { return abs(x - 1.0) + min(x, y) * max(x, y); });
+
+    // the lanes where x is zero have zero derivatives, as the scalar Real, instead of NaN
+    check([](auto x, auto) { return sqrt(x); });
+    check([](auto x, auto) { return cbrt(x); });
+    check([](auto x, auto y) { return pow(x, y); });
+    check([](auto x, auto) { return pow(x, 1.5); });
+    check([](auto x, auto y) { return sqrt(x) * y + pow(x, 3); });
+
+    RP r = sqrt(x);
+    REQUIRE(r[1][1] == 0.0);
+    REQUIRE(r[1][4] == 0.0);
+    REQUIRE(std::abs(r[1][0] - 0.5 / std::sqrt(0.3)) < 1.0e-12);
+}
+
+
+// expressions are re-evaluated from the new values of the variables changed through update(value)
+TEST_CASE("var_update", "") {
+    autodiff::var x = 0.5;
+    autodiff::var y = 2.0;
+    autodiff::var ey = exp(y);           // depends on y only
+    autodiff::var s = sin(x) * y;        // shared by both terms of u
+    autodiff::var u = s * s + s / ey;
+
+    auto reference = [](double x, double y) {
+        double s = std::sin(x) * y;
+        return s * s + s / std::exp(y);
+    };
+    REQUIRE(double(u) == reference(0.5, 2.0));
+
+    x.update(1.25);
+    const size_t eyVersion = ey.expr->version;
+    u.update();
+    REQUIRE(std::abs(double(u) - reference(1.25, 2.0)) < 1.0e-12);
+    REQUIRE(ey.expr->version == eyVersion); // outside the cone of x, so not re-evaluated
+    REQUIRE(double(ey) == std::exp(2.0));
+
+    // the derivatives follow the new values
+    auto [dudx, dudy] = rev::derivatives(u, rev::wrt(x, y));
+    double sv = std::sin(1.25) * 2.0;
+    REQUIRE(std::abs(dudx - (2.0 * sv + 1.0 / std::exp(2.0)) * std::cos(1.25) * 2.0) < 1.0e-12);
+
+    y.update(-0.5);
+    u.update();
+    REQUIRE(std::abs(double(u) - reference(1.25, -0.5)) < 1.0e-12);
+    REQUIRE(ey.expr->version != eyVersion);
+
+    // an update without changes re-evaluates nothing
+    const size_t uVersion = u.expr->version;
+    u.update();
+    REQUIRE(u.expr->version == uVersion);
+}
+
+TEST_CASE("var_update_condition", "") {
+    autodiff::var x = 1.0;
+    autodiff::var y = 3.0;
+    autodiff::var w = 1.0; // only in the predicate
+    autodiff::var m = condition(x < y, x * x, 3.0 * y);
+    autodiff::var p = condition(w > 0.0, x, y);
+
+    REQUIRE(double(m) == 1.0);
+    REQUIRE(double(p) == 1.0);
+
+    // the predicate flips and the other branch is selected
+    x.update(5.0);
+    m.update();
+    REQUIRE(double(m) == 9.0);
+    auto [dmdx, dmdy] = rev::derivatives(m, rev::wrt(x, y));
+    REQUIRE(dmdx == 0.0);
+    REQUIRE(dmdy == 3.0);
+
+    // and back, with a branch value changed while it was not selected
+    x.update(2.0);
+    m.update();
+    REQUIRE(double(m) == 4.0);
+
+    // a predicate on a variable that neither branch depends on
+    p.update();
+    REQUIRE(double(p) == 2.0);
+    w.update(-1.0);
+    p.update();
+    REQUIRE(double(p) == 3.0);
+    auto [dpdx, dpdy] = rev::derivatives(p, rev::wrt(x, y));
+    REQUIRE(dpdx == 0.0);
+    REQUIRE(dpdy == 1.0);
+}
+
+// writing expr->val of a variable directly does not mark it as changed, so update() keeps the old values (see Variable::update)
+TEST_CASE("var_update_direct_write", "") {
+    autodiff::var x = 1.0;
+    autodiff::var u = x * x + 1.0;
+
+    x.expr->val = 3.0;
+    u.update();
+    REQUIRE(double(u) == 2.0);
+
+    x.update(3.0);
+    u.update();
+    REQUIRE(double(u) == 10.0);
+}
+
+// single sweep jacobian and vjp against one derivatives() sweep per output
+TEST_CASE("var_jacobian", "") {
+    autodiff::var x = 0.7;
+    autodiff::var y = -1.3;
+    autodiff::var z = 2.1;
+    autodiff::var shared = sin(x * y) + z;
+    std::array<autodiff::var, 4> ys = {
+        shared * shared,
+        exp(shared) / (1.0 + z * z),
+        condition(x < y, x, pow(y, 2.0) * z),
+        atan2(x, z) + abs(y) + sqrt(z) + 3.0,
+    };
+
+    auto J = rev::jacobian(ys, rev::wrt(x, y, z));
+    for (size_t k = 0; k < ys.size(); k++)
+    {
+        auto d = rev::derivatives(ys[k], rev::wrt(x, y, z));
+        for (size_t i = 0; i < 3; i++)
+        {
+            REQUIRE(std::abs(J[k][i] - d[i]) < 1.0e-12 * (1.0 + std::abs(d[i])));
+        }
+    }
+
+    std::array<double, 4> v = { 0.5, -2.0, 1.5, 0.25 };
+    auto g = rev::vjp(ys, v, rev::wrt(x, y, z));
+    for (size_t i = 0; i < 3; i++)
+    {
+        double ref = 0.0;
+        for (size_t k = 0; k < ys.size(); k++)
+        {
+            ref += v[k] * rev::derivatives(ys[k], rev::wrt(x, y, z))[i];
+        }
+        REQUIRE(std::abs(g[i] - ref) < 1.0e-12 * (1.0 + std::abs(ref)));
+    }
+
+    // a variable outside the tree has zero derivatives
+    autodiff::var unused = 1.0;
+    auto Ju = rev::jacobian(ys, rev::wrt(unused));
+    for (size_t k = 0; k < ys.size(); k++)
+    {
+        REQUIRE(Ju[k][0] == 0.0);
+    }
+
+    // jacobian leaves gradients bound by an earlier derivatives() setup alone
+    {
+        autodiff::var a = 2.0;
+        autodiff::var b = 3.0;
+        autodiff::var w = a * b;
+        double ga = 0.0, gw = 0.0;
+        a.expr->bind_value(&ga);
+        w.expr->bind_value(&gw);
+        auto Jb = rev::jacobian(std::array<autodiff::var, 1>{ w + a }, rev::wrt(a, b));
+        REQUIRE(Jb[0][0] == 4.0);
+        REQUIRE(Jb[0][1] == 2.0);
+        REQUIRE(ga == 0.0);
+        REQUIRE(gw == 0.0);
+        a.expr->bind_value(nullptr);
+        w.expr->bind_value(nullptr);
+    }
+
+    // the Eigen overloads
+    autodiff::VectorXvar xs(3);
+    xs << 0.4, 1.1, -0.6;
+    autodiff::VectorXvar F(2);
+    F << xs[0] * xs[1] * xs[2], sin(xs[0]) + xs[1] * xs[1];
+    Eigen::MatrixXd Je = autodiff::reverse::detail::jacobian(F, xs);
+    Eigen::VectorXd w(2);
+    w << 3.0, -1.0;
+    Eigen::VectorXd ge = autodiff::reverse::detail::vjp(F, w, xs);
+    for (int k = 0; k < 2; k++)
+    {
+        Eigen::VectorXd d = autodiff::reverse::detail::gradient(F[k], xs);
+        for (int i = 0; i < 3; i++)
+        {
+            REQUIRE(std::abs(Je(k, i) - d[i]) < 1.0e-12);
+        }
+    }
+    REQUIRE((ge - Je.transpose() * w).cwiseAbs().maxCoeff() < 1.0e-12);
+}
+
+TEST_CASE("objective_var", "") {
+    // make_objective_var against make_objective_dval on the Rosenbrock function of the optimize test in unittest.cpp
+    auto rosenbrock = [](auto x) -> typename std::remove_const<typename std::remove_reference<decltype(x[0])>::type>::type {
+        auto a = 1.0f - x[0];
+        auto b = x[1] - x[0] * x[0];
+        return a * a + b * b * 100.0f;
+    };
+    saka::Objective viaVar = saka::make_objective_var<autodiff::var>([&](const autodiff::var* x) { return rosenbrock(x); }, 2);
+    saka::Objective viaDval = saka::make_objective_dval([&](const saka::dval* x) { return rosenbrock(x); }, 2);
+    for (float x0 : { -1.2f, 0.0f, 0.7f, 2.0f })
+    {
+        float x[2] = { x0, 1.0f };
+        float g0[2], g1[2];
+        float f0 = viaVar(x, g0);
+        float f1 = viaDval(x, g1);
+        REQUIRE(std::abs(f0 - f1) < 1.0e-5f * (1.0f + f1));
+        REQUIRE(std::abs(g0[0] - g1[0]) < 1.0e-4f * (1.0f + std::abs(g1[0])));
+        REQUIRE(std::abs(g0[1] - g1[1]) < 1.0e-4f * (1.0f + std::abs(g1[1])));
+    }
+
+    // repeated evaluations start from zero gradients
+    float x[2] = { 2.0f, 1.0f };
+    float g[2];
+    for (int i = 0; i < 3; i++)
+    {
+        REQUIRE(viaVar(x, g) == 901.0f);
+        REQUIRE(g[0] == 2402.0f);
+        REQUIRE(g[1] == -600.0f);
+    }
+}
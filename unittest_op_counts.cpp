@@ -0,0 +1,80 @@
+#include "catch_amalgamated.hpp"
+#include <cmath>
+#include <random>
+
+// Only this translation unit is instrumented, the rest of the suite runs the uncounted dval (see saka.h)
+#define SAKA_COUNT_OPS
+#include "saka.h"
+
+using namespace saka;
+
+TEST_CASE("op_counts", "") {
+    dval x = 1.0f; x.requires_grad();
+    dval y = 2.0f;
+
+    {
+        OpCountScope scope;
+        dval u = x * y;
+        OpCounts c = scope.counts();
+        REQUIRE(c.primal.mul == 1);
+        REQUIRE(c.primal.total() == 1);
+        REQUIRE(c.tangent.mul == 2);
+        REQUIRE(c.tangent.add == 1);
+        REQUIRE(c.tangent.total() == 3);
+        REQUIRE(u.v == 2.0f);
+        REQUIRE(u.g == 2.0f);
+    }
+    {
+        OpCountScope scope;
+        dval u = exp(x / y);
+        OpCounts c = scope.counts();
+        REQUIRE(c.primal.div == 1);
+        REQUIRE(c.primal.transcendental == 1);
+        REQUIRE(c.tangent.div == 2);
+        REQUIRE(c.tangent.transcendental == 0); // exp reuses its value
+        REQUIRE(fabsf(u.v - expf(0.5f)) < 1.0e-6f);
+        REQUIRE(fabsf(u.g - 0.5f * expf(0.5f)) < 1.0e-6f);
+    }
+
+    // nested scopes see the operations of the inner ones
+    {
+        OpCountScope outer;
+        {
+            OpCountScope inner;
+            dval u = x + y;
+            REQUIRE(u.v == 3.0f);
+        }
+        REQUIRE(outer.counts().primal.add == 1);
+    }
+
+    // dvaln counts the tangent per lane
+    {
+        dvaln<4> a = 1.0f; a.requires_grad(0);
+        dvaln<4> b = 2.0f; b.requires_grad(3);
+        OpCountScope scope;
+        dvaln<4> u = a * b;
+        OpCounts c = scope.counts();
+        REQUIRE(c.primal.mul == 1);
+        REQUIRE(c.tangent.mul == 8);
+        REQUIRE(c.tangent.add == 4);
+        REQUIRE(u.g[0] == 2.0f);
+        REQUIRE(u.g[3] == 1.0f);
+    }
+
+    std::mt19937 rng;
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    dval3 wi = { uniform(rng), uniform(rng), uniform(rng) };
+    dval3 n = { 0.0f, 0.0f, 1.0f };
+    wi.x.requires_grad();
+    {
+        OpCountScope scope;
+        dval3 wo = refraction_norm_free(wi, n, 1.2f);
+        REQUIRE(0 < scope.counts().primal.total());
+        REQUIRE(0 < scope.counts().tangent.total());
+
+        // wi is above the surface, so the refracted direction goes below it, and only its x moves with wi.x
+        REQUIRE(wo.z.v < 0.0f);
+        REQUIRE(wo.x.g == -1.0f);
+        REQUIRE(wo.y.g == 0.0f);
+    }
+}